@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <mutex>
+
+#include "buffer_pool.h"
+
+using std::lock_guard;
+
+PooledBuffer::PooledBuffer(
+    BufferPool* pool,
+    uint8_t* data,
+    uint32_t capacity
+) : pool(pool)
+  , data(data)
+  , capacity(capacity)
+  , size(0) {
+}
+
+void PooledBuffer::Destroy() {
+  pool->release(this);
+}
+
+static size_t sizeClassIndex(size_t classSize) {
+  return std::countr_zero(classSize) - BufferPool::kMinClassShift;
+}
+
+static uint8_t* allocateStorage(size_t size) {
+  return static_cast<uint8_t*>(std::aligned_alloc(BufferPool::kAlignment, size));
+}
+
+BufferPool::BufferPool(size_t highWaterMark) : highWaterMark(highWaterMark) {
+}
+
+BufferPool::~BufferPool() {
+  for (auto& freeList : freeLists) {
+    for (auto buffer : freeList) {
+      std::free(buffer->data);
+      delete buffer;
+    }
+  }
+}
+
+PooledBuffer* BufferPool::acquire(uint32_t capacity) {
+  size_t classSize = std::bit_ceil(
+      std::max<size_t>(capacity, size_t(1) << kMinClassShift)
+  );
+  if (classSize > size_t(1) << kMaxClassShift) {
+    // Too large to be worth keeping around, hand out an exact-fit buffer.
+    {
+      lock_guard guard(lock);
+      counters.misses++;
+    }
+    size_t size = (capacity + kAlignment - 1) & ~(kAlignment - 1);
+    auto data = allocateStorage(size);
+    if (!data) {
+      return nullptr;
+    }
+    return new PooledBuffer(this, data, capacity);
+  }
+
+  auto& freeList = freeLists[sizeClassIndex(classSize)];
+  {
+    lock_guard guard(lock);
+    if (!freeList.empty()) {
+      auto buffer = freeList.back();
+      freeList.pop_back();
+      counters.hits++;
+      counters.retainedBytes -= buffer->capacity;
+      buffer->size = 0;
+      return buffer;
+    }
+    counters.misses++;
+  }
+
+  auto data = allocateStorage(classSize);
+  if (!data) {
+    return nullptr;
+  }
+  return new PooledBuffer(this, data, classSize);
+}
+
+void BufferPool::release(PooledBuffer* buffer) {
+  if (buffer->capacity <= size_t(1) << kMaxClassShift) {
+    lock_guard guard(lock);
+    if (counters.retainedBytes + buffer->capacity <= highWaterMark) {
+      freeLists[sizeClassIndex(buffer->capacity)].push_back(buffer);
+      counters.retainedBytes += buffer->capacity;
+      return;
+    }
+  }
+  std::free(buffer->data);
+  delete buffer;
+}
+
+BufferPoolStats BufferPool::stats() {
+  lock_guard guard(lock);
+  return counters;
+}
+
+void BufferPool::resetStats() {
+  lock_guard guard(lock);
+  counters.hits = 0;
+  counters.misses = 0;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <glib.h>
+#include "content_decryption_module.h"
+
+using std::array;
+using std::mutex;
+using std::vector;
+
+struct BufferPool;
+
+// A cdm::Buffer whose storage comes from a BufferPool. The storage is
+// cache-line aligned and left uninitialized; the CDM overwrites it anyway.
+struct PooledBuffer final : cdm::Buffer {
+  G_GNUC_INTERNAL
+  PooledBuffer(BufferPool* pool, uint8_t* data, uint32_t capacity);
+
+  G_GNUC_INTERNAL
+  void Destroy() final;
+
+  [[nodiscard]] uint32_t Capacity() const final { return capacity; }
+  uint8_t* Data() final { return data; }
+  void SetSize(uint32_t size) final { this->size = size; }
+  [[nodiscard]] uint32_t Size() const final { return size; }
+
+  BufferPool* pool;
+  uint8_t* data;
+  uint32_t capacity;
+  uint32_t size;
+};
+
+struct BufferPoolStats {
+  uint64_t hits;
+  uint64_t misses;
+  size_t retainedBytes;
+};
+
+// Keeps released buffers in power-of-two size classes so that steady-state
+// decrypts do not hit the heap. At most |highWaterMark| bytes are retained;
+// anything released above that is freed straight away.
+struct BufferPool {
+  static constexpr size_t kAlignment = 64;
+  static constexpr unsigned kMinClassShift = 12;
+  static constexpr unsigned kMaxClassShift = 26;
+  static constexpr size_t kDefaultHighWaterMark = 16 * 1024 * 1024;
+
+  G_GNUC_INTERNAL
+  explicit BufferPool(size_t highWaterMark = kDefaultHighWaterMark);
+  G_GNUC_INTERNAL
+  ~BufferPool();
+
+  G_GNUC_INTERNAL
+  PooledBuffer* acquire(uint32_t capacity);
+  G_GNUC_INTERNAL
+  void release(PooledBuffer* buffer);
+
+  G_GNUC_INTERNAL
+  BufferPoolStats stats();
+  // Zeroes the hit and miss counts. The retained buffers are kept.
+  G_GNUC_INTERNAL
+  void resetStats();
+
+  size_t highWaterMark;
+
+ private:
+  static constexpr unsigned kClassCount = kMaxClassShift - kMinClassShift + 1;
+
+  mutex lock;
+  array<vector<PooledBuffer*>, kClassCount> freeLists;
+  BufferPoolStats counters = {};
+};
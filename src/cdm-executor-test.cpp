@@ -0,0 +1,115 @@
+#include <glib.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "cdm_executor.h"
+
+using std::atomic;
+using std::thread;
+using std::vector;
+
+static const unsigned kProducers = 8;
+static const unsigned kCallsPerProducer = 20000;
+
+// Every task runs on the executor thread, one at a time, and posted tasks from
+// one producer run in the order they were posted.
+static void
+test_serialized (void)
+{
+  CdmExecutor executor;
+  uint64_t unguarded = 0;
+  vector<unsigned> lastPosted(kProducers, 0);
+
+  vector<thread> producers;
+  for (auto p = 0U; p < kProducers; p++) {
+    producers.emplace_back([&, p]() {
+      for (auto i = 1U; i <= kCallsPerProducer; i++) {
+        if (i % 2) {
+          executor.call(CdmWork::Decrypt, [&]() {
+            g_assert_true(executor.onExecutorThread());
+            unguarded++;
+          });
+        } else {
+          executor.post(CdmWork::Housekeeping, [&, p, i]() {
+            g_assert_true(executor.onExecutorThread());
+            g_assert_cmpuint(lastPosted[p], <, i);
+            lastPosted[p] = i;
+            unguarded++;
+          });
+        }
+      }
+    });
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+
+  // Queued behind everything posted above.
+  executor.call(CdmWork::Housekeeping, []() { });
+  g_assert_cmpuint(unguarded, ==, kProducers * kCallsPerProducer);
+  auto stats = executor.stats();
+  g_assert_cmpuint(stats.decryptRequests, ==, kProducers * kCallsPerProducer / 2);
+  g_assert_cmpuint(stats.decryptBatches, <=, stats.decryptRequests);
+  g_print("%lu decrypts in %lu batches\n",
+      (unsigned long) stats.decryptRequests,
+      (unsigned long) stats.decryptBatches);
+}
+
+// Decrypts queued behind a backlog of housekeeping overtake it.
+static void
+test_decrypt_priority (void)
+{
+  CdmExecutor executor;
+  atomic<bool> release = false;
+  vector<char> order;
+
+  executor.post(CdmWork::Housekeeping, [&]() {
+    while (!release.load()) {
+      std::this_thread::yield();
+    }
+  });
+  for (auto i = 0; i < 4; i++) {
+    executor.post(CdmWork::Housekeeping, [&]() { order.push_back('h'); });
+  }
+  vector<thread> decrypts;
+  for (auto i = 0; i < 4; i++) {
+    decrypts.emplace_back([&]() {
+      executor.call(CdmWork::Decrypt, [&]() { order.push_back('d'); });
+    });
+  }
+  // Give the decrypts time to be queued before unblocking the executor.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  release = true;
+  for (auto& decrypt : decrypts) {
+    decrypt.join();
+  }
+  executor.call(CdmWork::Housekeeping, []() { });
+
+  g_assert_cmpuint(order.size(), ==, 8);
+  for (auto i = 0; i < 8; i++) {
+    g_assert_cmpint(order[i], ==, i < 4 ? 'd' : 'h');
+  }
+}
+
+// Calls made from the executor thread run inline rather than deadlocking.
+static void
+test_reentrant_call (void)
+{
+  CdmExecutor executor;
+  auto inner = false;
+  executor.call(CdmWork::Housekeeping, [&]() {
+    executor.call(CdmWork::Decrypt, [&]() { inner = true; });
+  });
+  g_assert_true(inner);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  test_serialized ();
+  test_decrypt_priority ();
+  test_reentrant_call ();
+  return 0;
+}
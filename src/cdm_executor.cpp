@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: MIT
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "cdm_executor.h"
+
+// The executor whose thread this is, if any.
+static thread_local const CdmExecutor* currentExecutor = nullptr;
+
+// Set by the executor once it is done with a task a thread is waiting for.
+// Lives as long as the waiting thread, which cannot exit while it waits, so
+// the executor may still touch it after the waiter has moved on.
+static thread_local atomic<bool> taskDone = false;
+
+namespace {
+
+struct PostedTask final : CdmTask {
+  explicit PostedTask(function<void()> work) : work(std::move(work)) { }
+
+  void run() final {
+    work();
+    delete this;
+  }
+
+  void discard() final {
+    delete this;
+  }
+
+  function<void()> work;
+};
+
+struct WaitingTask final : CdmTask {
+  WaitingTask(void* func, void (*invoke)(void*), atomic<bool>* done)
+    : func(func)
+    , invoke(invoke)
+    , done(done) { }
+
+  void run() final {
+    invoke(func);
+    finish();
+  }
+
+  void discard() final {
+    finish();
+  }
+
+  void finish() {
+    auto signal = done;
+    signal->store(true, std::memory_order_release);
+    signal->notify_one();
+  }
+
+  void* func;
+  void (*invoke)(void*);
+  atomic<bool>* done;
+};
+
+}
+
+// Detaches everything pushed onto |stack| so far, oldest first.
+static CdmTask* takeAll(atomic<CdmTask*>& stack) {
+  auto head = stack.exchange(nullptr, std::memory_order_acquire);
+  CdmTask* ordered = nullptr;
+  while (head) {
+    auto next = head->next;
+    head->next = ordered;
+    ordered = head;
+    head = next;
+  }
+  return ordered;
+}
+
+static void discardAll(CdmTask* task) {
+  while (task) {
+    auto next = task->next;
+    task->discard();
+    task = next;
+  }
+}
+
+CdmExecutor::CdmExecutor(optional<unsigned> cpu) {
+  worker = thread([this, cpu] { loop(cpu); });
+}
+
+CdmExecutor::~CdmExecutor() {
+  stopping.store(true);
+  wakeups.fetch_add(1, std::memory_order_release);
+  wakeups.notify_one();
+  worker.join();
+  discardAll(takeAll(decrypts));
+  discardAll(takeAll(housekeeping));
+}
+
+void CdmExecutor::post(CdmWork kind, function<void()> work) {
+  push(kind, new PostedTask(std::move(work)));
+}
+
+void CdmExecutor::runAndWait(CdmWork kind, void* func, void (*invoke)(void*)) {
+  taskDone.store(false, std::memory_order_relaxed);
+  WaitingTask task(func, invoke, &taskDone);
+  push(kind, &task);
+  while (!taskDone.load(std::memory_order_acquire)) {
+    taskDone.wait(false, std::memory_order_acquire);
+  }
+}
+
+void CdmExecutor::push(CdmWork kind, CdmTask* task) {
+  if (stopping.load()) {
+    task->discard();
+    return;
+  }
+  auto& stack = kind == CdmWork::Decrypt ? decrypts : housekeeping;
+  auto head = stack.load(std::memory_order_relaxed);
+  do {
+    task->next = head;
+  } while (!stack.compare_exchange_weak(
+      head,
+      task,
+      std::memory_order_release,
+      std::memory_order_relaxed
+  ));
+  wakeups.fetch_add(1, std::memory_order_release);
+  wakeups.notify_one();
+}
+
+bool CdmExecutor::onExecutorThread() const {
+  return currentExecutor == this;
+}
+
+CdmExecutorStats CdmExecutor::stats() const {
+  return { decryptBatches.load(), decryptRequests.load() };
+}
+
+void CdmExecutor::resetStats() {
+  decryptBatches = 0;
+  decryptRequests = 0;
+}
+
+bool CdmExecutor::runDecrypts() {
+  auto task = takeAll(decrypts);
+  if (!task) {
+    return false;
+  }
+  uint64_t count = 0;
+  while (task) {
+    auto next = task->next;
+    task->run();
+    task = next;
+    count++;
+  }
+  decryptBatches.fetch_add(1, std::memory_order_relaxed);
+  decryptRequests.fetch_add(count, std::memory_order_relaxed);
+  return true;
+}
+
+void CdmExecutor::loop(optional<unsigned> cpu) {
+  currentExecutor = this;
+#ifdef __linux__
+  pthread_setname_np(pthread_self(), "widevine-cdm");
+  if (cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu.value(), &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+#else
+  (void) cpu;
+#endif
+
+  CdmTask* pending = nullptr;
+  for (;;) {
+    auto seen = wakeups.load(std::memory_order_acquire);
+    if (stopping.load()) {
+      break;
+    }
+    runDecrypts();
+    if (!pending) {
+      pending = takeAll(housekeeping);
+    }
+    // Housekeeping runs one task at a time so that decrypts queued meanwhile
+    // do not have to wait for the whole backlog.
+    if (pending) {
+      auto task = pending;
+      pending = task->next;
+      task->run();
+      continue;
+    }
+    wakeups.wait(seen, std::memory_order_acquire);
+  }
+  discardAll(pending);
+}
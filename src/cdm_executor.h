@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <type_traits>
+
+#include <glib.h>
+
+using std::atomic;
+using std::function;
+using std::optional;
+using std::thread;
+
+// Which queue a task goes to. Decrypts are latency sensitive and always run
+// before pending housekeeping (session management, timers, ...).
+enum class CdmWork {
+  Decrypt,
+  Housekeeping,
+};
+
+struct CdmTask {
+  virtual ~CdmTask() = default;
+
+  // Runs the task. Called at most once, on the executor thread.
+  virtual void run() = 0;
+  // Releases the task without running it, once the executor has stopped.
+  virtual void discard() = 0;
+
+  CdmTask* next = nullptr;
+};
+
+struct CdmExecutorStats {
+  uint64_t decryptBatches;
+  uint64_t decryptRequests;
+};
+
+// The thread that owns a CDM instance. The Widevine CDM is not thread safe, so
+// every call into it goes through here. Producers push onto lock-free
+// intrusive stacks that the executor swaps out whole on each wakeup and
+// reverses into FIFO order. All decrypts queued at that point run as one
+// batch, and queued decrypts are checked for again before every housekeeping
+// task.
+//
+// Calls made from the executor thread itself, e.g. from a Host callback the
+// CDM invokes while it is busy, run inline instead of being queued.
+struct CdmExecutor {
+  // Pins the thread to |cpu| if set.
+  G_GNUC_INTERNAL
+  explicit CdmExecutor(optional<unsigned> cpu = std::nullopt);
+  // Stops the thread. Tasks still queued at that point are discarded.
+  G_GNUC_INTERNAL
+  ~CdmExecutor();
+
+  CdmExecutor(const CdmExecutor&) = delete;
+  CdmExecutor& operator=(const CdmExecutor&) = delete;
+
+  // Queues |work| and returns right away.
+  G_GNUC_INTERNAL
+  void post(CdmWork kind, function<void()> work);
+
+  // Runs |func| on the executor thread and waits for it. Does not allocate.
+  // If the executor stops before getting to it, |func| is not run.
+  template <typename Func>
+  void call(CdmWork kind, Func&& func) {
+    static_assert(std::is_void_v<std::invoke_result_t<Func&>>);
+    if (onExecutorThread()) {
+      func();
+      return;
+    }
+    runAndWait(kind, &func, [](void* func) {
+      (*static_cast<std::remove_reference_t<Func>*>(func))();
+    });
+  }
+
+  G_GNUC_INTERNAL
+  bool onExecutorThread() const;
+
+  G_GNUC_INTERNAL
+  CdmExecutorStats stats() const;
+  G_GNUC_INTERNAL
+  void resetStats();
+
+ private:
+  G_GNUC_INTERNAL
+  void runAndWait(CdmWork kind, void* func, void (*invoke)(void*));
+  G_GNUC_INTERNAL
+  void push(CdmWork kind, CdmTask* task);
+  G_GNUC_INTERNAL
+  void loop(optional<unsigned> cpu);
+  G_GNUC_INTERNAL
+  bool runDecrypts();
+
+  atomic<CdmTask*> decrypts = nullptr;
+  atomic<CdmTask*> housekeeping = nullptr;
+  // Bumped after every push so the executor never sleeps on queued work.
+  atomic<uint32_t> wakeups = 0;
+  atomic<bool> stopping = false;
+
+  atomic<uint64_t> decryptBatches = 0;
+  atomic<uint64_t> decryptRequests = 0;
+
+  thread worker;
+};
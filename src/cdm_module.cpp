@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: MIT
+
+#include <gio/gio.h>
+#include <gst/gst.h>
+
+#include <vector>
+
+#include "cdm_module.h"
+
+using std::vector;
+
+GST_DEBUG_CATEGORY_EXTERN(sparkle_widevine_debug_cat);
+#define GST_CAT_DEFAULT sparkle_widevine_debug_cat
+
+// Browsers unpack an update as a series of file operations; reloading waits
+// for them to be quiet for this long.
+static const guint kSettleMs = 1000;
+
+using InitializeCdmModuleFunc = void (*)();
+using GetCdmVersionFunc = const char* (*)();
+
+shared_ptr<CdmModule> CdmModule::initialize(GModule* handle, const string& path) {
+  void* initialize;
+  void* create;
+  if (!g_module_symbol(handle, G_STRINGIFY(INITIALIZE_CDM_MODULE), &initialize)
+      || !g_module_symbol(handle, G_STRINGIFY(CreateCdmInstance), &create)) {
+    g_module_close(handle);
+    return nullptr;
+  }
+  void* deinitialize = nullptr;
+  g_module_symbol(handle, G_STRINGIFY(DeinitializeCdmModule), &deinitialize);
+  void* getVersion = nullptr;
+  const char* version = nullptr;
+  if (g_module_symbol(handle, G_STRINGIFY(GetCdmVersion), &getVersion)) {
+    version = reinterpret_cast<GetCdmVersionFunc>(getVersion)();
+  }
+
+  reinterpret_cast<InitializeCdmModuleFunc>(initialize)();
+  return shared_ptr<CdmModule>(new CdmModule(
+      handle,
+      path,
+      version ? version : "",
+      reinterpret_cast<CreateCdmInstanceFunc>(create),
+      reinterpret_cast<DeinitializeCdmModuleFunc>(deinitialize)
+  ));
+}
+
+CdmModule::CdmModule(
+    GModule* handle,
+    const string& path,
+    const string& version,
+    CreateCdmInstanceFunc create,
+    DeinitializeCdmModuleFunc deinitialize
+)
+  : handle(handle)
+  , path(path)
+  , version(version)
+  , create(create)
+  , deinitialize(deinitialize) {
+}
+
+CdmModule::~CdmModule() {
+  GST_INFO("unloading cdm@%s", path.c_str());
+  if (deinitialize) {
+    deinitialize();
+  }
+  g_module_close(handle);
+}
+
+cdm::ContentDecryptionModule_10* CdmModule::createInstance(
+    const string& keySystem,
+    GetCdmHostFunc getHost,
+    void* userData
+) {
+  auto instance = create(
+      cdm::ContentDecryptionModule_10::kVersion,
+      keySystem.data(),
+      keySystem.size(),
+      getHost,
+      userData
+  );
+  return static_cast<cdm::ContentDecryptionModule_10*>(instance);
+}
+
+namespace {
+
+struct Watch {
+  GMainContext* context;
+  string path;
+  function<string()> changed;
+  vector<GFileMonitor*> monitors;
+  GSource* settle = nullptr;
+};
+
+}
+
+static void watch_directories(Watch* watch);
+
+static gboolean on_settled(gpointer data) {
+  auto watch = static_cast<Watch*>(data);
+  g_source_unref(watch->settle);
+  watch->settle = nullptr;
+
+  auto path = watch->changed();
+  if (path != watch->path) {
+    watch->path = path;
+    watch_directories(watch);
+  }
+  return G_SOURCE_REMOVE;
+}
+
+static void on_changed(
+    GFileMonitor*,
+    GFile* file,
+    GFile*,
+    GFileMonitorEvent event,
+    gpointer data
+) {
+  if (event == G_FILE_MONITOR_EVENT_ATTRIBUTE_CHANGED) {
+    return;
+  }
+  auto watch = static_cast<Watch*>(data);
+  g_autofree gchar *name = g_file_get_path(file);
+  GST_LOG("%s changed (%d)", name, event);
+  if (watch->settle) {
+    g_source_destroy(watch->settle);
+    g_source_unref(watch->settle);
+  }
+  watch->settle = g_timeout_source_new(kSettleMs);
+  g_source_set_callback(watch->settle, on_settled, watch, nullptr);
+  g_source_attach(watch->settle, watch->context);
+}
+
+static void watch_directories(Watch* watch) {
+  for (auto monitor : watch->monitors) {
+    g_file_monitor_cancel(monitor);
+    g_object_unref(monitor);
+  }
+  watch->monitors.clear();
+
+  // A blob replaced in place changes its own directory; an update unpacked
+  // next to the version in use changes the directory holding the versions.
+  // That is the parent of the blob's directory in Firefox's
+  // gmp-widevinecdm/<version>/ layout, and the parent of the version above
+  // _platform_specific in Chromium's
+  // WidevineCdm/<version>/_platform_specific/<platform>/ one.
+  g_autoptr(GFile) blob = g_file_new_for_path(watch->path.c_str());
+  g_autoptr(GFile) directory = g_file_get_parent(blob);
+  g_autoptr(GFile) version = directory
+      ? static_cast<GFile*>(g_object_ref(directory))
+      : nullptr;
+  g_autoptr(GFile) platforms = directory ? g_file_get_parent(directory) : nullptr;
+  g_autofree gchar *platformsName = platforms
+      ? g_file_get_basename(platforms)
+      : nullptr;
+  if (g_strcmp0(platformsName, "_platform_specific") == 0) {
+    g_object_unref(version);
+    version = g_file_get_parent(platforms);
+  }
+  g_autoptr(GFile) versions = version ? g_file_get_parent(version) : nullptr;
+  for (auto dir : { directory, versions }) {
+    if (!dir) {
+      continue;
+    }
+    g_autoptr(GError) error = nullptr;
+    auto monitor = g_file_monitor_directory(
+        dir,
+        G_FILE_MONITOR_WATCH_MOVES,
+        nullptr,
+        &error
+    );
+    if (!monitor) {
+      GST_WARNING("cannot watch for cdm updates: %s", error->message);
+      continue;
+    }
+    g_signal_connect(monitor, "changed", G_CALLBACK(on_changed), watch);
+    watch->monitors.push_back(monitor);
+  }
+  GST_INFO("watching cdm@%s for updates", watch->path.c_str());
+}
+
+static gpointer watch_thread(gpointer data) {
+  auto watch = static_cast<Watch*>(data);
+  g_main_context_push_thread_default(watch->context);
+  watch_directories(watch);
+  auto loop = g_main_loop_new(watch->context, FALSE);
+  g_main_loop_run(loop);
+  return nullptr;
+}
+
+void watchCdmModule(const string& path, function<string()> changed) {
+  auto watch = new Watch { g_main_context_new(), path, std::move(changed), {} };
+  g_thread_unref(g_thread_new("widevine-cdm-watch", watch_thread, watch));
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+
+#include <glib.h>
+#include <gmodule.h>
+
+#include "content_decryption_module.h"
+
+using std::function;
+using std::shared_ptr;
+using std::string;
+
+// A loaded CDM blob. Every system holds a reference to the module its CDM
+// instance comes from, so that a module replaced by a newer one is only
+// deinitialized and unloaded once the last system using it is destroyed.
+struct CdmModule {
+  // Takes ownership of |handle|, opened from |path|, and initializes the
+  // module. Returns nullptr, closing |handle|, if it is not a CDM.
+  G_GNUC_INTERNAL
+  static shared_ptr<CdmModule> initialize(GModule* handle, const string& path);
+
+  CdmModule(const CdmModule&) = delete;
+  CdmModule& operator=(const CdmModule&) = delete;
+  G_GNUC_INTERNAL
+  ~CdmModule();
+
+  // Returns a new ContentDecryptionModule_10, or nullptr.
+  G_GNUC_INTERNAL
+  cdm::ContentDecryptionModule_10* createInstance(
+      const string& keySystem,
+      GetCdmHostFunc getHost,
+      void* userData
+  );
+
+  GModule* const handle;
+  const string path;
+  // What the blob's GetCdmVersion() reports, empty if it does not export it.
+  const string version;
+
+ private:
+  using CreateCdmInstanceFunc = void* (*)(
+      int cdm_interface_version,
+      const char* key_system,
+      uint32_t key_system_size,
+      GetCdmHostFunc get_cdm_host_func,
+      void* user_data
+  );
+  using DeinitializeCdmModuleFunc = void (*)();
+
+  G_GNUC_INTERNAL
+  CdmModule(
+      GModule* handle,
+      const string& path,
+      const string& version,
+      CreateCdmInstanceFunc create,
+      DeinitializeCdmModuleFunc deinitialize
+  );
+
+  CreateCdmInstanceFunc create;
+  DeinitializeCdmModuleFunc deinitialize;
+};
+
+// Watches the directory of the blob at |path|, and the one browsers unpack
+// new versions of the CDM into, from a thread of its own. Once changes there
+// have settled, |changed| runs on that thread and returns the path of the
+// blob to watch from then on. Never stops.
+G_GNUC_INTERNAL
+void watchCdmModule(const string& path, function<string()> changed);
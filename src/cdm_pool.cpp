@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cdm_pool.h"
+#include "system.h"
+
+using std::lock_guard;
+using std::unique_lock;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+static mutex sharedLock;
+static CdmPool* sharedPool = nullptr;
+static pid_t sharedPid = 0;
+
+CdmPool& CdmPool::shared() {
+  lock_guard guard(sharedLock);
+  if (sharedPool && sharedPid == getpid()) {
+    return *sharedPool;
+  }
+  // A pool inherited from the parent is abandoned along with its systems,
+  // whose executor threads did not survive fork().
+  if (!sharedPool) {
+    pthread_atfork(
+        [] { sharedLock.lock(); },
+        [] { sharedLock.unlock(); },
+        [] { sharedLock.unlock(); }
+    );
+  }
+
+  guint64 capacity = 0;
+  guint64 timeout = kDefaultIdleTimeout.count();
+  const gchar *value = g_getenv("WIDEVINE_CDM_POOL_SIZE");
+  if (value) {
+    g_ascii_string_to_unsigned(value, 10, 0, 64, &capacity, nullptr);
+  }
+  value = g_getenv("WIDEVINE_CDM_POOL_IDLE_SECONDS");
+  if (value) {
+    g_ascii_string_to_unsigned(value, 10, 1, G_MAXUINT32, &timeout, nullptr);
+  }
+  sharedPool = new CdmPool(capacity, seconds(timeout));
+  sharedPid = getpid();
+  return *sharedPool;
+}
+
+CdmPool::CdmPool(size_t capacity, seconds idleTimeout)
+  : capacity(capacity)
+  , idleTimeout(idleTimeout) {
+  if (capacity) {
+    reaper = thread([this] { reap(); });
+    reaper.detach();
+  }
+}
+
+OpenCDMSystem* CdmPool::take(const string& keySystem, const CdmModule* module) {
+  if (!capacity) {
+    return nullptr;
+  }
+  lock_guard guard(lock);
+  auto found = std::find_if(idle.rbegin(), idle.rend(), [&](const Idle& entry) {
+    return entry.system->keySystem == keySystem
+        && entry.system->module.get() == module;
+  });
+  if (found == idle.rend()) {
+    counters.misses++;
+    return nullptr;
+  }
+  auto system = found->system;
+  idle.erase(std::next(found).base());
+  counters.hits++;
+  return system;
+}
+
+bool CdmPool::give(OpenCDMSystem* system) {
+  lock_guard guard(lock);
+  if (idle.size() >= capacity) {
+    return false;
+  }
+  idle.push_back({ system, steady_clock::now() });
+  counters.recycled++;
+  wakeup.notify_one();
+  return true;
+}
+
+CdmPoolStats CdmPool::stats() {
+  lock_guard guard(lock);
+  auto stats = counters;
+  stats.idle = idle.size();
+  return stats;
+}
+
+void CdmPool::reap() {
+  unique_lock guard(lock);
+  for (;;) {
+    if (idle.empty()) {
+      wakeup.wait(guard);
+      continue;
+    }
+    auto expiry = idle.front().since + idleTimeout;
+    if (steady_clock::now() < expiry) {
+      wakeup.wait_until(guard, expiry);
+      continue;
+    }
+    auto system = idle.front().system;
+    idle.erase(idle.begin());
+    counters.reaped++;
+    guard.unlock();
+    delete system;
+    guard.lock();
+  }
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glib.h>
+
+using std::mutex;
+using std::string;
+using std::thread;
+using std::vector;
+
+struct CdmModule;
+struct OpenCDMSystem;
+
+struct CdmPoolStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t recycled;
+  uint64_t reaped;
+  size_t idle;
+};
+
+// Keeps up to |capacity| systems whose CDM is initialized but has no sessions
+// left, so that creating a system for the same key system again skips CDM
+// creation and initialization. Systems sitting idle for longer than
+// |idleTimeout| are destroyed by a reaper thread.
+struct CdmPool {
+  static constexpr std::chrono::seconds kDefaultIdleTimeout { 60 };
+
+  // The pool shared by the whole process, sized by WIDEVINE_CDM_POOL_SIZE
+  // (disabled by default) with the timeout set by
+  // WIDEVINE_CDM_POOL_IDLE_SECONDS. Never destroyed. A process forked from
+  // one that used the pool starts with an empty pool of its own.
+  G_GNUC_INTERNAL
+  static CdmPool& shared();
+
+  CdmPool(const CdmPool&) = delete;
+  CdmPool& operator=(const CdmPool&) = delete;
+
+  // Returns the most recently recycled system for |keySystem| whose CDM comes
+  // from |module|, if any.
+  G_GNUC_INTERNAL
+  OpenCDMSystem* take(const string& keySystem, const CdmModule* module);
+
+  // Keeps |system|, which must have been reset already, unless the pool is
+  // full. Returns whether it did; if not the caller still owns |system|.
+  G_GNUC_INTERNAL
+  bool give(OpenCDMSystem* system);
+
+  G_GNUC_INTERNAL
+  CdmPoolStats stats();
+
+  const size_t capacity;
+  const std::chrono::seconds idleTimeout;
+
+ private:
+  G_GNUC_INTERNAL
+  CdmPool(size_t capacity, std::chrono::seconds idleTimeout);
+
+  struct Idle {
+    OpenCDMSystem* system;
+    std::chrono::steady_clock::time_point since;
+  };
+
+  G_GNUC_INTERNAL
+  void reap();
+
+  mutex lock;
+  std::condition_variable wakeup;
+  // Oldest first.
+  vector<Idle> idle;
+  CdmPoolStats counters = {};
+  thread reaper;
+};
@@ -0,0 +1,231 @@
+#include <glib.h>
+
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "open_cdm.h"
+#include "content_decryption_module.h"
+
+#include "decrypt.h"
+
+using std::span;
+using std::vector;
+
+struct FakeBuffer final : cdm::Buffer {
+  vector<uint8_t> data;
+
+  FakeBuffer(uint32_t capacity) { data.resize(capacity); }
+  void Destroy() final { delete this; }
+
+  [[nodiscard]] uint32_t Capacity() const final { return data.capacity(); }
+  uint8_t* Data() final { return data.data(); }
+  void SetSize(uint32_t size) final { data.resize(size); }
+  [[nodiscard]] uint32_t Size() const final { return data.size(); }
+};
+
+// Stands in for the blob: copies the input and flips the first byte of every
+// encrypted range, so the cost measured is the host side of each call.
+struct FakeCdm final : cdm::ContentDecryptionModule_10 {
+  uint64_t decryptCalls = 0;
+
+  // Mirrors Host::Allocate().
+  cdm::Buffer* allocate(uint32_t capacity) {
+    if (auto destination = claimDecryptDestination(capacity)) {
+      return destination;
+    }
+    return new FakeBuffer(capacity);
+  }
+
+  void Initialize(bool, bool, bool) final {}
+  void GetStatusForPolicy(uint32_t, const cdm::Policy&) final {}
+  void SetServerCertificate(uint32_t, const uint8_t*, uint32_t) final {}
+  void CreateSessionAndGenerateRequest(
+      uint32_t, cdm::SessionType, cdm::InitDataType, const uint8_t*, uint32_t
+  ) final {}
+  void LoadSession(uint32_t, cdm::SessionType, const char*, uint32_t) final {}
+  void UpdateSession(
+      uint32_t, const char*, uint32_t, const uint8_t*, uint32_t
+  ) final {}
+  void CloseSession(uint32_t, const char*, uint32_t) final {}
+  void RemoveSession(uint32_t, const char*, uint32_t) final {}
+  void TimerExpired(void*) final {}
+
+  cdm::Status Decrypt(
+      const cdm::InputBuffer_2& input,
+      cdm::DecryptedBlock* decrypted
+  ) final {
+    decryptCalls++;
+    auto buffer = allocate(input.data_size);
+    if (buffer->Data() != input.data) {
+      memcpy(buffer->Data(), input.data, input.data_size);
+    }
+    buffer->SetSize(input.data_size);
+    if (input.num_subsamples == 0) {
+      buffer->Data()[0] ^= 0xff;
+    } else {
+      size_t position = 0;
+      for (auto i = 0U; i < input.num_subsamples; i++) {
+        position += input.subsamples[i].clear_bytes;
+        buffer->Data()[position] ^= 0xff;
+        position += input.subsamples[i].cipher_bytes;
+      }
+    }
+    decrypted->SetDecryptedBuffer(buffer);
+    return cdm::kSuccess;
+  }
+
+  cdm::Status InitializeAudioDecoder(const cdm::AudioDecoderConfig_2&) final {
+    return cdm::kInitializationError;
+  }
+  cdm::Status InitializeVideoDecoder(const cdm::VideoDecoderConfig_2&) final {
+    return cdm::kInitializationError;
+  }
+  void DeinitializeDecoder(cdm::StreamType) final {}
+  void ResetDecoder(cdm::StreamType) final {}
+  cdm::Status DecryptAndDecodeFrame(
+      const cdm::InputBuffer_2&, cdm::VideoFrame*
+  ) final {
+    return cdm::kDecodeError;
+  }
+  cdm::Status DecryptAndDecodeSamples(
+      const cdm::InputBuffer_2&, cdm::AudioFrames*
+  ) final {
+    return cdm::kDecodeError;
+  }
+  void OnPlatformChallengeResponse(
+      const cdm::PlatformChallengeResponse&
+  ) final {}
+  void OnQueryOutputProtectionStatus(cdm::QueryResult, uint32_t, uint32_t) final {}
+  void OnStorageId(uint32_t, const uint8_t*, uint32_t) final {}
+  void Destroy() final {}
+};
+
+static vector<uint8_t> buildSubsamples(
+    uint32_t count,
+    uint16_t clear,
+    uint32_t cipher
+) {
+  vector<uint8_t> data;
+  for (auto i = 0U; i < count; i++) {
+    data.push_back(clear >> 8);
+    data.push_back(clear & 0xff);
+    data.push_back(cipher >> 24);
+    data.push_back((cipher >> 16) & 0xff);
+    data.push_back((cipher >> 8) & 0xff);
+    data.push_back(cipher & 0xff);
+  }
+  return data;
+}
+
+// The decrypt path this module used before samples were handed over whole:
+// one CDM call per encrypted range.
+static OpenCDMError decryptPerSubsample(
+    ContentDecryptionModule_10& cdm,
+    span<uint8_t> buffer,
+    span<uint8_t> subsamples,
+    uint32_t subsampleCount,
+    span<uint8_t> iv,
+    span<uint8_t> keyId,
+    DecryptCounters& counters,
+    bool inPlace
+) {
+  SubsampleMap entries;
+  auto parsed = parseSubsamples(
+      subsamples,
+      subsampleCount,
+      buffer.size(),
+      entries
+  );
+  if (parsed != ERROR_NONE) {
+    return parsed;
+  }
+  size_t position = 0;
+  for (const auto& subsample : entries.entries) {
+    auto encrypted = buffer.subspan(
+        position + subsample.clear_bytes,
+        subsample.cipher_bytes
+    );
+    if (!encrypted.empty()) {
+      auto result = decryptWithoutSubsamples(
+          cdm,
+          encrypted,
+          iv,
+          keyId,
+          counters,
+          inPlace
+      );
+      if (result != ERROR_NONE) {
+        return result;
+      }
+    }
+    position += subsample.clear_bytes + subsample.cipher_bytes;
+  }
+  return ERROR_NONE;
+}
+
+using DecryptFunc = OpenCDMError (*)(
+    ContentDecryptionModule_10&,
+    span<uint8_t>,
+    span<uint8_t>,
+    const uint32_t,
+    span<uint8_t>,
+    span<uint8_t>,
+    DecryptCounters&,
+    bool
+);
+
+static void run(
+    const char* name,
+    DecryptFunc decrypt,
+    uint32_t subsampleCount,
+    bool inPlace
+) {
+  const uint16_t clear = 96;
+  const uint32_t cipher = 4000;
+  const auto frames = 2000U;
+  FakeCdm cdm;
+  DecryptCounters counters;
+  auto subsamples = buildSubsamples(subsampleCount, clear, cipher);
+  vector<uint8_t> frame((clear + cipher) * subsampleCount);
+  vector<uint8_t> iv(16);
+  vector<uint8_t> keyId(16);
+
+  auto start = g_get_monotonic_time();
+  for (auto i = 0U; i < frames; i++) {
+    auto result = decrypt(
+        cdm,
+        frame,
+        subsamples,
+        subsampleCount,
+        iv,
+        keyId,
+        counters,
+        inPlace
+    );
+    g_assert(result == ERROR_NONE);
+  }
+  auto elapsed = g_get_monotonic_time() - start;
+
+  g_print(
+      "%-16s subsamples=%-4u calls/frame=%-6.1f us/frame=%-8.2f "
+      "copied=%lu zero-copy=%lu\n",
+      name,
+      subsampleCount,
+      (double) cdm.decryptCalls / frames,
+      (double) elapsed / frames,
+      (unsigned long) counters.copiedBytes,
+      (unsigned long) counters.zeroCopyBytes
+  );
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  for (auto count : { 1U, 8U, 32U, 64U }) {
+    run("per-subsample", decryptPerSubsample, count, false);
+    run("batched", decryptSubsamples, count, false);
+    run("batched/in-place", decryptSubsamples, count, true);
+  }
+  return 0;
+}
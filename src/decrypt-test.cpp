@@ -0,0 +1,442 @@
+#include <glib.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "open_cdm.h"
+#include "content_decryption_module.h"
+
+#include "decrypt.h"
+
+using std::array;
+using std::span;
+using std::vector;
+
+static const guint32 kSeed = 0x5eed;
+static const unsigned kChunkings = 200;
+
+static const uint8_t kSBox[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+typedef array<uint8_t, 16> Block;
+
+static uint8_t
+xtime (uint8_t value)
+{
+  return (value << 1) ^ ((value & 0x80) ? 0x1b : 0x00);
+}
+
+// A plain AES-128 block encryption, enough to produce a real CTR keystream.
+struct Aes128 {
+  array<Block, 11> roundKeys;
+
+  explicit Aes128 (const Block& key) {
+    roundKeys[0] = key;
+    uint8_t rcon = 0x01;
+    for (auto round = 1U; round < roundKeys.size (); round++) {
+      auto& previous = roundKeys[round - 1];
+      auto& next = roundKeys[round];
+      uint8_t word[4] = {
+        (uint8_t) (kSBox[previous[13]] ^ rcon), kSBox[previous[14]],
+        kSBox[previous[15]], kSBox[previous[12]],
+      };
+      for (auto i = 0U; i < 16; i++) {
+        next[i] = previous[i] ^ (i < 4 ? word[i] : next[i - 4]);
+      }
+      rcon = xtime (rcon);
+    }
+  }
+
+  Block encrypt (Block state) const {
+    for (auto i = 0U; i < 16; i++)
+      state[i] ^= roundKeys[0][i];
+    for (auto round = 1U; round < roundKeys.size (); round++) {
+      Block shifted;
+      for (auto i = 0U; i < 16; i++) {
+        // Column-major state: row i % 4 moves left by its row number.
+        shifted[i] = kSBox[state[(i + 4 * (i % 4)) % 16]];
+      }
+      if (round < roundKeys.size () - 1) {
+        for (auto column = 0U; column < 4; column++) {
+          auto c = &shifted[4 * column];
+          uint8_t all = c[0] ^ c[1] ^ c[2] ^ c[3];
+          uint8_t first = c[0];
+          c[0] ^= all ^ xtime (c[0] ^ c[1]);
+          c[1] ^= all ^ xtime (c[1] ^ c[2]);
+          c[2] ^= all ^ xtime (c[2] ^ c[3]);
+          c[3] ^= all ^ xtime (c[3] ^ first);
+        }
+      }
+      for (auto i = 0U; i < 16; i++)
+        state[i] = shifted[i] ^ roundKeys[round][i];
+    }
+    return state;
+  }
+};
+
+struct FakeBuffer final : cdm::Buffer {
+  vector<uint8_t> data;
+
+  FakeBuffer (uint32_t capacity) { data.resize (capacity); }
+  void Destroy () final { delete this; }
+
+  [[nodiscard]] uint32_t Capacity () const final { return data.capacity (); }
+  uint8_t* Data () final { return data.data (); }
+  void SetSize (uint32_t size) final { data.resize (size); }
+  [[nodiscard]] uint32_t Size () const final { return data.size (); }
+};
+
+// Adds |blocks| to |block| taken as a 128-bit big-endian counter.
+static void
+add_blocks (Block& block, uint64_t blocks)
+{
+  unsigned carry = 0;
+  for (auto i = 16U; i > 0; i--) {
+    auto sum = block[i - 1] + (blocks & 0xff) + carry;
+    block[i - 1] = sum & 0xff;
+    carry = sum >> 8;
+    blocks >>= 8;
+  }
+}
+
+// Stands in for the blob with a real 'cenc' decrypt: the encrypted ranges of
+// the input are XORed, as one continuous stream, with an AES-CTR keystream
+// whose counter is the whole IV. With |failing| set it reports
+// an error once it has written its output.
+struct FakeCdm final : cdm::ContentDecryptionModule_10 {
+  Aes128 aes;
+  uint64_t decryptCalls = 0;
+  bool failing = false;
+
+  explicit FakeCdm (const Block& key) : aes (key) { }
+
+  void Initialize (bool, bool, bool) final {}
+  void GetStatusForPolicy (uint32_t, const cdm::Policy&) final {}
+  void SetServerCertificate (uint32_t, const uint8_t*, uint32_t) final {}
+  void CreateSessionAndGenerateRequest (
+      uint32_t, cdm::SessionType, cdm::InitDataType, const uint8_t*, uint32_t
+  ) final {}
+  void LoadSession (uint32_t, cdm::SessionType, const char*, uint32_t) final {}
+  void UpdateSession (
+      uint32_t, const char*, uint32_t, const uint8_t*, uint32_t
+  ) final {}
+  void CloseSession (uint32_t, const char*, uint32_t) final {}
+  void RemoveSession (uint32_t, const char*, uint32_t) final {}
+  void TimerExpired (void*) final {}
+
+  cdm::Status Decrypt (
+      const cdm::InputBuffer_2& input,
+      cdm::DecryptedBlock* decrypted
+  ) final {
+    decryptCalls++;
+    g_assert_true (input.iv_size == 8 || input.iv_size == 16);
+    // Mirrors Host::Allocate().
+    cdm::Buffer* buffer = claimDecryptDestination (input.data_size);
+    if (!buffer)
+      buffer = new FakeBuffer (input.data_size);
+    if (buffer->Data () != input.data)
+      memcpy (buffer->Data (), input.data, input.data_size);
+    buffer->SetSize (input.data_size);
+
+    Block iv = {};
+    memcpy (iv.data (), input.iv, input.iv_size);
+
+    auto data = buffer->Data ();
+    size_t streamed = 0;
+    Block keystream;
+    auto apply = [&] (size_t position, size_t length) {
+      for (auto i = 0U; i < length; i++, streamed++) {
+        if (streamed % 16 == 0) {
+          auto block = iv;
+          add_blocks (block, streamed / 16);
+          keystream = aes.encrypt (block);
+        }
+        data[position + i] ^= keystream[streamed % 16];
+      }
+    };
+    if (input.num_subsamples == 0) {
+      apply (0, input.data_size);
+    } else {
+      size_t position = 0;
+      for (auto i = 0U; i < input.num_subsamples; i++) {
+        position += input.subsamples[i].clear_bytes;
+        g_assert_cmpuint (position + input.subsamples[i].cipher_bytes, <=,
+            input.data_size);
+        apply (position, input.subsamples[i].cipher_bytes);
+        position += input.subsamples[i].cipher_bytes;
+      }
+    }
+    decrypted->SetDecryptedBuffer (buffer);
+    return failing ? cdm::kDecryptError : cdm::kSuccess;
+  }
+
+  cdm::Status InitializeAudioDecoder (const cdm::AudioDecoderConfig_2&) final {
+    return cdm::kInitializationError;
+  }
+  cdm::Status InitializeVideoDecoder (const cdm::VideoDecoderConfig_2&) final {
+    return cdm::kInitializationError;
+  }
+  void DeinitializeDecoder (cdm::StreamType) final {}
+  void ResetDecoder (cdm::StreamType) final {}
+  cdm::Status DecryptAndDecodeFrame (
+      const cdm::InputBuffer_2&, cdm::VideoFrame*
+  ) final {
+    return cdm::kDecodeError;
+  }
+  cdm::Status DecryptAndDecodeSamples (
+      const cdm::InputBuffer_2&, cdm::AudioFrames*
+  ) final {
+    return cdm::kDecodeError;
+  }
+  void OnPlatformChallengeResponse (
+      const cdm::PlatformChallengeResponse&
+  ) final {}
+  void OnQueryOutputProtectionStatus (cdm::QueryResult, uint32_t, uint32_t) final {}
+  void OnStorageId (uint32_t, const uint8_t*, uint32_t) final {}
+  void Destroy () final {}
+};
+
+struct Subsample {
+  uint16_t clear;
+  uint32_t cipher;
+};
+
+static vector<uint8_t>
+encode_subsamples (span<const Subsample> subsamples)
+{
+  vector<uint8_t> data;
+  for (auto subsample : subsamples) {
+    data.push_back (subsample.clear >> 8);
+    data.push_back (subsample.clear & 0xff);
+    data.push_back (subsample.cipher >> 24);
+    data.push_back ((subsample.cipher >> 16) & 0xff);
+    data.push_back ((subsample.cipher >> 8) & 0xff);
+    data.push_back (subsample.cipher & 0xff);
+  }
+  return data;
+}
+
+static const Block kKey = {
+  0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+  0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c,
+};
+
+// Decrypts |sample| split at |cuts| and checks the result against |expected|,
+// the sample decrypted in one piece.
+static void
+check_chunked (FakeCdm& cdm, const vector<uint8_t>& sample,
+    vector<size_t> cuts, vector<uint8_t>& subsamples, uint32_t subsampleCount,
+    vector<uint8_t>& iv, const vector<uint8_t>& expected)
+{
+  cuts.push_back (sample.size ());
+  for (auto inPlace : { false, true }) {
+    auto chunked = sample;
+    vector<span<uint8_t>> chunks;
+    size_t start = 0;
+    for (auto cut : cuts) {
+      chunks.push_back (span (chunked).subspan (start, cut - start));
+      start = cut;
+    }
+
+    uint8_t keyId[16] = {};
+    DecryptCounters counters;
+    g_assert_cmpint (decryptScattered (cdm, chunks, subsamples, subsampleCount,
+        iv, keyId, counters, inPlace), ==, ERROR_NONE);
+    g_assert_true (chunked == expected);
+  }
+}
+
+// AES-128 against the FIPS-197 example, so the keystream below is the real one.
+static void
+test_aes (void)
+{
+  Block key, plain;
+  for (auto i = 0U; i < 16; i++) {
+    key[i] = i;
+    plain[i] = (i << 4) | i;
+  }
+  const Block expected = {
+    0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+    0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a,
+  };
+  g_assert_true (Aes128 (key).encrypt (plain) == expected);
+}
+
+// Samples spread over random memory layouts, with subsamples straddling the
+// boundaries and encrypted ranges that leave the counter mid-block, decrypt
+// to the same bytes as the contiguous sample.
+static void
+test_scattered_matches_contiguous (void)
+{
+  FakeCdm cdm (kKey);
+  g_autoptr (GRand) rand = g_rand_new_with_seed (kSeed);
+  const Subsample layout[] = {
+    { 5, 16 }, { 0, 37 }, { 100, 3 }, { 17, 250 }, { 0, 1 }, { 33, 0 },
+    { 2, 64 }, { 1, 15 }, { 0, 4096 }, { 9, 31 },
+  };
+  auto subsamples = encode_subsamples (layout);
+  size_t sampleSize = 0;
+  for (auto subsample : layout)
+    sampleSize += subsample.clear + subsample.cipher;
+
+  for (auto ivSize : { 8U, 16U }) {
+    vector<uint8_t> iv (ivSize);
+    for (auto& byte : iv)
+      byte = g_rand_int (rand);
+    vector<uint8_t> sample (sampleSize);
+    for (auto& byte : sample)
+      byte = g_rand_int (rand);
+
+    uint8_t keyId[16] = {};
+    DecryptCounters counters;
+    auto expected = sample;
+    g_assert_cmpint (decryptSubsamples (cdm, expected, subsamples,
+        G_N_ELEMENTS (layout), iv, keyId, counters, false), ==, ERROR_NONE);
+    g_assert_true (expected != sample);
+
+    for (auto i = 0U; i < kChunkings; i++) {
+      vector<size_t> cuts;
+      auto count = g_rand_int_range (rand, 1, 8);
+      for (auto c = 0; c < count; c++)
+        cuts.push_back (g_rand_int_range (rand, 0, sampleSize + 1));
+      std::sort (cuts.begin (), cuts.end ());
+      check_chunked (cdm, sample, cuts, subsamples, G_N_ELEMENTS (layout), iv,
+          expected);
+    }
+  }
+}
+
+// A sample without a subsample map is all encrypted, and still decrypts to
+// the contiguous result when it is split mid-block.
+static void
+test_scattered_without_subsamples (void)
+{
+  FakeCdm cdm (kKey);
+  vector<uint8_t> iv (16, 0x42);
+  vector<uint8_t> sample (1000);
+  for (auto i = 0U; i < sample.size (); i++)
+    sample[i] = i * 7;
+
+  uint8_t keyId[16] = {};
+  DecryptCounters counters;
+  auto expected = sample;
+  g_assert_cmpint (decryptWithoutSubsamples (cdm, expected, iv, keyId,
+      counters, false), ==, ERROR_NONE);
+
+  vector<uint8_t> none;
+  check_chunked (cdm, sample, { 1, 17, 500, 999 }, none, 0, iv, expected);
+}
+
+// The block counter is the whole IV, so one whose low 64 bits wrap carries
+// into the high half, both in the CDM and when a run is resumed mid-sample.
+static void
+test_counter_wrap (void)
+{
+  FakeCdm cdm (kKey);
+  vector<uint8_t> iv = {
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe,
+  };
+  const Subsample layout[] = { { 4, 24 }, { 3, 40 }, { 0, 16 }, { 8, 50 } };
+  auto subsamples = encode_subsamples (layout);
+  vector<uint8_t> sample (4 + 24 + 3 + 40 + 16 + 8 + 50);
+  for (auto i = 0U; i < sample.size (); i++)
+    sample[i] = i;
+
+  uint8_t keyId[16] = {};
+  DecryptCounters counters;
+  auto expected = sample;
+  g_assert_cmpint (decryptSubsamples (cdm, expected, subsamples,
+      G_N_ELEMENTS (layout), iv, keyId, counters, false), ==, ERROR_NONE);
+
+  // The second block of the keystream uses counter 0xff...ff, the third one
+  // wraps the low half to zero and carries into the high half.
+  Block counterBlock = {
+    0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x09,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  };
+  auto keystream = cdm.aes.encrypt (counterBlock);
+  // The third block starts 32 bytes into the encrypted stream: 24 bytes of the
+  // first subsample and 8 of the second, after 4 + 24 + 3 bytes of sample.
+  for (auto i = 0U; i < 16; i++)
+    g_assert_cmpuint (expected[4 + 24 + 3 + 8 + i], ==,
+        sample[4 + 24 + 3 + 8 + i] ^ keystream[i]);
+
+  // Each subsample in its own memory, then cut mid-block on both sides of the
+  // wrap.
+  check_chunked (cdm, sample, { 28, 71, 87 }, subsamples,
+      G_N_ELEMENTS (layout), iv, expected);
+  check_chunked (cdm, sample, { 10, 40, 50, 90, 100 }, subsamples,
+      G_N_ELEMENTS (layout), iv, expected);
+}
+
+// Unless decrypting in place, the CDM writes to a buffer of its own, so the
+// sample is left alone when it fails, contiguous or not.
+static void
+test_failed_decrypt (void)
+{
+  FakeCdm cdm (kKey);
+  vector<uint8_t> iv (8, 0x24);
+  const Subsample layout[] = { { 10, 100 }, { 3, 60 } };
+  auto subsamples = encode_subsamples (layout);
+  vector<uint8_t> sample (173);
+  for (auto i = 0U; i < sample.size (); i++)
+    sample[i] = i;
+  uint8_t keyId[16] = {};
+
+  DecryptCounters counters;
+  auto decrypted = sample;
+  g_assert_cmpint (decryptSubsamples (cdm, decrypted, subsamples,
+      G_N_ELEMENTS (layout), iv, keyId, counters, false), ==, ERROR_NONE);
+  g_assert_cmpuint (counters.copiedBytes, ==, sample.size ());
+  g_assert_cmpuint (counters.zeroCopyBytes, ==, 0);
+  auto inPlace = sample;
+  g_assert_cmpint (decryptSubsamples (cdm, inPlace, subsamples,
+      G_N_ELEMENTS (layout), iv, keyId, counters, true), ==, ERROR_NONE);
+  g_assert_true (inPlace == decrypted);
+  g_assert_cmpuint (counters.zeroCopyBytes, ==, sample.size ());
+
+  cdm.failing = true;
+  auto contiguous = sample;
+  g_assert_cmpint (decryptSubsamples (cdm, contiguous, subsamples,
+      G_N_ELEMENTS (layout), iv, keyId, counters, false), ==, ERROR_FAIL);
+  g_assert_true (contiguous == sample);
+  auto chunked = sample;
+  span<uint8_t> chunks[] = {
+    span (chunked).first (50), span (chunked).subspan (50, 70),
+    span (chunked).subspan (120),
+  };
+  g_assert_cmpint (decryptScattered (cdm, chunks, subsamples,
+      G_N_ELEMENTS (layout), iv, keyId, counters, false), ==, ERROR_FAIL);
+  g_assert_true (chunked == sample);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  test_aes ();
+  test_scattered_matches_contiguous ();
+  test_scattered_without_subsamples ();
+  test_counter_wrap ();
+  test_failed_decrypt ();
+  return 0;
+}
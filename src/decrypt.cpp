@@ -0,0 +1,457 @@
+// SPDX-License-Identifier: MIT
+
+#include <glib.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "open_cdm.h"
+#include "content_decryption_module.h"
+
+#include "decrypt.h"
+
+using std::array;
+
+// Lends the decrypt destination to the CDM as its output buffer, when
+// decrypting in place. The input and output then alias byte for byte.
+struct DestinationBuffer final : cdm::Buffer {
+  span<uint8_t> region;
+  uint32_t size = 0;
+
+  DestinationBuffer(span<uint8_t> region) : region(region) { }
+  void Destroy() final { }
+
+  [[nodiscard]] uint32_t Capacity() const final { return region.size(); }
+  uint8_t* Data() final { return region.data(); }
+  void SetSize(uint32_t size) final { this->size = size; }
+  [[nodiscard]] uint32_t Size() const final { return size; }
+};
+
+static thread_local DestinationBuffer* pendingDestination = nullptr;
+
+cdm::Buffer* claimDecryptDestination(uint32_t capacity) {
+  auto destination = pendingDestination;
+  if (!destination || capacity > destination->region.size()) {
+    return nullptr;
+  }
+  pendingDestination = nullptr;
+  return destination;
+}
+
+static OpenCDMError processDecryptionResult(
+    ContentDecryptionModule_10& cdm,
+    span<uint8_t> buffer,
+    cdm::InputBuffer_2 input,
+    DecryptCounters& counters,
+    bool inPlace
+) {
+  DestinationBuffer destination(buffer);
+  pendingDestination = inPlace ? &destination : nullptr;
+  BasicDecryptedBlock decrypted;
+  auto result = cdm.Decrypt(input, &decrypted);
+  pendingDestination = nullptr;
+  switch (result) {
+    case cdm::kSuccess:
+      if (decrypted.size() > buffer.size()) {
+        return ERROR_INVALID_DECRYPT_BUFFER;
+      }
+      if (decrypted.DecryptedBuffer() == &destination) {
+        counters.zeroCopyBytes += decrypted.size();
+      } else {
+        memcpy(buffer.data(), decrypted.data(), decrypted.size());
+        counters.copiedBytes += decrypted.size();
+      }
+      return ERROR_NONE;
+    case cdm::kNeedMoreData:
+      return ERROR_MORE_DATA_AVAILBALE;
+    case cdm::kNoKey:
+      return ERROR_INVALID_SESSION;
+    default:
+      return ERROR_FAIL;
+  }
+}
+
+OpenCDMError decryptWithoutSubsamples(
+    ContentDecryptionModule_10& cdm,
+    span<uint8_t> buffer,
+    span<uint8_t> iv,
+    span<uint8_t> keyId,
+    DecryptCounters& counters,
+    bool inPlace
+) {
+  cdm::InputBuffer_2 input = {
+    .data = buffer.data(),
+    .data_size = static_cast<uint32_t>(buffer.size()),
+    .encryption_scheme = cdm::EncryptionScheme::kCenc,
+    .key_id = keyId.data(),
+    .key_id_size = static_cast<uint32_t>(keyId.size()),
+    .iv = iv.data(),
+    .iv_size = static_cast<uint32_t>(iv.size()),
+    .subsamples = nullptr,
+    .num_subsamples = 0,
+    .pattern = { 0, 0 },
+    .timestamp = 0,
+  };
+
+  return processDecryptionResult(cdm, buffer, input, counters, inPlace);
+}
+
+span<cdm::SubsampleEntry> SubsampleMap::reserve(size_t count) {
+  if (count <= kInlineCapacity) {
+    entries = span(inlineEntries).first(count);
+  } else {
+    thread_local vector<cdm::SubsampleEntry> spill;
+    if (spill.size() < count) {
+      spill.resize(count);
+    }
+    entries = span(spill).first(count);
+  }
+  return entries;
+}
+
+OpenCDMError parseSubsamples(
+    span<const uint8_t> data,
+    size_t subsampleCount,
+    size_t payloadSize,
+    SubsampleMap& map
+) {
+  // Each entry is a big-endian 16-bit clear size and 32-bit cipher size.
+  constexpr size_t kEntrySize = sizeof(guint16) + sizeof(guint32);
+  if (subsampleCount < 1 || data.size() / kEntrySize < subsampleCount) {
+    return ERROR_FAIL;
+  }
+
+  auto entries = map.reserve(subsampleCount);
+  auto record = data.data();
+  size_t sampleSize = 0;
+  for (auto& entry : entries) {
+    guint16 clear;
+    guint32 cipher;
+    memcpy(&clear, record, sizeof(clear));
+    memcpy(&cipher, record + sizeof(clear), sizeof(cipher));
+    entry.clear_bytes = GUINT16_FROM_BE(clear);
+    entry.cipher_bytes = GUINT32_FROM_BE(cipher);
+    sampleSize += size_t(entry.clear_bytes) + entry.cipher_bytes;
+    record += kEntrySize;
+  }
+  if (sampleSize > payloadSize) {
+    return ERROR_INVALID_DECRYPT_BUFFER;
+  }
+  map.sampleSize = sampleSize;
+  return ERROR_NONE;
+}
+
+OpenCDMError decryptSubsamples(
+    ContentDecryptionModule_10& cdm,
+    span<uint8_t> buffer,
+    span<uint8_t> subsamples,
+    const uint32_t subsampleCount,
+    span<uint8_t> iv,
+    span<uint8_t> keyId,
+    DecryptCounters& counters,
+    bool inPlace
+) {
+  SubsampleMap subsampleMap;
+  auto parsed = parseSubsamples(
+      subsamples,
+      subsampleCount,
+      buffer.size(),
+      subsampleMap
+  );
+  if (parsed != ERROR_NONE) {
+    return parsed;
+  }
+
+  // The CDM hands back the whole sample with the clear ranges passed through,
+  // so a single copy puts every decrypted range back in place.
+  auto subsampleEntries = subsampleMap.entries;
+  auto sample = buffer.first(subsampleMap.sampleSize);
+  cdm::InputBuffer_2 input = {
+    .data = sample.data(),
+    .data_size = static_cast<uint32_t>(sample.size()),
+    .encryption_scheme = cdm::EncryptionScheme::kCenc,
+    .key_id = keyId.data(),
+    .key_id_size = static_cast<uint32_t>(keyId.size()),
+    .iv = iv.data(),
+    .iv_size = static_cast<uint32_t>(iv.size()),
+    .subsamples = subsampleEntries.data(),
+    .num_subsamples = static_cast<uint32_t>(subsampleEntries.size()),
+    .pattern = { 0, 0 },
+    .timestamp = 0,
+  };
+
+  return processDecryptionResult(cdm, sample, input, counters, inPlace);
+}
+
+static constexpr size_t kAesBlockSize = 16;
+
+// Returns |iv| moved |blocks| blocks ahead, as 'cenc' does for every 16 bytes
+// of encrypted data. The whole block is one 128-bit big-endian counter, as in
+// the CDM: a 16-byte IV whose low half wraps carries into its high half.
+static array<uint8_t, kAesBlockSize> advanceCounter(
+    span<const uint8_t> iv,
+    size_t blocks
+) {
+  array<uint8_t, kAesBlockSize> block = {};
+  memcpy(block.data(), iv.data(), std::min(iv.size(), block.size()));
+  uint64_t high = 0;
+  uint64_t low = 0;
+  for (auto i = 0U; i < 8; i++) {
+    high = (high << 8) | block[i];
+    low = (low << 8) | block[i + 8];
+  }
+  auto advanced = low + blocks;
+  if (advanced < low) {
+    high++;
+  }
+  for (auto i = 8U; i > 0; i--) {
+    block[i - 1] = high & 0xff;
+    block[i + 7] = advanced & 0xff;
+    high >>= 8;
+    advanced >>= 8;
+  }
+  return block;
+}
+
+static OpenCDMError decryptRun(
+    ContentDecryptionModule_10& cdm,
+    span<uint8_t> region,
+    span<const cdm::SubsampleEntry> entries,
+    span<uint8_t> iv,
+    size_t cipherOffset,
+    span<uint8_t> keyId,
+    DecryptCounters& counters,
+    bool inPlace
+) {
+  auto counterBlock = advanceCounter(iv, cipherOffset / kAesBlockSize);
+  span<const uint8_t> runIv = iv;
+  if (cipherOffset > 0) {
+    runIv = counterBlock;
+  }
+  cdm::InputBuffer_2 input = {
+    .data = region.data(),
+    .data_size = static_cast<uint32_t>(region.size()),
+    .encryption_scheme = cdm::EncryptionScheme::kCenc,
+    .key_id = keyId.data(),
+    .key_id_size = static_cast<uint32_t>(keyId.size()),
+    .iv = runIv.data(),
+    .iv_size = static_cast<uint32_t>(runIv.size()),
+    .subsamples = entries.data(),
+    .num_subsamples = static_cast<uint32_t>(entries.size()),
+    .pattern = { 0, 0 },
+    .timestamp = 0,
+  };
+
+  return processDecryptionResult(cdm, region, input, counters, inPlace);
+}
+
+// Copies between the logical byte range starting at |offset| of a chunked
+// sample and a contiguous |data| span.
+static void copyChunks(
+    span<const span<uint8_t>> chunks,
+    size_t offset,
+    span<uint8_t> data,
+    bool toChunks
+) {
+  size_t done = 0;
+  for (auto chunk : chunks) {
+    if (done == data.size()) {
+      break;
+    }
+    if (offset >= chunk.size()) {
+      offset -= chunk.size();
+      continue;
+    }
+    auto length = std::min(chunk.size() - offset, data.size() - done);
+    if (toChunks) {
+      memcpy(chunk.data() + offset, data.data() + done, length);
+    } else {
+      memcpy(data.data() + done, chunk.data() + offset, length);
+    }
+    done += length;
+    offset = 0;
+  }
+}
+
+// Decrypts a run of subsamples that cannot be handed to the CDM where it
+// lies, either because it crosses a chunk boundary or because it does not
+// start on an AES block boundary. The run is gathered behind enough padding
+// to realign the counter, decrypted, and scattered back.
+static OpenCDMError decryptStitched(
+    ContentDecryptionModule_10& cdm,
+    span<const span<uint8_t>> chunks,
+    size_t start,
+    size_t end,
+    span<const cdm::SubsampleEntry> entries,
+    span<uint8_t> iv,
+    size_t cipherOffset,
+    span<uint8_t> keyId,
+    DecryptCounters& counters,
+    bool inPlace
+) {
+  auto padding = cipherOffset % kAesBlockSize;
+  vector<uint8_t> stitched(padding + end - start);
+  auto payload = span(stitched).subspan(padding);
+  copyChunks(chunks, start, payload, false);
+
+  vector<cdm::SubsampleEntry> stitchedEntries;
+  stitchedEntries.reserve(entries.size() + 1);
+  if (padding > 0) {
+    stitchedEntries.push_back({ 0, static_cast<uint32_t>(padding) });
+  }
+  stitchedEntries.insert(stitchedEntries.end(), entries.begin(), entries.end());
+
+  auto result = decryptRun(
+      cdm,
+      stitched,
+      stitchedEntries,
+      iv,
+      cipherOffset - padding,
+      keyId,
+      counters,
+      inPlace
+  );
+  if (result != ERROR_NONE) {
+    return result;
+  }
+  copyChunks(chunks, start, payload, true);
+  counters.copiedBytes += payload.size();
+  return ERROR_NONE;
+}
+
+OpenCDMError decryptScattered(
+    ContentDecryptionModule_10& cdm,
+    span<const span<uint8_t>> chunks,
+    span<uint8_t> subsamples,
+    const uint32_t subsampleCount,
+    span<uint8_t> iv,
+    span<uint8_t> keyId,
+    DecryptCounters& counters,
+    bool inPlace
+) {
+  size_t totalSize = 0;
+  for (auto chunk : chunks) {
+    totalSize += chunk.size();
+  }
+
+  if (!inPlace) {
+    vector<uint8_t> sample(totalSize);
+    copyChunks(chunks, 0, sample, false);
+    auto result = subsampleCount < 1
+        ? decryptWithoutSubsamples(cdm, sample, iv, keyId, counters, false)
+        : decryptSubsamples(
+            cdm,
+            sample,
+            subsamples,
+            subsampleCount,
+            iv,
+            keyId,
+            counters,
+            false
+        );
+    if (result == ERROR_NONE) {
+      copyChunks(chunks, 0, sample, true);
+    }
+    return result;
+  }
+
+  SubsampleMap subsampleMap;
+  if (subsampleCount < 1) {
+    subsampleMap.reserve(1)[0] = { 0, static_cast<uint32_t>(totalSize) };
+  } else {
+    auto parsed = parseSubsamples(
+        subsamples,
+        subsampleCount,
+        totalSize,
+        subsampleMap
+    );
+    if (parsed != ERROR_NONE) {
+      return parsed;
+    }
+  }
+  auto entries = subsampleMap.entries;
+
+  size_t position = 0;
+  size_t cipherOffset = 0;
+  size_t chunkIndex = 0;
+  size_t chunkStart = 0;
+  size_t i = 0;
+  while (i < entries.size()) {
+    while (chunkIndex < chunks.size()
+        && chunkStart + chunks[chunkIndex].size() <= position) {
+      chunkStart += chunks[chunkIndex].size();
+      chunkIndex++;
+    }
+
+    // Take as many subsamples as fit in the chunk the run starts in.
+    size_t end = position;
+    size_t runCipher = 0;
+    size_t j = i;
+    if (chunkIndex < chunks.size()) {
+      auto chunkEnd = chunkStart + chunks[chunkIndex].size();
+      while (j < entries.size()) {
+        auto size = size_t(entries[j].clear_bytes) + entries[j].cipher_bytes;
+        if (end + size > chunkEnd) {
+          break;
+        }
+        end += size;
+        runCipher += entries[j].cipher_bytes;
+        j++;
+      }
+    }
+    bool straddles = j == i;
+    if (straddles) {
+      end += size_t(entries[i].clear_bytes) + entries[i].cipher_bytes;
+      runCipher = entries[i].cipher_bytes;
+      j = i + 1;
+    }
+    if (end > totalSize) {
+      return ERROR_INVALID_DECRYPT_BUFFER;
+    }
+
+    auto run = entries.subspan(i, j - i);
+    if (runCipher > 0) {
+      OpenCDMError result;
+      if (!straddles && cipherOffset % kAesBlockSize == 0) {
+        auto region = chunks[chunkIndex].subspan(
+            position - chunkStart,
+            end - position
+        );
+        result = decryptRun(
+            cdm,
+            region,
+            run,
+            iv,
+            cipherOffset,
+            keyId,
+            counters,
+            inPlace
+        );
+      } else {
+        result = decryptStitched(
+            cdm,
+            chunks,
+            position,
+            end,
+            run,
+            iv,
+            cipherOffset,
+            keyId,
+            counters,
+            inPlace
+        );
+      }
+      if (result != ERROR_NONE) {
+        return result;
+      }
+    }
+
+    position = end;
+    cipherOffset += runCipher;
+    i = j;
+  }
+  return ERROR_NONE;
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <glib.h>
+#include "open_cdm.h"
+#include "content_decryption_module.h"
+
+using std::array;
+using std::atomic;
+using std::span;
+using std::vector;
+
+using cdm::ContentDecryptionModule_10;
+
+struct BasicDecryptedBlock final : cdm::DecryptedBlock {
+  cdm::Buffer* buffer = nullptr;
+  int64_t timestamp = 0;
+
+  ~BasicDecryptedBlock() final {
+    if (buffer) {
+      buffer->Destroy();
+    }
+  }
+
+  void SetDecryptedBuffer(cdm::Buffer* buffer) final { this->buffer = buffer; }
+  cdm::Buffer* DecryptedBuffer() final { return buffer; }
+
+  void SetTimestamp(int64_t timestamp) final { this->timestamp = timestamp; }
+  [[nodiscard]] int64_t Timestamp() const final { return timestamp; }
+
+  [[nodiscard]] uint32_t size() const { return buffer ? buffer->Size() : 0; }
+  [[nodiscard]] const uint8_t* data() const {
+    return buffer ? buffer->Data() : nullptr;
+  }
+};
+
+// Tells apart output that the CDM wrote straight into the caller's buffer from
+// output that had to be copied back from a host allocated one, and counts
+// input that had to be duplicated because it was shared.
+struct DecryptCounters {
+  atomic<uint64_t> copiedBytes = 0;
+  atomic<uint64_t> zeroCopyBytes = 0;
+  atomic<uint64_t> duplicatedBytes = 0;
+};
+
+// While a decrypt in place is in flight on the calling thread, returns a
+// cdm::Buffer wrapping its destination if |capacity| fits in it.
+// Host::Allocate tries this before falling back to a pooled buffer.
+G_GNUC_INTERNAL
+cdm::Buffer* claimDecryptDestination(uint32_t capacity);
+
+// The parsed subsample map of one sample. Up to kInlineCapacity entries are
+// stored inline; larger maps spill into a per-thread buffer that is reused
+// across calls, so parsing does not allocate in steady state. The entries are
+// only valid until the next map on the same thread spills.
+struct SubsampleMap {
+  static constexpr size_t kInlineCapacity = 64;
+
+  SubsampleMap() = default;
+  SubsampleMap(const SubsampleMap&) = delete;
+  SubsampleMap& operator=(const SubsampleMap&) = delete;
+
+  G_GNUC_INTERNAL
+  span<cdm::SubsampleEntry> reserve(size_t count);
+
+  span<cdm::SubsampleEntry> entries;
+  size_t sampleSize = 0;
+
+ private:
+  array<cdm::SubsampleEntry, kInlineCapacity> inlineEntries;
+};
+
+// Decodes |subsampleCount| entries of the subsample map in |data| and checks
+// that they cover no more than |payloadSize| bytes.
+G_GNUC_INTERNAL
+OpenCDMError parseSubsamples(
+    span<const uint8_t> data,
+    size_t subsampleCount,
+    size_t payloadSize,
+    SubsampleMap& map
+);
+
+// The decrypt functions below write the decrypted sample over the encrypted
+// one. The CDM decrypts into a host buffer that is copied back once it
+// succeeded, so a failed decrypt leaves the sample as it was. With |inPlace|
+// the sample itself is lent to the CDM as its output buffer instead, saving
+// the copy, for CDMs known to cope with their input and output aliasing; a
+// failed decrypt may then leave the sample partly decrypted.
+G_GNUC_INTERNAL
+OpenCDMError decryptWithoutSubsamples(
+    ContentDecryptionModule_10& cdm,
+    span<uint8_t> buffer,
+    span<uint8_t> iv,
+    span<uint8_t> keyId,
+    DecryptCounters& counters,
+    bool inPlace
+);
+
+// Decrypts a whole sample with a single call into the CDM. The subsample map
+// is handed over as-is so the CTR counter runs continuously across the
+// encrypted ranges, as CENC requires.
+G_GNUC_INTERNAL
+OpenCDMError decryptSubsamples(
+    ContentDecryptionModule_10& cdm,
+    span<uint8_t> buffer,
+    span<uint8_t> subsamples,
+    const uint32_t subsampleCount,
+    span<uint8_t> iv,
+    span<uint8_t> keyId,
+    DecryptCounters& counters,
+    bool inPlace
+);
+
+// Like decryptSubsamples() for a sample split over several non-contiguous
+// chunks, e.g. the memories of a GstBuffer. The sample is gathered into one
+// piece, decrypted, and scattered back once that succeeded. In place, runs of
+// subsamples that lie within one chunk are decrypted where they are instead;
+// only runs straddling a chunk boundary are copied out and back.
+G_GNUC_INTERNAL
+OpenCDMError decryptScattered(
+    ContentDecryptionModule_10& cdm,
+    span<const span<uint8_t>> chunks,
+    span<uint8_t> subsamples,
+    const uint32_t subsampleCount,
+    span<uint8_t> iv,
+    span<uint8_t> keyId,
+    DecryptCounters& counters,
+    bool inPlace
+);
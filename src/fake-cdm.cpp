@@ -0,0 +1,380 @@
+// SPDX-License-Identifier: MIT
+
+// A stand-in for the Widevine CDM blob, loaded through WIDEVINE_CDM_BLOB by
+// tests that exercise the library end to end. It settles promises right away,
+// except for updates whose response is "hold", which stay outstanding, and
+// keeps a short timer armed while sessions are open as the real CDM does for
+// renewals. Persistent license sessions are named after their init data and
+// store their key through the host's FileIO, from where LoadSession() gets it
+// back. With WIDEVINE_FAKE_CDM_PROVISIONING set, sessions first ask for the
+// device to be provisioned, until an update answers that and the certificate
+// is stored through the FileIO as well. With WIDEVINE_FAKE_CDM_LICENSE_MS
+// set, keys expire that long after the update that brought them.
+// GetCdmVersion() reports the name of the version directory the blob was
+// loaded from, as found in the browsers' layouts, so that tests can tell
+// copies of it apart.
+
+#include <dlfcn.h>
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "content_decryption_module.h"
+
+using std::function;
+using std::string;
+using std::unordered_map;
+using std::unordered_set;
+
+static const int64_t kTimerMs = 5;
+static const uint32_t kKeySize = 16;
+static const char kCertificateName[] = "cert.bin";
+static const char kProvisioningRequest[] = "provisioning-request";
+
+// Opens a file, reads or replaces its contents and closes it again.
+struct FakeFile final : cdm::FileIOClient {
+  using Done = function<void(bool success, const string& contents)>;
+
+  static void read(cdm::Host_10* host, const string& name, Done done) {
+    start(host, name, false, {}, std::move(done));
+  }
+
+  static void write(
+      cdm::Host_10* host,
+      const string& name,
+      const string& contents,
+      Done done
+  ) {
+    start(host, name, true, contents, std::move(done));
+  }
+
+  void OnOpenComplete(Status status) final {
+    if (status != Status::kSuccess) {
+      finish(false, {});
+    } else if (writing) {
+      file->Write(reinterpret_cast<const uint8_t*>(contents.data()), contents.size());
+    } else {
+      file->Read();
+    }
+  }
+
+  void OnReadComplete(Status status, const uint8_t* data, uint32_t size) final {
+    finish(status == Status::kSuccess, string(reinterpret_cast<const char*>(data), size));
+  }
+
+  void OnWriteComplete(Status status) final {
+    finish(status == Status::kSuccess, {});
+  }
+
+ private:
+  static void start(
+      cdm::Host_10* host,
+      const string& name,
+      bool writing,
+      const string& contents,
+      Done done
+  ) {
+    auto self = new FakeFile();
+    self->file = host->CreateFileIO(self);
+    if (!self->file) {
+      delete self;
+      done(false, {});
+      return;
+    }
+    self->writing = writing;
+    self->contents = contents;
+    self->done = std::move(done);
+    self->file->Open(name.data(), name.size());
+  }
+
+  void finish(bool success, const string& result) {
+    file->Close();
+    done(success, result);
+    delete this;
+  }
+
+  cdm::FileIO* file = nullptr;
+  bool writing = false;
+  string contents;
+  Done done;
+};
+
+struct FakeCdm final : cdm::ContentDecryptionModule_10 {
+  explicit FakeCdm(cdm::Host_10* host) : host(host) { }
+
+  void Initialize(bool, bool, bool) final {
+    auto wanted = getenv("WIDEVINE_FAKE_CDM_PROVISIONING");
+    if (!wanted || !*wanted || !strcmp(wanted, "0")) {
+      provisioned = true;
+      host->OnInitialized(true);
+      return;
+    }
+    FakeFile::read(host, kCertificateName, [this](bool success, const string& certificate) {
+      provisioned = success && !certificate.empty();
+      host->OnInitialized(true);
+    });
+  }
+
+  void GetStatusForPolicy(uint32_t promiseId, const cdm::Policy&) final {
+    host->OnResolveKeyStatusPromise(promiseId, cdm::kUsable);
+  }
+
+  void SetServerCertificate(uint32_t promiseId, const uint8_t*, uint32_t) final {
+    host->OnResolvePromise(promiseId);
+  }
+
+  void CreateSessionAndGenerateRequest(
+      uint32_t promiseId,
+      cdm::SessionType sessionType,
+      cdm::InitDataType,
+      const uint8_t* initData,
+      uint32_t initDataSize
+  ) final {
+    string id;
+    if (sessionType == cdm::kPersistentLicense) {
+      id = "persistent-";
+      for (auto i = 0U; i < initDataSize; i++) {
+        static const char digits[] = "0123456789abcdef";
+        id += digits[initData[i] >> 4];
+        id += digits[initData[i] & 0xf];
+      }
+      persistentSessions.insert(id);
+    } else {
+      id = "fake-" + std::to_string(nextSession++);
+    }
+    host->OnResolveNewSessionPromise(promiseId, id.data(), id.size());
+    string request(reinterpret_cast<const char*>(initData), initDataSize);
+    if (provisioned) {
+      sendLicenseRequest(id, request);
+    } else {
+      unprovisionedSessions[id] = request;
+      host->OnSessionMessage(
+          id.data(),
+          id.size(),
+          cdm::kIndividualizationRequest,
+          kProvisioningRequest,
+          strlen(kProvisioningRequest)
+      );
+    }
+    openSessions++;
+    armTimer();
+  }
+
+  void LoadSession(
+      uint32_t promiseId,
+      cdm::SessionType,
+      const char* sessionId,
+      uint32_t sessionIdSize
+  ) final {
+    string id(sessionId, sessionIdSize);
+    FakeFile::read(host, id, [this, promiseId, id](bool success, const string& key) {
+      if (!success || key.size() != kKeySize) {
+        host->OnResolveNewSessionPromise(promiseId, nullptr, 0);
+        return;
+      }
+      persistentSessions.insert(id);
+      cdm::KeyInformation info = {};
+      info.key_id = reinterpret_cast<const uint8_t*>(key.data());
+      info.key_id_size = key.size();
+      info.status = cdm::kUsable;
+      host->OnSessionKeysChange(id.data(), id.size(), true, &info, 1);
+      host->OnResolveNewSessionPromise(promiseId, id.data(), id.size());
+    });
+  }
+
+  void UpdateSession(
+      uint32_t promiseId,
+      const char* sessionId,
+      uint32_t sessionIdSize,
+      const uint8_t* response,
+      uint32_t responseSize
+  ) final {
+    if (responseSize == 4 && !memcmp(response, "hold", 4)) {
+      return;
+    }
+    auto unprovisioned = unprovisionedSessions.find(string(sessionId, sessionIdSize));
+    if (unprovisioned != unprovisionedSessions.end()) {
+      string certificate(reinterpret_cast<const char*>(response), responseSize);
+      FakeFile::write(host, kCertificateName, certificate, [
+          this,
+          promiseId,
+          id = unprovisioned->first,
+          request = unprovisioned->second
+      ](bool success, const string&) {
+        if (!success) {
+          host->OnRejectPromise(promiseId, cdm::kExceptionInvalidStateError, 0, "", 0);
+          return;
+        }
+        provisioned = true;
+        unprovisionedSessions.erase(id);
+        host->OnResolvePromise(promiseId);
+        sendLicenseRequest(id, request);
+      });
+      return;
+    }
+    if (responseSize == kKeySize) {
+      cdm::KeyInformation key = {};
+      key.key_id = response;
+      key.key_id_size = responseSize;
+      key.status = cdm::kUsable;
+      host->OnSessionKeysChange(sessionId, sessionIdSize, true, &key, 1);
+      auto duration = getenv("WIDEVINE_FAKE_CDM_LICENSE_MS");
+      if (duration && *duration) {
+        auto expiry = host->GetCurrentWallTime() + atoll(duration) / 1000.0;
+        host->OnExpirationChange(sessionId, sessionIdSize, expiry);
+      }
+    }
+    string id(sessionId, sessionIdSize);
+    if (responseSize == kKeySize && persistentSessions.contains(id)) {
+      string key(reinterpret_cast<const char*>(response), responseSize);
+      FakeFile::write(host, id, key, [this, promiseId](bool success, const string&) {
+        if (success) {
+          host->OnResolvePromise(promiseId);
+        } else {
+          host->OnRejectPromise(promiseId, cdm::kExceptionInvalidStateError, 0, "", 0);
+        }
+      });
+      return;
+    }
+    host->OnResolvePromise(promiseId);
+  }
+
+  void sendLicenseRequest(const string& id, const string& request) {
+    host->OnSessionMessage(
+        id.data(),
+        id.size(),
+        cdm::kLicenseRequest,
+        request.data(),
+        request.size()
+    );
+  }
+
+  void CloseSession(uint32_t promiseId, const char* sessionId, uint32_t sessionIdSize) final {
+    host->OnResolvePromise(promiseId);
+    host->OnSessionClosed(sessionId, sessionIdSize);
+    unprovisionedSessions.erase(string(sessionId, sessionIdSize));
+    if (openSessions) {
+      openSessions--;
+    }
+  }
+
+  void RemoveSession(uint32_t promiseId, const char*, uint32_t) final {
+    host->OnResolvePromise(promiseId);
+  }
+
+  void TimerExpired(void*) final {
+    timerArmed = false;
+    armTimer();
+  }
+
+  void armTimer() {
+    if (openSessions && !timerArmed) {
+      timerArmed = true;
+      host->SetTimer(kTimerMs, this);
+    }
+  }
+
+  cdm::Status Decrypt(
+      const cdm::InputBuffer_2& input,
+      cdm::DecryptedBlock* decrypted
+  ) final {
+    auto buffer = host->Allocate(input.data_size);
+    if (buffer->Data() != input.data) {
+      memcpy(buffer->Data(), input.data, input.data_size);
+    }
+    buffer->SetSize(input.data_size);
+    decrypted->SetDecryptedBuffer(buffer);
+    return cdm::kSuccess;
+  }
+
+  cdm::Status InitializeAudioDecoder(const cdm::AudioDecoderConfig_2&) final {
+    return cdm::kInitializationError;
+  }
+  cdm::Status InitializeVideoDecoder(const cdm::VideoDecoderConfig_2&) final {
+    return cdm::kInitializationError;
+  }
+  void DeinitializeDecoder(cdm::StreamType) final { }
+  void ResetDecoder(cdm::StreamType) final { }
+  cdm::Status DecryptAndDecodeFrame(const cdm::InputBuffer_2&, cdm::VideoFrame*) final {
+    return cdm::kDecodeError;
+  }
+  cdm::Status DecryptAndDecodeSamples(const cdm::InputBuffer_2&, cdm::AudioFrames*) final {
+    return cdm::kDecodeError;
+  }
+  void OnPlatformChallengeResponse(const cdm::PlatformChallengeResponse&) final { }
+  void OnQueryOutputProtectionStatus(cdm::QueryResult, uint32_t, uint32_t) final { }
+  void OnStorageId(uint32_t, const uint8_t*, uint32_t) final { }
+
+  void Destroy() final {
+    delete this;
+  }
+
+  cdm::Host_10* host;
+  uint64_t nextSession = 0;
+  unordered_set<string> persistentSessions;
+  bool provisioned = false;
+  // Sessions waiting for provisioning, with the init data of their license
+  // request.
+  unordered_map<string, string> unprovisionedSessions;
+  uint64_t openSessions = 0;
+  bool timerArmed = false;
+};
+
+extern "C" {
+
+CDM_API void INITIALIZE_CDM_MODULE() {
+}
+
+CDM_API void DeinitializeCdmModule() {
+}
+
+CDM_API void* CreateCdmInstance(
+    int interfaceVersion,
+    const char*,
+    uint32_t,
+    GetCdmHostFunc getHost,
+    void* userData
+) {
+  if (interfaceVersion != cdm::ContentDecryptionModule_10::kVersion) {
+    return nullptr;
+  }
+  auto host = static_cast<cdm::Host_10*>(
+      getHost(cdm::Host_10::kVersion, userData)
+  );
+  if (!host) {
+    return nullptr;
+  }
+  return static_cast<cdm::ContentDecryptionModule_10*>(new FakeCdm(host));
+}
+
+CDM_API const char* GetCdmVersion() {
+  static const string version = [] {
+    Dl_info info;
+    if (!dladdr(reinterpret_cast<void*>(&GetCdmVersion), &info)
+        || !info.dli_fname) {
+      return string("fake");
+    }
+    auto dirname = [](const string& path) {
+      auto slash = path.rfind('/');
+      return slash == string::npos ? string() : path.substr(0, slash);
+    };
+    auto basename = [](const string& path) {
+      return path.substr(path.rfind('/') + 1);
+    };
+    // <version>/ in Firefox's layout, and
+    // <version>/_platform_specific/<platform>/ in Chromium's.
+    auto directory = dirname(info.dli_fname);
+    auto platforms = dirname(directory);
+    if (basename(platforms) == "_platform_specific") {
+      directory = dirname(platforms);
+    }
+    return directory.empty() ? string("fake") : basename(directory);
+  }();
+  return version.c_str();
+}
+
+}
@@ -0,0 +1,436 @@
+// SPDX-License-Identifier: MIT
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <vector>
+
+#include "cdm_executor.h"
+#include "file_io.h"
+#include "record_log.h"
+
+using std::lock_guard;
+using std::unique_lock;
+using std::vector;
+
+using Status = cdm::FileIOClient::Status;
+
+GST_DEBUG_CATEGORY_EXTERN(sparkle_widevine_debug_cat);
+#define GST_CAT_DEFAULT sparkle_widevine_debug_cat
+
+static const guint kMaxFileNameLength = 256;
+// Not a valid CDM file name, so it cannot clash with one.
+static const gchar kLogName[] = "_records.log";
+// Where a machine without a machine ID keeps the one made up for it.
+static const gchar kMachineIdName[] = "_machine-id";
+// When the device was provisioned and how long that took.
+static const gchar kProvisioningName[] = "_provisioning";
+static const gchar kDefaultStorageIdSalt[] = "sparkle-cdm-widevine";
+
+static mutex sharedLock;
+static FileStorage* sharedStorage = nullptr;
+static pid_t sharedPid = 0;
+
+FileStorage& FileStorage::shared() {
+  lock_guard guard(sharedLock);
+  if (sharedStorage && sharedPid == getpid()) {
+    return *sharedStorage;
+  }
+  // The parent's I/O thread did not survive fork(), and whatever it had
+  // queued is abandoned with it.
+  if (!sharedStorage) {
+    pthread_atfork(
+        [] { sharedLock.lock(); },
+        [] { sharedLock.unlock(); },
+        [] { sharedLock.unlock(); }
+    );
+  }
+
+  const gchar *origin = g_getenv("WIDEVINE_CDM_ORIGIN");
+  if (!origin || !*origin) {
+    origin = "default";
+  }
+  const gchar *root = g_getenv("WIDEVINE_CDM_STORAGE_DIR");
+  g_autofree gchar *defaultRoot = g_build_filename(
+      g_get_user_data_dir(),
+      "sparkle-cdm-widevine",
+      NULL
+  );
+  // Hashed, so that any origin makes a valid directory name that does not
+  // give away where content was played from.
+  g_autofree gchar *hash = g_compute_checksum_for_string(
+      G_CHECKSUM_SHA256,
+      origin,
+      -1
+  );
+  g_autofree gchar *directory = g_build_filename(
+      root && *root ? root : defaultRoot,
+      hash,
+      NULL
+  );
+  const gchar *useLog = g_getenv("WIDEVINE_CDM_STORAGE_LOG");
+  sharedStorage = new FileStorage(
+      origin,
+      directory,
+      useLog && g_strcmp0(useLog, "0") != 0
+  );
+  sharedPid = getpid();
+  return *sharedStorage;
+}
+
+FileStorage::FileStorage(
+    const string& origin,
+    const string& directory,
+    bool useLog
+)
+  : origin(origin)
+  , directory(directory)
+  , useLog(useLog) {
+  GST_INFO("storing cdm files for %s in %s", origin.c_str(), directory.c_str());
+  g_thread_unref(g_thread_new("widevine-cdm-io", [](gpointer self) -> gpointer {
+    static_cast<FileStorage*>(self)->loop();
+    return nullptr;
+  }, this));
+}
+
+void FileStorage::post(function<void()> work) {
+  lock_guard guard(lock);
+  queue.push_back(std::move(work));
+  wakeup.notify_one();
+}
+
+// The systemd (or D-Bus) machine ID, or failing that a random one kept in
+// |directory|.
+static string machine_id(const string& directory) {
+  for (auto path : { "/etc/machine-id", "/var/lib/dbus/machine-id" }) {
+    g_autofree gchar *contents = nullptr;
+    if (g_file_get_contents(path, &contents, nullptr, nullptr) && *g_strstrip(contents)) {
+      return contents;
+    }
+  }
+  g_autofree gchar *path = g_build_filename(directory.c_str(), kMachineIdName, NULL);
+  g_autofree gchar *stored = nullptr;
+  if (g_file_get_contents(path, &stored, nullptr, nullptr) && *g_strstrip(stored)) {
+    return stored;
+  }
+  g_autofree gchar *generated = g_uuid_string_random();
+  g_autoptr(GError) error = nullptr;
+  if (g_mkdir_with_parents(directory.c_str(), 0700) != 0
+      || !g_file_set_contents_full(
+          path,
+          generated,
+          -1,
+          G_FILE_SET_CONTENTS_CONSISTENT,
+          0600,
+          &error
+      )) {
+    // Still stable for as long as the process lives.
+    GST_WARNING("cannot keep a machine id in %s", path);
+  }
+  return generated;
+}
+
+const vector<uint8_t>& FileStorage::storageId() {
+  std::call_once(storageIdOnce, [this] {
+    auto start = g_get_monotonic_time();
+    const gchar *salt = g_getenv("WIDEVINE_CDM_STORAGE_ID_SALT");
+    if (!salt || !*salt) {
+      salt = kDefaultStorageIdSalt;
+    }
+    auto machine = machine_id(directory);
+    auto hmac = g_hmac_new(G_CHECKSUM_SHA256, (const guchar *) salt, strlen(salt));
+    g_hmac_update(hmac, (const guchar *) machine.data(), machine.size());
+    // Keeps "ab" + "c" apart from "a" + "bc".
+    g_hmac_update(hmac, (const guchar *) "", 1);
+    g_hmac_update(hmac, (const guchar *) origin.data(), origin.size());
+    storageIdValue.resize(g_checksum_type_get_length(G_CHECKSUM_SHA256));
+    gsize length = storageIdValue.size();
+    g_hmac_get_digest(hmac, storageIdValue.data(), &length);
+    g_hmac_unref(hmac);
+    GST_INFO("derived the storage id in %" G_GINT64_FORMAT " us",
+        g_get_monotonic_time() - start);
+  });
+  return storageIdValue;
+}
+
+bool FileStorage::acquire(const string& name) {
+  return inUse.insert(name).second;
+}
+
+void FileStorage::release(const string& name) {
+  inUse.erase(name);
+}
+
+bool FileStorage::prepare() {
+  if (prepared) {
+    return true;
+  }
+  if (g_mkdir_with_parents(directory.c_str(), 0700) != 0) {
+    GST_WARNING("cannot create %s: %s", directory.c_str(), g_strerror(errno));
+    return false;
+  }
+  if (useLog) {
+    g_autofree gchar *path = g_build_filename(directory.c_str(), kLogName, NULL);
+    // Not a file per record instead, which the processes sharing the log
+    // would not see.
+    log = RecordLog::open(path);
+    if (!log) {
+      return false;
+    }
+  }
+  prepared = true;
+  return true;
+}
+
+bool FileStorage::read(const string& name, vector<uint8_t>& data) {
+  if (log) {
+    auto record = log->get(name);
+    if (!record) {
+      return false;
+    }
+    data.assign(record->begin(), record->end());
+    return true;
+  }
+  g_autofree gchar *path = g_build_filename(directory.c_str(), name.c_str(), NULL);
+  g_autoptr(GError) error = nullptr;
+  gchar *contents = nullptr;
+  gsize length = 0;
+  if (!g_file_get_contents(path, &contents, &length, &error)) {
+    // A file that was never written reads as empty.
+    if (g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+      return true;
+    }
+    GST_WARNING("cannot read %s: %s", path, error->message);
+    return false;
+  }
+  if (length > G_MAXUINT32) {
+    g_free(contents);
+    return false;
+  }
+  data.assign((const uint8_t *) contents, (const uint8_t *) contents + length);
+  g_free(contents);
+  return true;
+}
+
+bool FileStorage::write(const string& name, span<const uint8_t> data) {
+  if (log) {
+    if (!log->put(name, data)) {
+      return false;
+    }
+    if (!compactionQueued && log->needsCompaction()) {
+      // After whatever is queued already.
+      compactionQueued = true;
+      post([this] {
+        compactionQueued = false;
+        log->compact();
+      });
+    }
+    return true;
+  }
+  g_autofree gchar *path = g_build_filename(directory.c_str(), name.c_str(), NULL);
+  if (data.empty()) {
+    if (g_unlink(path) != 0 && errno != ENOENT) {
+      GST_WARNING("cannot clear %s: %s", path, g_strerror(errno));
+      return false;
+    }
+    return true;
+  }
+  g_autoptr(GError) error = nullptr;
+  if (!g_file_set_contents_full(
+      path,
+      (const gchar *) data.data(),
+      data.size(),
+      G_FILE_SET_CONTENTS_CONSISTENT,
+      0600,
+      &error
+  )) {
+    GST_WARNING("cannot write %s: %s", path, error->message);
+    return false;
+  }
+  return true;
+}
+
+bool FileStorage::provisioned() {
+  if (!provisionedValue) {
+    vector<uint8_t> record;
+    if (!prepare() || !read(kProvisioningName, record)) {
+      return false;
+    }
+    provisionedValue = !record.empty();
+  }
+  return provisionedValue.value();
+}
+
+void FileStorage::markProvisioned(gint64 durationUs) {
+  g_autofree gchar *record = g_strdup_printf(
+      "%" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+      g_get_real_time() / G_USEC_PER_SEC,
+      durationUs
+  );
+  auto data = span((const uint8_t *) record, strlen(record));
+  if (prepare() && write(kProvisioningName, data)) {
+    provisionedValue = true;
+  }
+}
+
+void FileStorage::loop() {
+  unique_lock guard(lock);
+  for (;;) {
+    if (queue.empty()) {
+      wakeup.wait(guard);
+      continue;
+    }
+    auto work = std::move(queue.front());
+    queue.pop_front();
+    guard.unlock();
+    work();
+    guard.lock();
+  }
+}
+
+// Owned jointly by the FileIO and the operations in flight, so that the CDM
+// may close a file before they complete. Everything but |acquired| is only
+// touched on the executor; |acquired| only on the I/O thread.
+struct CdmFileIO::State {
+  State(cdm::FileIOClient* client, shared_ptr<FileIOSink> sink)
+    : client(client)
+    , sink(std::move(sink)) {
+  }
+
+  cdm::FileIOClient* const client;
+  const shared_ptr<FileIOSink> sink;
+  string name;
+  bool opening = false;
+  bool opened = false;
+  bool busy = false;
+  bool closed = false;
+  bool acquired = false;
+};
+
+// Runs |notify| on the executor unless the file has been closed or the CDM
+// destroyed by then.
+static void complete(
+    const shared_ptr<CdmFileIO::State>& state,
+    function<void(CdmFileIO::State&)> notify
+) {
+  auto& sink = *state->sink;
+  lock_guard guard(sink.lock);
+  if (!sink.executor) {
+    return;
+  }
+  sink.executor->post(CdmWork::Housekeeping, [state, notify = std::move(notify)] {
+    {
+      lock_guard guard(state->sink->lock);
+      if (!state->sink->executor) {
+        return;
+      }
+    }
+    if (!state->closed) {
+      notify(*state);
+    }
+  });
+}
+
+static bool valid_file_name(const string& name) {
+  if (name.empty() || name.size() > kMaxFileNameLength || name[0] == '_') {
+    return false;
+  }
+  for (auto c : name) {
+    if (!g_ascii_isalnum(c) && c != '.' && c != '_' && c != '-') {
+      return false;
+    }
+  }
+  // Letters, digits and dots would still allow these.
+  return name != "." && name != "..";
+}
+
+CdmFileIO::CdmFileIO(cdm::FileIOClient* client, shared_ptr<FileIOSink> sink)
+  : state(std::make_shared<State>(client, std::move(sink))) {
+}
+
+void CdmFileIO::Open(const char* file_name, uint32_t file_name_size) {
+  string name(file_name, file_name_size);
+  if (state->opening || state->opened || !valid_file_name(name)) {
+    GST_WARNING("%p: cannot open `%s'", this, name.c_str());
+    complete(state, [](State& state) {
+      state.client->OnOpenComplete(Status::kError);
+    });
+    return;
+  }
+  state->name = name;
+  state->opening = true;
+  auto& storage = FileStorage::shared();
+  storage.post([state = state, &storage] {
+    Status status = Status::kSuccess;
+    if (!storage.prepare()) {
+      status = Status::kError;
+    } else if (!storage.acquire(state->name)) {
+      status = Status::kInUse;
+    } else {
+      state->acquired = true;
+    }
+    complete(state, [status](State& state) {
+      state.opening = false;
+      state.opened = status == Status::kSuccess;
+      state.client->OnOpenComplete(status);
+    });
+  });
+}
+
+void CdmFileIO::Read() {
+  if (!state->opened || state->busy) {
+    auto status = state->opened ? Status::kInUse : Status::kError;
+    complete(state, [status](State& state) {
+      state.client->OnReadComplete(status, nullptr, 0);
+    });
+    return;
+  }
+  state->busy = true;
+  auto& storage = FileStorage::shared();
+  storage.post([state = state, &storage] {
+    auto data = std::make_shared<vector<uint8_t>>();
+    auto status = storage.read(state->name, *data) ? Status::kSuccess : Status::kError;
+    complete(state, [status, data](State& state) {
+      state.busy = false;
+      state.client->OnReadComplete(status, data->data(), data->size());
+    });
+  });
+}
+
+void CdmFileIO::Write(const uint8_t* data, uint32_t data_size) {
+  if (!state->opened || state->busy) {
+    auto status = state->opened ? Status::kInUse : Status::kError;
+    complete(state, [status](State& state) {
+      state.client->OnWriteComplete(status);
+    });
+    return;
+  }
+  state->busy = true;
+  vector<uint8_t> contents(data, data ? data + data_size : data);
+  auto& storage = FileStorage::shared();
+  storage.post([state = state, &storage, contents = std::move(contents)] {
+    auto status = storage.write(state->name, contents) ? Status::kSuccess : Status::kError;
+    complete(state, [status](State& state) {
+      state.busy = false;
+      state.client->OnWriteComplete(status);
+    });
+  });
+}
+
+void CdmFileIO::Close() {
+  state->closed = true;
+  if (state->opening || state->opened) {
+    auto& storage = FileStorage::shared();
+    storage.post([state = state, &storage] {
+      if (state->acquired) {
+        storage.release(state->name);
+      }
+    });
+  }
+  delete this;
+}
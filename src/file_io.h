@@ -0,0 +1,138 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include <glib.h>
+
+#include "content_decryption_module.h"
+
+using std::deque;
+using std::function;
+using std::mutex;
+using std::optional;
+using std::shared_ptr;
+using std::span;
+using std::string;
+using std::unique_ptr;
+using std::unordered_set;
+using std::vector;
+
+struct CdmExecutor;
+struct RecordLog;
+
+// Where the file operations of one system report back to. Detached once the
+// CDM is destroyed, after which completions are dropped.
+struct FileIOSink {
+  mutex lock;
+  CdmExecutor* executor = nullptr;
+};
+
+// The directory the CDM keeps its files in (licenses, certificates, ...), one
+// per origin, and the thread that does all the file I/O for the process.
+// Files are stored one per file name, or with WIDEVINE_CDM_STORAGE_LOG as
+// records of a single RecordLog, which scales to many more of them.
+struct FileStorage {
+  // The storage shared by the whole process, under WIDEVINE_CDM_STORAGE_DIR
+  // for the origin named by WIDEVINE_CDM_ORIGIN. Never destroyed. A process
+  // forked from one that used it gets an I/O thread of its own.
+  G_GNUC_INTERNAL
+  static FileStorage& shared();
+
+  FileStorage(const FileStorage&) = delete;
+  FileStorage& operator=(const FileStorage&) = delete;
+
+  // Queues |work| for the I/O thread.
+  G_GNUC_INTERNAL
+  void post(function<void()> work);
+
+  // The ID the CDM binds persistent data such as its provisioning to:
+  // HMAC-SHA256 of the machine ID and the origin, keyed with
+  // WIDEVINE_CDM_STORAGE_ID_SALT. The same across restarts; computed once.
+  G_GNUC_INTERNAL
+  const vector<uint8_t>& storageId();
+
+  // The rest is only called on the I/O thread.
+
+  // Creates the directory, and opens the log if there is one, the first time
+  // around.
+  G_GNUC_INTERNAL
+  bool prepare();
+
+  // Marks the file |name| as open, unless it is already.
+  G_GNUC_INTERNAL
+  bool acquire(const string& name);
+  G_GNUC_INTERNAL
+  void release(const string& name);
+
+  // Reads all of |name|, which is empty if it was never written.
+  G_GNUC_INTERNAL
+  bool read(const string& name, vector<uint8_t>& data);
+  // Replaces the contents of |name| at once, or deletes it if |data| is
+  // empty.
+  G_GNUC_INTERNAL
+  bool write(const string& name, span<const uint8_t> data);
+
+  // Whether the device was provisioned for this storage, as recorded by
+  // markProvisioned() in this or an earlier run. The CDM keeps the
+  // certificate itself in a file of its own.
+  G_GNUC_INTERNAL
+  bool provisioned();
+  G_GNUC_INTERNAL
+  void markProvisioned(gint64 durationUs);
+
+  const string origin;
+  const string directory;
+
+ private:
+  G_GNUC_INTERNAL
+  FileStorage(const string& origin, const string& directory, bool useLog);
+  G_GNUC_INTERNAL
+  void loop();
+
+  mutex lock;
+  std::condition_variable wakeup;
+  deque<function<void()>> queue;
+
+  std::once_flag storageIdOnce;
+  vector<uint8_t> storageIdValue;
+
+  const bool useLog;
+  bool prepared = false;
+  unique_ptr<RecordLog> log;
+  bool compactionQueued = false;
+  unordered_set<string> inUse;
+  optional<bool> provisionedValue;
+};
+
+// A file in the storage directory. The CDM calls in from the executor of its
+// system; the I/O itself happens on the storage thread and every outcome is
+// reported back on the executor, never from within the call that asked for it.
+// Writes go to a temporary file that replaces the previous contents in one
+// rename, so a crash leaves either the old or the new contents.
+struct CdmFileIO final : cdm::FileIO {
+  G_GNUC_INTERNAL
+  CdmFileIO(cdm::FileIOClient* client, shared_ptr<FileIOSink> sink);
+
+  G_GNUC_INTERNAL
+  void Open(const char* file_name, uint32_t file_name_size) final;
+  G_GNUC_INTERNAL
+  void Read() final;
+  G_GNUC_INTERNAL
+  void Write(const uint8_t* data, uint32_t data_size) final;
+  G_GNUC_INTERNAL
+  void Close() final;
+
+  struct State;
+
+ private:
+  shared_ptr<State> state;
+};
@@ -0,0 +1,114 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "open_cdm.h"
+#include "open_cdm_widevine.h"
+
+// Changes are acted upon once the directories settled for a second.
+static const gint64 kTimeoutUs = 10 * G_USEC_PER_SEC;
+
+static void
+remove_tree (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  if (dir) {
+    const gchar *name;
+    while ((name = g_dir_read_name (dir))) {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+      remove_tree (child);
+    }
+    g_dir_close (dir);
+  }
+  g_remove (path);
+}
+
+// Installs a copy of |blob| as |version| of the CDM under |root|, laid out as
+// Chromium unpacks it. Each copy is a file of its own, so that it is loaded
+// next to the others rather than handed out again.
+static void
+install_version (const gchar *blob, const gchar *root, const gchar *version)
+{
+  g_autofree gchar *platform = g_build_filename (root, version,
+      "_platform_specific", "linux_x64", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (platform, 0700), ==, 0);
+  g_autofree gchar *contents = NULL;
+  gsize length;
+  g_assert_true (g_file_get_contents (blob, &contents, &length, NULL));
+  g_autofree gchar *copy = g_build_filename (platform, "libwidevinecdm.so",
+      NULL);
+  g_assert_true (g_file_set_contents (copy, contents, length, NULL));
+}
+
+static const gchar *
+create_and_get_version (OpenCDMSystem **system)
+{
+  *system = opencdm_create_system ("com.widevine.alpha");
+  g_assert_nonnull (*system);
+  auto version = opencdm_widevine_system_get_cdm_version (*system);
+  g_assert_nonnull (version);
+  return version;
+}
+
+// A browser unpacking a new version next to the one in use has systems
+// created from then on use it, while the existing ones keep the old blob.
+static void
+test_new_version (const gchar *blob, const gchar *tmp)
+{
+  g_autofree gchar *versions = g_build_filename (tmp, "config", "chromium",
+      "WidevineCdm", NULL);
+  install_version (blob, versions, "1.0");
+  g_assert_cmpint (opencdm_init (), ==, ERROR_NONE);
+
+  OpenCDMSystem *old_system;
+  g_assert_cmpstr (create_and_get_version (&old_system), ==, "1.0");
+
+  // Unpacked aside and moved in at once, as browsers do.
+  g_autofree gchar *staging = g_build_filename (tmp, "staging", NULL);
+  install_version (blob, staging, "2.0");
+  g_autofree gchar *staged = g_build_filename (staging, "2.0", NULL);
+  g_autofree gchar *installed = g_build_filename (versions, "2.0", NULL);
+  g_assert_cmpint (g_rename (staged, installed), ==, 0);
+
+  auto deadline = g_get_monotonic_time () + kTimeoutUs;
+  for (;;) {
+    OpenCDMSystem *system;
+    g_autofree gchar *version = g_strdup (create_and_get_version (&system));
+    opencdm_destruct_system (system);
+    if (g_strcmp0 (version, "2.0") == 0)
+      break;
+    g_assert_cmpstr (version, ==, "1.0");
+    g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+    g_usleep (50000);
+  }
+
+  g_assert_cmpstr (opencdm_widevine_system_get_cdm_version (old_system), ==,
+      "1.0");
+  opencdm_destruct_system (old_system);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  // The blob is found by searching the browsers' directories, which is what
+  // hot reloading watches, rather than named directly.
+  g_autofree gchar *blob = g_strdup (g_getenv ("WIDEVINE_CDM_BLOB"));
+  g_assert_nonnull (blob);
+  g_unsetenv ("WIDEVINE_CDM_BLOB");
+
+  g_autofree gchar *tmp = g_dir_make_tmp ("hot-reload-test-XXXXXX", NULL);
+  g_assert_nonnull (tmp);
+  g_autofree gchar *home = g_build_filename (tmp, "home", NULL);
+  g_autofree gchar *config = g_build_filename (tmp, "config", NULL);
+  g_autofree gchar *cache = g_build_filename (tmp, "cache", NULL);
+  g_autofree gchar *storage = g_build_filename (tmp, "storage", NULL);
+  g_setenv ("HOME", home, TRUE);
+  g_setenv ("XDG_CONFIG_HOME", config, TRUE);
+  g_setenv ("XDG_CACHE_HOME", cache, TRUE);
+  g_setenv ("WIDEVINE_CDM_STORAGE_DIR", storage, TRUE);
+  g_setenv ("WIDEVINE_CDM_HOT_RELOAD", "1", TRUE);
+
+  test_new_version (blob, tmp);
+
+  remove_tree (tmp);
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include <glib.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "key_table.h"
+#include "snapshot.h"
+
+using std::atomic;
+using std::thread;
+using std::vector;
+
+static const unsigned kKeyPool = 64;
+static const unsigned kKeysPerGeneration = 4;
+static const unsigned kGenerations = 20000;
+static const unsigned kReaders = 8;
+
+static KeyId keyId(unsigned index) {
+  KeyId id = {};
+  id.bytes[0] = index;
+  id.bytes[15] = ~index;
+  return id;
+}
+
+// Marks the keys of |generation| usable and every other key expired, the way
+// a license rotation would.
+static void rotate(KeyTable& table, unsigned generation) {
+  for (auto i = 0U; i < kKeyPool; i++) {
+    table.update(keyId(i), cdm::KeyStatus::kExpired, 0);
+  }
+  for (auto i = 0U; i < kKeysPerGeneration; i++) {
+    auto index = (generation * kKeysPerGeneration + i) % kKeyPool;
+    table.update(keyId(index), cdm::KeyStatus::kUsable, generation);
+  }
+}
+
+// Readers must only ever observe complete rotations: exactly one
+// generation's worth of usable keys, all tagged with the same generation.
+static void
+test_rotation_snapshots (void)
+{
+  KeyTable initial;
+  rotate(initial, 0);
+  Snapshot<KeyTable> keys(initial);
+  atomic<bool> done = false;
+  atomic<uint64_t> reads = 0;
+
+  vector<thread> readers;
+  for (auto r = 0U; r < kReaders; r++) {
+    readers.emplace_back([&, r]() {
+      uint64_t local = 0;
+      uint32_t lastGeneration = 0;
+      while (!done.load()) {
+        auto generation = keys.read([&](const KeyTable& table) {
+          uint32_t seen = G_MAXUINT32;
+          auto usable = 0U;
+          table.forEach([&](const KeyEntry& key) {
+            if (key.keyStatus() != cdm::KeyStatus::kUsable) {
+              return;
+            }
+            usable++;
+            if (seen == G_MAXUINT32) {
+              seen = key.systemCode;
+            }
+            g_assert_cmpuint(key.systemCode, ==, seen);
+          });
+          g_assert_cmpuint(usable, ==, kKeysPerGeneration);
+          auto probe = table.find(keyId((seen * kKeysPerGeneration + r) % kKeyPool));
+          g_assert_true(probe.has_value());
+          return seen;
+        });
+        g_assert_cmpuint(generation, >=, lastGeneration);
+        lastGeneration = generation;
+        local++;
+      }
+      reads += local;
+    });
+  }
+
+  for (auto generation = 1U; generation <= kGenerations; generation++) {
+    keys.update([&](KeyTable& table) { rotate(table, generation); });
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+
+  keys.read([](const KeyTable& table) {
+    auto last = table.find(keyId((kGenerations * kKeysPerGeneration) % kKeyPool));
+    g_assert_true(last.has_value());
+    g_assert_cmpuint(last->systemCode, ==, kGenerations);
+  });
+  g_assert_cmpuint(keys.pendingReclamation(), ==, 0);
+  g_print("%u rotations, %lu snapshot reads\n", kGenerations, (unsigned long) reads.load());
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  test_rotation_snapshots ();
+  return 0;
+}
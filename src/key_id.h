@@ -0,0 +1,39 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+
+using std::array;
+using std::optional;
+using std::span;
+
+// A Widevine key ID. Key IDs are always 16 bytes, so they are stored and
+// compared by value rather than as heap allocated strings.
+struct KeyId {
+  static constexpr size_t kSize = 16;
+
+  array<uint8_t, kSize> bytes;
+
+  static optional<KeyId> from(span<const uint8_t> data) {
+    if (data.size() != kSize) {
+      return std::nullopt;
+    }
+    KeyId id;
+    memcpy(id.bytes.data(), data.data(), kSize);
+    return id;
+  }
+
+  bool operator==(const KeyId& other) const = default;
+};
+
+struct KeyIdHash {
+  size_t operator()(const KeyId& id) const {
+    uint64_t high, low;
+    memcpy(&high, id.bytes.data(), sizeof(high));
+    memcpy(&low, id.bytes.data() + sizeof(high), sizeof(low));
+    return high ^ (low * 0x9e3779b97f4a7c15ULL);
+  }
+};
@@ -0,0 +1,58 @@
+// SPDX-License-Identifier: MIT
+
+#include "key_table.h"
+
+static size_t slotIndex(const KeyId& id, size_t capacity) {
+  return KeyIdHash()(id) & (capacity - 1);
+}
+
+void KeyTable::update(
+    const KeyId& id,
+    cdm::KeyStatus status,
+    uint32_t systemCode
+) {
+  if ((count + 1) * 4 > slots.size() * 3) {
+    grow();
+  }
+  auto mask = slots.size() - 1;
+  for (auto i = slotIndex(id, slots.size());; i = (i + 1) & mask) {
+    auto& slot = slots[i];
+    if (slot.status == KeyEntry::kEmpty) {
+      slot.id = id;
+      count++;
+    } else if (slot.id != id) {
+      continue;
+    }
+    slot.status = static_cast<uint8_t>(status);
+    slot.systemCode = systemCode;
+    return;
+  }
+}
+
+optional<KeyEntry> KeyTable::find(const KeyId& id) const {
+  if (slots.empty()) {
+    return std::nullopt;
+  }
+  auto mask = slots.size() - 1;
+  for (auto i = slotIndex(id, slots.size());; i = (i + 1) & mask) {
+    const auto& slot = slots[i];
+    if (slot.status == KeyEntry::kEmpty) {
+      return std::nullopt;
+    }
+    if (slot.id == id) {
+      return slot;
+    }
+  }
+}
+
+void KeyTable::grow() {
+  auto capacity = slots.empty() ? kInitialCapacity : slots.size() * 2;
+  vector<KeyEntry> old(capacity, KeyEntry { {}, KeyEntry::kEmpty, 0 });
+  old.swap(slots);
+  count = 0;
+  for (const auto& slot : old) {
+    if (slot.status != KeyEntry::kEmpty) {
+      update(slot.id, slot.keyStatus(), slot.systemCode);
+    }
+  }
+}
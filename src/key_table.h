@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <glib.h>
+#include "content_decryption_module.h"
+
+#include "key_id.h"
+
+using std::optional;
+using std::span;
+using std::vector;
+
+struct KeyEntry {
+  static constexpr uint8_t kEmpty = 0xff;
+
+  KeyId id;
+  uint8_t status;
+  uint32_t systemCode;
+
+  [[nodiscard]] cdm::KeyStatus keyStatus() const {
+    return static_cast<cdm::KeyStatus>(status);
+  }
+};
+
+// The keys of one session and their latest status. A small open-addressed
+// table of KeyEntry slots: the few keys a session usually carries fit in a
+// couple of cache lines and lookups never allocate. Keys are never removed
+// from a table; one is rebuilt whenever the CDM reports a new key set.
+struct KeyTable {
+  G_GNUC_INTERNAL
+  void update(const KeyId& id, cdm::KeyStatus status, uint32_t systemCode);
+  G_GNUC_INTERNAL
+  optional<KeyEntry> find(const KeyId& id) const;
+
+  [[nodiscard]] size_t size() const { return count; }
+
+  template <typename Func>
+  void forEach(Func&& func) const {
+    for (const auto& slot : slots) {
+      if (slot.status != KeyEntry::kEmpty) {
+        func(slot);
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t kInitialCapacity = 4;
+
+  G_GNUC_INTERNAL
+  void grow();
+
+  vector<KeyEntry> slots;
+  size_t count = 0;
+};
@@ -0,0 +1,101 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+
+#include <cstring>
+
+#include "open_cdm.h"
+#include "open_cdm_adapter.h"
+
+// What fetching a license from a server typically adds to starting playback.
+static const gulong kLicenseRoundTripUs = 50 * G_TIME_SPAN_MILLISECOND;
+static const unsigned kIterations = 10;
+static const uint8_t kKeyId[16] = {
+  0x10, 0x32, 0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe,
+  0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+};
+
+static void
+remove_tree (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  if (dir) {
+    const gchar *name;
+    while ((name = g_dir_read_name (dir))) {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+      remove_tree (child);
+    }
+    g_dir_close (dir);
+  }
+  g_remove (path);
+}
+
+static void
+decrypt (OpenCDMSession *session)
+{
+  g_assert_cmpint (opencdm_session_status (session, kKeyId, sizeof (kKeyId)),
+      ==, Usable);
+  auto buffer = gst_buffer_new_allocate (NULL, 4096, NULL);
+  auto iv = gst_buffer_new_allocate (NULL, 16, NULL);
+  auto keyId = gst_buffer_new_allocate (NULL, sizeof (kKeyId), NULL);
+  gst_buffer_fill (keyId, 0, kKeyId, sizeof (kKeyId));
+  g_assert_cmpint (opencdm_gstreamer_session_decrypt (session, buffer, NULL, 0,
+      iv, keyId, 0), ==, ERROR_NONE);
+  gst_buffer_unref (keyId);
+  gst_buffer_unref (iv);
+  gst_buffer_unref (buffer);
+}
+
+// From creating the system to the first decrypted sample. Without a stored
+// license the key comes from a license server; with one it is loaded from the
+// storage directory.
+static gint64
+time_to_first_decrypt (unsigned content, bool persisted)
+{
+  static OpenCDMSessionCallbacks callbacks = {};
+  uint8_t initData[] = { 0x00, 0x00, 0x00, (uint8_t) content };
+  auto start = g_get_monotonic_time ();
+
+  auto system = opencdm_create_system ("com.widevine.alpha");
+  g_assert_nonnull (system);
+  OpenCDMSession *session = nullptr;
+  g_assert_cmpint (opencdm_construct_session (system, PersistentLicense,
+      "cenc", initData, sizeof (initData), nullptr, 0, &callbacks, nullptr,
+      &session), ==, ERROR_NONE);
+  if (persisted) {
+    g_assert_cmpint (opencdm_session_load (session), ==, ERROR_NONE);
+  } else {
+    g_usleep (kLicenseRoundTripUs);
+    g_assert_cmpint (opencdm_session_update (session, kKeyId,
+        sizeof (kKeyId)), ==, ERROR_NONE);
+  }
+  decrypt (session);
+  gint64 elapsed = g_get_monotonic_time () - start;
+
+  g_assert_cmpint (opencdm_session_close (session), ==, ERROR_NONE);
+  opencdm_destruct_session (session);
+  opencdm_destruct_system (system);
+  return elapsed;
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  gst_init (&argc, &argv);
+  g_autofree gchar *storage = g_dir_make_tmp ("license-bench-XXXXXX", NULL);
+  g_assert_nonnull (storage);
+  g_setenv ("WIDEVINE_CDM_STORAGE_DIR", storage, TRUE);
+  g_assert_cmpint (opencdm_init (), ==, ERROR_NONE);
+
+  gint64 networkUs = 0, persistedUs = 0;
+  for (auto i = 0U; i < kIterations; i++) {
+    networkUs += time_to_first_decrypt (i, false);
+    persistedUs += time_to_first_decrypt (i, true);
+  }
+  g_print ("time to first decrypt over %u runs: license server avg %"
+      G_GINT64_FORMAT " us, persisted license avg %" G_GINT64_FORMAT " us\n",
+      kIterations, networkUs / kIterations, persistedUs / kIterations);
+
+  remove_tree (storage);
+  return 0;
+}
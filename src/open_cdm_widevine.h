@@ -0,0 +1,340 @@
+/*
+ * Widevine specific extensions to the OpenCDM API implemented by
+ * sparkle-cdm-widevine.
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef __OPEN_CDM_WIDEVINE_H
+#define __OPEN_CDM_WIDEVINE_H
+
+#include <glib.h>
+
+#include "open_cdm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Runtime counters of an \ref OpenCDMSystem, meant for sizing and tuning.
+ */
+typedef struct {
+    /** Decrypt output buffers served from the per-system pool. */
+    uint64_t buffer_pool_hits;
+    /** Decrypt output buffers that had to be allocated from the heap. */
+    uint64_t buffer_pool_misses;
+    /** Bytes currently held by the pool for reuse. The upper bound can be set
+     * with the WIDEVINE_CDM_BUFFER_POOL_MAX_BYTES environment variable. */
+    uint64_t buffer_pool_retained_bytes;
+    /** Promises handed to the CDM that it has not resolved or rejected yet. */
+    uint64_t outstanding_promises;
+    /** Wakeups of the CDM thread that found decrypt requests queued. */
+    uint64_t executor_decrypt_batches;
+    /** Decrypt requests run on the CDM thread; divided by the batch count
+     * this gives the average batch size. */
+    uint64_t executor_decrypt_requests;
+    /** Microseconds the CDM took to initialize, 0 until it has. */
+    int64_t cdm_initialize_us;
+    /** Microseconds session construction spent waiting for the CDM to
+     * initialize. With WIDEVINE_CDM_EAGER_INIT set this is only the part of
+     * the warm-up that had not finished in the background yet. */
+    int64_t cdm_initialize_wait_us;
+    /** Microseconds from handing an individualization request to the
+     * application to the CDM accepting the response, 0 unless the device was
+     * provisioned through this system. */
+    int64_t provisioning_us;
+    /** Individualization requests handed to the application. */
+    uint64_t provisioning_requests;
+    /** Sessions that went straight to their license request because the
+     * provisioning of an earlier run was found in storage. */
+    uint64_t provisioning_cache_hits;
+    /** Renewals signalled through the renewal callback ahead of an
+     * expiration. */
+    uint64_t renewals_signalled;
+    /** Licenses whose expiration was pushed back. */
+    uint64_t renewals;
+    /** Licenses that expired before they were renewed. */
+    uint64_t licenses_expired;
+    /** Smallest and average time left before the expiration when a license
+     * was renewed, in milliseconds, negative if it had expired already. 0
+     * until a license was renewed. */
+    int64_t renewal_margin_min_ms;
+    int64_t renewal_margin_avg_ms;
+} OpenCDMWidevineSystemMetrics;
+
+/**
+ * \brief Retrieves the runtime counters of a system.
+ *
+ * \param system Instance of \ref OpenCDMSystem.
+ * \param metrics Output, filled in on success.
+ * \return Zero on success, non-zero on error.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_system_get_metrics(
+    struct OpenCDMSystem* system,
+    OpenCDMWidevineSystemMetrics* metrics);
+
+/**
+ * \brief Returns the version of the CDM blob a system uses.
+ *
+ * With WIDEVINE_CDM_HOT_RELOAD set, systems created after the browser updated
+ * the CDM report the version of the new blob, while existing ones keep the
+ * blob they were created with.
+ *
+ * \param system Instance of \ref OpenCDMSystem.
+ * \return The version the blob reports, valid as long as \p system, or NULL
+ *         if the blob does not report one.
+ */
+EXTERNAL const char* opencdm_widevine_system_get_cdm_version(
+    struct OpenCDMSystem* system);
+
+/*
+ * Session callbacks, and the callbacks below, run on the CDM thread of the
+ * system. The blocking calls cannot wait for the CDM from there, as it only
+ * gets to them once the callback has returned: they fail with ERROR_FAIL
+ * without doing anything. Use their opencdm_widevine_*_async variants from
+ * callbacks instead.
+ */
+
+/**
+ * Receives the individualization (provisioning) request of a device that the
+ * CDM has no certificate for yet. The application sends \p request to the
+ * provisioning server and passes the response to \ref opencdm_session_update
+ * (or its asynchronous variant) on the same session, after which the CDM
+ * carries on with the license request. The CDM stores the certificate in the
+ * storage directory, so later sessions skip provisioning. Runs on the CDM
+ * thread of the system.
+ *
+ * \param session The session that is waiting for the device to be
+ *        provisioned.
+ * \param userData Pointer passed along with the callback.
+ * \param request Buffer containing the request.
+ * \param requestLength Length of the request (in bytes).
+ */
+typedef void (*OpenCDMWidevineIndividualizationCallback)(
+    struct OpenCDMSession* session,
+    void* userData,
+    const uint8_t request[],
+    const uint32_t requestLength);
+
+/**
+ * \brief Sets where individualization requests of a system go.
+ *
+ * Without a callback, a session that needs the device provisioned reports an
+ * error through its error_message_callback instead.
+ *
+ * \param system Instance of \ref OpenCDMSystem.
+ * \param callback The callback, or NULL to unset it.
+ * \param userData Pointer passed along with the callback.
+ * \return Zero on success, non-zero on error.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_system_set_individualization_callback(
+    struct OpenCDMSystem* system,
+    OpenCDMWidevineIndividualizationCallback callback,
+    void* userData);
+
+/**
+ * Signals that the license of a session is about to expire and should be
+ * renewed, for instance with a new license from the license server passed
+ * to \ref opencdm_session_update. Renewal messages the CDM generates itself
+ * are delivered through process_challenge_callback, like license requests.
+ * The signal comes at a random point in the window that ends
+ * WIDEVINE_CDM_RENEWAL_LEAD_MS before the expiration and starts
+ * WIDEVINE_CDM_RENEWAL_JITTER_MS earlier, so that sessions expiring together
+ * do not all renew at once. Runs on the CDM thread of the system.
+ *
+ * \param session The session whose license is about to expire.
+ * \param userData Pointer passed along with the callback.
+ * \param expiration When the license expires, in milliseconds since the
+ *        Unix epoch.
+ */
+typedef void (*OpenCDMWidevineRenewalCallback)(
+    struct OpenCDMSession* session,
+    void* userData,
+    const int64_t expiration);
+
+/**
+ * \brief Sets where the renewal signals of a system go.
+ *
+ * \param system Instance of \ref OpenCDMSystem.
+ * \param callback The callback, or NULL to unset it.
+ * \param userData Pointer passed along with the callback.
+ * \return Zero on success, non-zero on error.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_system_set_renewal_callback(
+    struct OpenCDMSystem* system,
+    OpenCDMWidevineRenewalCallback callback,
+    void* userData);
+
+/**
+ * \brief Prepares a process to be forked into workers.
+ *
+ * Finds, loads and initializes the CDM module, without starting any thread,
+ * so that processes forked afterwards inherit the module ready to use: they
+ * call opencdm_init() and opencdm_create_system() as usual, and skip the
+ * search, the loading and the module initialization. The zygote itself
+ * should not create systems; the call fails if it has some already.
+ * Hot reloading (WIDEVINE_CDM_HOT_RELOAD) is not available in that mode.
+ *
+ * \return Zero on success, non-zero on error.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_zygote_init(void);
+
+/**
+ * Process wide counters of the pool of CDM instances that
+ * \ref opencdm_destruct_system recycles when WIDEVINE_CDM_POOL_SIZE is set.
+ */
+typedef struct {
+    /** Systems created from a recycled CDM instance. */
+    uint64_t hits;
+    /** Systems that needed a new CDM instance while the pool was enabled. */
+    uint64_t misses;
+    /** Systems kept in the pool when destroyed. */
+    uint64_t recycled;
+    /** Pooled instances destroyed after sitting idle for
+     * WIDEVINE_CDM_POOL_IDLE_SECONDS. */
+    uint64_t reaped;
+    /** Instances currently waiting in the pool. */
+    uint64_t idle;
+} OpenCDMWidevineCdmPoolMetrics;
+
+/**
+ * \brief Retrieves the counters of the CDM instance pool.
+ *
+ * \param metrics Output, filled in on success.
+ * \return Zero on success, non-zero on error.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_get_cdm_pool_metrics(
+    OpenCDMWidevineCdmPoolMetrics* metrics);
+
+/**
+ * Runtime counters of an \ref OpenCDMSession.
+ */
+typedef struct {
+    /** Decrypted bytes copied back from a host buffer into the sample. */
+    uint64_t decrypt_copied_bytes;
+    /** Decrypted bytes the CDM wrote straight into the sample, with
+     * WIDEVINE_CDM_DECRYPT_IN_PLACE set. */
+    uint64_t decrypt_zero_copy_bytes;
+    /** Encrypted bytes duplicated before decrypting because the memory
+     * holding them was shared with another buffer. */
+    uint64_t decrypt_duplicated_bytes;
+} OpenCDMWidevineSessionMetrics;
+
+/**
+ * \brief Retrieves the runtime counters of a session.
+ *
+ * \param session Instance of \ref OpenCDMSession.
+ * \param metrics Output, filled in on success.
+ * \return Zero on success, non-zero on error.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_session_get_metrics(
+    const struct OpenCDMSession* session,
+    OpenCDMWidevineSessionMetrics* metrics);
+
+/**
+ * Reports the outcome of an asynchronous call.
+ *
+ * \param result ERROR_NONE on success, the error the blocking call would have
+ *        returned otherwise.
+ * \param user_data The pointer passed along with the callback.
+ */
+typedef void (*OpenCDMWidevineCompletion)(OpenCDMError result, void* user_data);
+
+/**
+ * Reports the outcome of \ref opencdm_widevine_construct_session_async.
+ *
+ * \param session The new session on success, NULL otherwise.
+ * \param result ERROR_NONE on success, the error the blocking call would have
+ *        returned otherwise.
+ * \param user_data The pointer passed along with the callback.
+ */
+typedef void (*OpenCDMWidevineSessionCompletion)(
+    struct OpenCDMSession* session,
+    OpenCDMError result,
+    void* user_data);
+
+/*
+ * Asynchronous variants of the calls that wait for the CDM to settle a
+ * license operation. They return as soon as the request has been handed to
+ * the CDM; the completion then runs exactly once, dispatched from |context|,
+ * or from the thread default main context of the caller if |context| is NULL.
+ * It never runs from within the call that started the operation, even if the
+ * CDM answers right away. A non-zero return value means the arguments were
+ * rejected and the completion will not run. Destroying a session fails what
+ * is still outstanding for it with ERROR_FAIL, and destroying the system fails
+ * whatever is still outstanding at all.
+ */
+
+/**
+ * \brief Asynchronous variant of \ref opencdm_system_set_server_certificate.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_system_set_server_certificate_async(
+    struct OpenCDMSystem* system,
+    const uint8_t serverCertificate[],
+    const uint16_t serverCertificateLength,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* user_data);
+
+/**
+ * \brief Asynchronous variant of \ref opencdm_construct_session.
+ *
+ * The session callbacks and their \p userData are used as in the blocking
+ * call, so the license request may be delivered before \p complete runs.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_construct_session_async(
+    struct OpenCDMSystem* system,
+    const LicenseType licenseType,
+    const char initDataType[],
+    const uint8_t initData[],
+    const uint16_t initDataLength,
+    OpenCDMSessionCallbacks* callbacks,
+    void* userData,
+    GMainContext* context,
+    OpenCDMWidevineSessionCompletion complete,
+    void* complete_data);
+
+/**
+ * \brief Asynchronous variant of \ref opencdm_session_load.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_session_load_async(
+    struct OpenCDMSession* session,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* user_data);
+
+/**
+ * \brief Asynchronous variant of \ref opencdm_session_update.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_session_update_async(
+    struct OpenCDMSession* session,
+    const uint8_t keyMessage[],
+    const uint16_t keyLength,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* user_data);
+
+/**
+ * \brief Asynchronous variant of \ref opencdm_session_remove.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_session_remove_async(
+    struct OpenCDMSession* session,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* user_data);
+
+/**
+ * \brief Asynchronous variant of \ref opencdm_session_close.
+ */
+EXTERNAL OpenCDMError opencdm_widevine_session_close_async(
+    struct OpenCDMSession* session,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* user_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __OPEN_CDM_WIDEVINE_H
@@ -0,0 +1,80 @@
+// SPDX-License-Identifier: MIT
+
+#include <mutex>
+
+#include "promise_registry.h"
+
+using std::lock_guard;
+
+void rejectSlot(PromiseSlot& slot, const RejectedPromise& rejection) {
+  std::visit([&](auto& pending) {
+    using Slot = std::decay_t<decltype(pending)>;
+    if constexpr (std::is_same_v<Slot, CreateSessionSlot>) {
+      pending.complete({ rejection });
+    } else {
+      pending({ rejection });
+    }
+  }, slot);
+}
+
+void PromiseRegistry::add(
+    uint32_t id,
+    PromiseSlot slot,
+    const OpenCDMSession* session
+) {
+  lock_guard guard(lock);
+  slots.insert_or_assign(id, Entry { std::move(slot), session });
+}
+
+optional<PromiseSlot> PromiseRegistry::take(uint32_t id) {
+  lock_guard guard(lock);
+  auto entry = slots.find(id);
+  if (entry == slots.end()) {
+    return nullopt;
+  }
+  auto slot = std::move(entry->second.slot);
+  slots.erase(entry);
+  return slot;
+}
+
+size_t PromiseRegistry::outstanding() {
+  lock_guard guard(lock);
+  return slots.size();
+}
+
+size_t PromiseRegistry::rejectAll(
+    cdm::Exception exception,
+    const string& message
+) {
+  unordered_map<uint32_t, Entry> rejected;
+  {
+    lock_guard guard(lock);
+    rejected.swap(slots);
+  }
+  for (auto& [id, entry] : rejected) {
+    rejectSlot(entry.slot, { id, exception, 0, message });
+  }
+  return rejected.size();
+}
+
+size_t PromiseRegistry::rejectSession(
+    const OpenCDMSession& session,
+    cdm::Exception exception,
+    const string& message
+) {
+  unordered_map<uint32_t, Entry> rejected;
+  {
+    lock_guard guard(lock);
+    for (auto entry = slots.begin(); entry != slots.end();) {
+      if (entry->second.session == &session) {
+        rejected.insert(slots.extract(entry++));
+      } else {
+        entry++;
+      }
+    }
+  }
+  for (auto& [id, entry] : rejected) {
+    rejectSlot(entry.slot, { id, exception, 0, message });
+  }
+  return rejected.size();
+}
@@ -0,0 +1,197 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <variant>
+
+#include <glib.h>
+#include "open_cdm.h"
+#include "content_decryption_module.h"
+
+#include "session.h"
+
+using std::function;
+using std::monostate;
+using std::mutex;
+using std::nullopt;
+using std::optional;
+using std::shared_ptr;
+using std::span;
+using std::string;
+using std::unordered_map;
+using std::variant;
+
+struct RejectedPromise {
+  uint32_t id;
+  cdm::Exception exception;
+  uint32_t system_code;
+  string message;
+
+  OpenCDMError openCdmError() {
+    switch (exception) {
+      case cdm::Exception::kExceptionInvalidStateError:
+      case cdm::Exception::kExceptionNotSupportedError:
+      case cdm::Exception::kExceptionQuotaExceededError:
+      case cdm::Exception::kExceptionTypeError:
+        return ERROR_FAIL;
+      default:
+        return ERROR_UNKNOWN;
+    }
+  }
+};
+
+struct UpdateSessionResponse : variant<monostate, RejectedPromise> {
+  bool isOk() {
+    return std::get_if<monostate>(this);
+  }
+  optional<RejectedPromise> error() {
+    if (std::holds_alternative<RejectedPromise>(*this)) {
+      return std::get<RejectedPromise>(*this);
+    } else {
+      return nullopt;
+    }
+  }
+};
+
+struct LoadSessionResponse : variant<monostate, RejectedPromise> {
+  bool isOk() {
+    return std::get_if<monostate>(this);
+  }
+  optional<RejectedPromise> error() {
+    if (std::holds_alternative<RejectedPromise>(*this)) {
+      return std::get<RejectedPromise>(*this);
+    } else {
+      return nullopt;
+    }
+  }
+};
+
+struct RemoveSessionResponse : variant<monostate, RejectedPromise> {
+  bool isOk() {
+    return std::get_if<monostate>(this);
+  }
+  optional<RejectedPromise> error() {
+    if (std::holds_alternative<RejectedPromise>(*this)) {
+      return std::get<RejectedPromise>(*this);
+    } else {
+      return nullopt;
+    }
+  }
+};
+
+struct CloseSessionResponse : variant<monostate, RejectedPromise> {
+  bool isOk() {
+    return std::get_if<monostate>(this);
+  }
+  optional<RejectedPromise> error() {
+    if (std::holds_alternative<RejectedPromise>(*this)) {
+      return std::get<RejectedPromise>(*this);
+    } else {
+      return nullopt;
+    }
+  }
+};
+
+struct CreateSessionRequest {
+  cdm::SessionType sessionType;
+  OpenCDMSessionCallbacks* callbacks;
+  void* userData;
+};
+
+struct CreateSessionResponse : variant<shared_ptr<OpenCDMSession>, RejectedPromise> {
+  optional<shared_ptr<OpenCDMSession>> session() {
+    if (std::holds_alternative<shared_ptr<OpenCDMSession>>(*this)) {
+      return std::get<shared_ptr<OpenCDMSession>>(*this);
+    } else {
+      return nullopt;
+    }
+  }
+  optional<RejectedPromise> error() {
+    if (std::holds_alternative<RejectedPromise>(*this)) {
+      return std::get<RejectedPromise>(*this);
+    } else {
+      return nullopt;
+    }
+  }
+};
+
+struct SetServerCertificateRequest {
+  span<const uint8_t> certificate;
+};
+
+struct SetServerCertificateResponse : variant<monostate, RejectedPromise> {
+  optional<RejectedPromise> error() {
+    if (std::holds_alternative<RejectedPromise>(*this)) {
+      return std::get<RejectedPromise>(*this);
+    } else {
+      return nullopt;
+    }
+  }
+};
+
+template <typename Response>
+using Completion = function<void(Response)>;
+
+struct CreateSessionSlot {
+  CreateSessionRequest request;
+  Completion<CreateSessionResponse> complete;
+};
+
+// What to do once the CDM settles a promise, one alternative per kind of call.
+using PromiseSlot = variant<
+    CreateSessionSlot,
+    Completion<SetServerCertificateResponse>,
+    Completion<LoadSessionResponse>,
+    Completion<UpdateSessionResponse>,
+    Completion<RemoveSessionResponse>,
+    Completion<CloseSessionResponse>
+>;
+
+// Completes |slot| with |rejection|.
+G_GNUC_INTERNAL
+void rejectSlot(PromiseSlot& slot, const RejectedPromise& rejection);
+
+// The promises a Host has handed to the CDM and not seen settled yet. Calls
+// register from their own threads while the CDM settles from its, so every
+// access is locked; a slot is erased as soon as it is taken for completion.
+struct PromiseRegistry {
+  // |session| is the session the call is about, if any, so that its slots can
+  // be failed when it goes away.
+  G_GNUC_INTERNAL
+  void add(
+      uint32_t id,
+      PromiseSlot slot,
+      const OpenCDMSession* session = nullptr
+  );
+  G_GNUC_INTERNAL
+  optional<PromiseSlot> take(uint32_t id);
+  G_GNUC_INTERNAL
+  size_t outstanding();
+
+  // Takes every outstanding slot and rejects it with |exception|, e.g. once
+  // the CDM that was to settle them is gone. Returns how many there were.
+  G_GNUC_INTERNAL
+  size_t rejectAll(cdm::Exception exception, const string& message);
+
+  // Like rejectAll() for the slots registered for |session| only.
+  G_GNUC_INTERNAL
+  size_t rejectSession(
+      const OpenCDMSession& session,
+      cdm::Exception exception,
+      const string& message
+  );
+
+ private:
+  struct Entry {
+    PromiseSlot slot;
+    const OpenCDMSession* session;
+  };
+
+  mutex lock;
+  unordered_map<uint32_t, Entry> slots;
+};
@@ -0,0 +1,163 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <cstring>
+
+#include "open_cdm.h"
+#include "open_cdm_widevine.h"
+
+static const gint64 kTimeoutUs = 5 * G_USEC_PER_SEC;
+static const uint8_t kInitData[] = { 0x00, 0x00, 0x00, 0x10 };
+static const uint8_t kCertificate[] = { 'c', 'e', 'r', 't' };
+
+// What the CDM asked for so far, filled in from its thread.
+static struct {
+  GMutex lock;
+  GCond changed;
+  guint individualizationRequests;
+  guint licenseRequests;
+  gchar *lastRequest;
+} messages;
+
+static void
+remove_tree (const gchar *path)
+{
+  GDir *dir = g_dir_open (path, 0, NULL);
+  if (dir) {
+    const gchar *name;
+    while ((name = g_dir_read_name (dir))) {
+      g_autofree gchar *child = g_build_filename (path, name, NULL);
+      remove_tree (child);
+    }
+    g_dir_close (dir);
+  }
+  g_remove (path);
+}
+
+static void
+on_individualization_request (OpenCDMSession *session, void *user_data,
+    const uint8_t request[], const uint32_t length)
+{
+  g_mutex_lock (&messages.lock);
+  messages.individualizationRequests++;
+  g_free (messages.lastRequest);
+  messages.lastRequest = g_strndup ((const gchar *) request, length);
+  g_cond_broadcast (&messages.changed);
+  g_mutex_unlock (&messages.lock);
+}
+
+static void
+on_challenge (OpenCDMSession *session, void *user_data, const char url[],
+    const uint8_t challenge[], const uint16_t length)
+{
+  g_mutex_lock (&messages.lock);
+  messages.licenseRequests++;
+  g_cond_broadcast (&messages.changed);
+  g_mutex_unlock (&messages.lock);
+}
+
+static void
+wait_for (guint *counter, guint value)
+{
+  auto deadline = g_get_monotonic_time () + kTimeoutUs;
+  g_mutex_lock (&messages.lock);
+  while (*counter < value) {
+    g_assert_true (g_cond_wait_until (&messages.changed, &messages.lock,
+        deadline));
+  }
+  g_mutex_unlock (&messages.lock);
+}
+
+static OpenCDMSession *
+construct_session (OpenCDMSystem *system)
+{
+  static OpenCDMSessionCallbacks callbacks = {};
+  callbacks.process_challenge_callback = on_challenge;
+  OpenCDMSession *session = nullptr;
+  g_assert_cmpint (opencdm_construct_session (system, Temporary, "cenc",
+      kInitData, sizeof (kInitData), nullptr, 0, &callbacks, nullptr,
+      &session), ==, ERROR_NONE);
+  return session;
+}
+
+static void
+destroy (OpenCDMSystem *system, OpenCDMSession *session)
+{
+  g_assert_cmpint (opencdm_session_close (session), ==, ERROR_NONE);
+  opencdm_destruct_session (session);
+  opencdm_destruct_system (system);
+}
+
+// A device without a certificate asks to be provisioned before the license
+// request, which follows once the response has been fed back.
+static void
+test_provisioning (void)
+{
+  auto system = opencdm_create_system ("com.widevine.alpha");
+  g_assert_nonnull (system);
+  g_assert_cmpint (opencdm_widevine_system_set_individualization_callback (
+      system, on_individualization_request, nullptr), ==, ERROR_NONE);
+  auto session = construct_session (system);
+
+  wait_for (&messages.individualizationRequests, 1);
+  g_assert_cmpstr (messages.lastRequest, ==, "provisioning-request");
+  g_assert_cmpuint (messages.licenseRequests, ==, 0);
+  g_assert_cmpint (opencdm_session_update (session, kCertificate,
+      sizeof (kCertificate)), ==, ERROR_NONE);
+  wait_for (&messages.licenseRequests, 1);
+
+  OpenCDMWidevineSystemMetrics metrics;
+  g_assert_cmpint (opencdm_widevine_system_get_metrics (system, &metrics), ==,
+      ERROR_NONE);
+  g_assert_cmpuint (metrics.provisioning_requests, ==, 1);
+  g_assert_cmpint (metrics.provisioning_us, >, 0);
+  g_assert_cmpuint (metrics.provisioning_cache_hits, ==, 0);
+  g_print ("provisioned in %" G_GINT64_FORMAT " us\n", metrics.provisioning_us);
+  destroy (system, session);
+}
+
+// Later systems find the provisioning in storage and go straight to the
+// license request. With WIDEVINE_CDM_POOL_SIZE set the system reuses the CDM
+// of the previous one, whose provisioning it must not report.
+static void
+test_cache_hit (void)
+{
+  auto system = opencdm_create_system ("com.widevine.alpha");
+  g_assert_nonnull (system);
+  g_assert_cmpint (opencdm_widevine_system_set_individualization_callback (
+      system, on_individualization_request, nullptr), ==, ERROR_NONE);
+  auto session = construct_session (system);
+  wait_for (&messages.licenseRequests, 2);
+  g_assert_cmpuint (messages.individualizationRequests, ==, 1);
+
+  // Counted once the storage thread has checked.
+  OpenCDMWidevineSystemMetrics metrics;
+  auto deadline = g_get_monotonic_time () + kTimeoutUs;
+  do {
+    g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+    g_usleep (1000);
+    g_assert_cmpint (opencdm_widevine_system_get_metrics (system, &metrics),
+        ==, ERROR_NONE);
+  } while (!metrics.provisioning_cache_hits);
+  g_assert_cmpuint (metrics.provisioning_cache_hits, ==, 1);
+  g_assert_cmpuint (metrics.provisioning_requests, ==, 0);
+  g_assert_cmpint (metrics.provisioning_us, ==, 0);
+  destroy (system, session);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  g_autofree gchar *storage = g_dir_make_tmp ("provisioning-test-XXXXXX", NULL);
+  g_assert_nonnull (storage);
+  g_setenv ("WIDEVINE_CDM_STORAGE_DIR", storage, TRUE);
+  g_setenv ("WIDEVINE_FAKE_CDM_PROVISIONING", "1", TRUE);
+  g_assert_cmpint (opencdm_init (), ==, ERROR_NONE);
+
+  test_provisioning ();
+  test_cache_hit ();
+
+  remove_tree (storage);
+  g_free (messages.lastRequest);
+  return 0;
+}
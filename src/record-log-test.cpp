@@ -0,0 +1,293 @@
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "record_log.h"
+
+GST_DEBUG_CATEGORY(sparkle_widevine_debug_cat);
+
+using std::string;
+
+static const unsigned kManyRecords = 20000;
+static const unsigned kWriters = 4;
+static const unsigned kWritesEach = 64;
+
+static span<const uint8_t>
+bytes (const string& value)
+{
+  return span ((const uint8_t *) value.data (), value.size ());
+}
+
+static string
+get (RecordLog& log, const string& name)
+{
+  auto data = log.get (name);
+  g_assert_true (data.has_value ());
+  return string ((const char *) data->data (), data->size ());
+}
+
+static string
+make_log_path (void)
+{
+  g_autofree gchar *dir = g_dir_make_tmp ("record-log-test-XXXXXX", NULL);
+  g_assert_nonnull (dir);
+  g_autofree gchar *path = g_build_filename (dir, "records.log", NULL);
+  return path;
+}
+
+static void
+remove_log (const string& path)
+{
+  g_remove (path.c_str ());
+  g_autofree gchar *dir = g_path_get_dirname (path.c_str ());
+  g_rmdir (dir);
+}
+
+static gint64
+file_size (const string& path)
+{
+  GStatBuf info;
+  g_assert_cmpint (g_stat (path.c_str (), &info), ==, 0);
+  return info.st_size;
+}
+
+// The latest record of every name survives reopening; deleted ones do not.
+static void
+test_reopen (void)
+{
+  auto path = make_log_path ();
+  {
+    auto log = RecordLog::open (path);
+    g_assert_nonnull (log);
+    g_assert_true (log->put ("a", bytes ("first")));
+    g_assert_true (log->put ("b", bytes ("other")));
+    g_assert_true (log->put ("a", bytes ("second")));
+    g_assert_true (log->put ("b", {}));
+    g_assert_cmpstr (get (*log, "a").c_str (), ==, "second");
+    g_assert_cmpuint (log->get ("b")->size (), ==, 0);
+  }
+  auto log = RecordLog::open (path);
+  g_assert_nonnull (log);
+  g_assert_cmpuint (log->records (), ==, 1);
+  g_assert_cmpstr (get (*log, "a").c_str (), ==, "second");
+  g_assert_cmpuint (log->get ("b")->size (), ==, 0);
+  log.reset ();
+  remove_log (path);
+}
+
+// A record cut short or corrupted, as a crash while appending leaves it, is
+// dropped along with anything after it, and appending carries on from there.
+static void
+test_torn_records (void)
+{
+  auto path = make_log_path ();
+  {
+    auto log = RecordLog::open (path);
+    g_assert_true (log->put ("kept", bytes ("intact")));
+    g_assert_true (log->put ("torn", bytes ("cut short")));
+  }
+  g_assert_cmpint (truncate (path.c_str (), file_size (path) - 4), ==, 0);
+  {
+    auto log = RecordLog::open (path);
+    g_assert_cmpuint (log->records (), ==, 1);
+    g_assert_cmpstr (get (*log, "kept").c_str (), ==, "intact");
+    g_assert_true (log->put ("flipped", bytes ("corrupted")));
+    g_assert_true (log->put ("later", bytes ("after it")));
+  }
+  auto size = file_size (path);
+  int fd = g_open (path.c_str (), O_RDWR, 0);
+  // The last byte of "corrupted", which ends its record and is followed by
+  // the 32 bytes of the "later" one.
+  g_assert_cmpint (pwrite (fd, "X", 1, size - 32 - 1), ==, 1);
+  close (fd);
+
+  auto log = RecordLog::open (path);
+  g_assert_cmpuint (log->records (), ==, 1);
+  g_assert_cmpuint (log->get ("flipped")->size (), ==, 0);
+  g_assert_cmpuint (log->get ("later")->size (), ==, 0);
+  g_assert_true (log->put ("later", bytes ("again")));
+  g_assert_cmpstr (get (*log, "later").c_str (), ==, "again");
+  log.reset ();
+  remove_log (path);
+}
+
+// Rewriting the same records over and over leaves mostly garbage, which
+// compaction reclaims without losing anything live.
+static void
+test_compaction (void)
+{
+  auto path = make_log_path ();
+  auto log = RecordLog::open (path);
+  string large (64 * 1024, 'x');
+  auto writes = 0U;
+  while (!log->needsCompaction ()) {
+    large[0] = 'a' + writes % 26;
+    g_assert_true (log->put ("large", bytes (large)));
+    g_assert_true (log->put ("small-" + std::to_string (writes % 4), bytes ("s")));
+    writes++;
+  }
+  auto before = log->fileBytes ();
+  g_assert_true (log->compact ());
+  g_assert_cmpuint (log->fileBytes (), <, before / 4);
+  g_assert_cmpuint (log->fileBytes (), ==, (guint64) file_size (path));
+  g_assert_cmpuint (log->records (), ==, 5);
+  char latest = 'a' + (writes - 1) % 26;
+  g_assert_cmpint (get (*log, "large")[0], ==, latest);
+  g_assert_true (log->put ("after", bytes ("compaction")));
+  log.reset ();
+
+  log = RecordLog::open (path);
+  g_assert_cmpuint (log->records (), ==, 6);
+  g_assert_cmpuint (log->get ("large")->size (), ==, large.size ());
+  g_assert_cmpstr (get (*log, "after").c_str (), ==, "compaction");
+  log.reset ();
+  remove_log (path);
+}
+
+// Logs open on the same file, as in several processes, see each other's
+// changes, including across a compaction by one of them.
+static void
+test_shared (void)
+{
+  auto path = make_log_path ();
+  auto first = RecordLog::open (path);
+  auto second = RecordLog::open (path);
+  g_assert_nonnull (first);
+  g_assert_nonnull (second);
+  g_assert_true (first->put ("a", bytes ("from the first")));
+  g_assert_cmpstr (get (*second, "a").c_str (), ==, "from the first");
+  g_assert_true (second->put ("b", bytes ("from the second")));
+  g_assert_true (second->put ("a", {}));
+  g_assert_cmpstr (get (*first, "b").c_str (), ==, "from the second");
+  g_assert_cmpuint (first->get ("a")->size (), ==, 0);
+
+  string large (64 * 1024, 'x');
+  auto writes = 0U;
+  while (!first->needsCompaction ()) {
+    large[0] = 'a' + writes % 26;
+    g_assert_true (first->put ("large", bytes (large)));
+    writes++;
+  }
+  g_assert_true (first->compact ());
+  char latest = 'a' + (writes - 1) % 26;
+  g_assert_cmpint (get (*second, "large")[0], ==, latest);
+  g_assert_cmpuint (second->fileBytes (), ==, first->fileBytes ());
+  g_assert_true (second->put ("after", bytes ("compaction")));
+  g_assert_cmpstr (get (*first, "after").c_str (), ==, "compaction");
+  g_assert_cmpuint (first->records (), ==, 3);
+  g_assert_cmpuint (second->records (), ==, 3);
+  g_assert_cmpuint ((guint64) file_size (path), ==, first->fileBytes ());
+  first.reset ();
+  second.reset ();
+  remove_log (path);
+}
+
+// Processes appending to and compacting the same log at once lose none of
+// each other's records.
+static void
+test_concurrent_writers (void)
+{
+  auto path = make_log_path ();
+  pid_t writers[kWriters];
+  for (auto i = 0U; i < kWriters; i++) {
+    writers[i] = fork ();
+    g_assert_cmpint (writers[i], >=, 0);
+    if (writers[i])
+      continue;
+    auto log = RecordLog::open (path);
+    string large (64 * 1024, 'a' + i);
+    bool ok = log != nullptr;
+    for (auto j = 0U; ok && j < kWritesEach; j++) {
+      auto name = std::to_string (i) + "-" + std::to_string (j);
+      ok = log->put (name, bytes (name))
+          && log->put ("large-" + std::to_string (i), bytes (large))
+          && (!log->needsCompaction () || log->compact ());
+    }
+    _exit (ok ? 0 : 1);
+  }
+  for (auto writer : writers) {
+    int status;
+    g_assert_cmpint (waitpid (writer, &status, 0), ==, writer);
+    g_assert_true (WIFEXITED (status));
+    g_assert_cmpint (WEXITSTATUS (status), ==, 0);
+  }
+
+  auto log = RecordLog::open (path);
+  g_assert_cmpuint (log->records (), ==, kWriters * (kWritesEach + 1));
+  for (auto i = 0U; i < kWriters; i++) {
+    for (auto j = 0U; j < kWritesEach; j++) {
+      auto name = std::to_string (i) + "-" + std::to_string (j);
+      g_assert_cmpstr (get (*log, name).c_str (), ==, name.c_str ());
+    }
+    auto large = log->get ("large-" + std::to_string (i));
+    g_assert_cmpuint (large->size (), ==, 64 * 1024);
+    g_assert_cmpint ((*large)[0], ==, 'a' + i);
+  }
+  log.reset ();
+  auto temporary = path + ".compact";
+  g_assert_false (g_file_test (temporary.c_str (), G_FILE_TEST_EXISTS));
+  remove_log (path);
+}
+
+static void
+test_many_records (void)
+{
+  auto path = make_log_path ();
+  auto log = RecordLog::open (path);
+  string license (1024, 'l');
+  for (auto i = 0U; i < kManyRecords; i++) {
+    g_assert_true (log->put (std::to_string (i) + ".lic", bytes (license)));
+  }
+  log.reset ();
+
+  auto start = g_get_monotonic_time ();
+  log = RecordLog::open (path);
+  auto openUs = g_get_monotonic_time () - start;
+  g_assert_cmpuint (log->records (), ==, kManyRecords);
+  start = g_get_monotonic_time ();
+  for (auto i = 0U; i < kManyRecords; i++) {
+    g_assert_cmpuint (log->get (std::to_string (i) + ".lic")->size (), ==, license.size ());
+  }
+  auto lookupUs = g_get_monotonic_time () - start;
+  g_print ("%u records: open %" G_GINT64_FORMAT " us, lookup avg %"
+      G_GINT64_FORMAT " ns\n", kManyRecords, openUs,
+      lookupUs * 1000 / kManyRecords);
+  log.reset ();
+  remove_log (path);
+}
+
+// A log that can no longer be read reports that, rather than every record
+// reading as missing.
+static void
+test_unreadable (void)
+{
+  auto path = make_log_path ();
+  auto log = RecordLog::open (path);
+  g_assert_true (log->put ("a", bytes ("stored")));
+  remove_log (path);
+
+  g_assert_false (log->get ("a").has_value ());
+  g_assert_false (log->get ("b").has_value ());
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  gst_init (&argc, &argv);
+  GST_DEBUG_CATEGORY_INIT (sparkle_widevine_debug_cat, "sprklcdm-widevine", 0,
+      "Sparkle CDM Widevine");
+  test_reopen ();
+  test_torn_records ();
+  test_compaction ();
+  test_shared ();
+  test_concurrent_writers ();
+  test_many_records ();
+  test_unreadable ();
+  return 0;
+}
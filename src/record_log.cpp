@@ -0,0 +1,413 @@
+// SPDX-License-Identifier: MIT
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <vector>
+
+#include "record_log.h"
+
+using std::array;
+using std::vector;
+
+GST_DEBUG_CATEGORY_EXTERN(sparkle_widevine_debug_cat);
+#define GST_CAT_DEFAULT sparkle_widevine_debug_cat
+
+// The file starts with kFileMagic, followed by records, each made of a
+// RecordHeader, the name and the data, padded to a multiple of 8 bytes. All
+// integers are in host byte order.
+static const char kFileMagic[8] = { 'S', 'P', 'K', 'R', 'L', 'O', 'G', '1' };
+static const uint32_t kRecordMagic = 0x52454331;
+static const uint64_t kMinMapping = 1 << 20;
+
+struct RecordHeader {
+  uint32_t magic;
+  // CRC-32 of everything after it: the sizes, the name and the data.
+  uint32_t checksum;
+  uint32_t nameSize;
+  uint32_t dataSize;
+};
+
+static constexpr array<uint32_t, 256> kCrcTable = [] {
+  array<uint32_t, 256> table = {};
+  for (uint32_t i = 0; i < table.size(); i++) {
+    uint32_t crc = i;
+    for (auto bit = 0; bit < 8; bit++) {
+      crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+    }
+    table[i] = crc;
+  }
+  return table;
+}();
+
+static uint32_t crc32(uint32_t crc, const void* data, size_t size) {
+  auto bytes = static_cast<const uint8_t*>(data);
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc = kCrcTable[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static uint32_t checksum(
+    const RecordHeader& header,
+    const void* name,
+    const void* data
+) {
+  auto crc = crc32(0, &header.nameSize, sizeof(header.nameSize));
+  crc = crc32(crc, &header.dataSize, sizeof(header.dataSize));
+  crc = crc32(crc, name, header.nameSize);
+  return crc32(crc, data, header.dataSize);
+}
+
+static uint64_t record_size(uint64_t nameSize, uint64_t dataSize) {
+  return (sizeof(RecordHeader) + nameSize + dataSize + 7) & ~uint64_t(7);
+}
+
+static bool write_all(int fd, const void* data, size_t size, uint64_t offset) {
+  auto bytes = static_cast<const uint8_t*>(data);
+  while (size) {
+    auto written = pwrite(fd, bytes, size, offset);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return false;
+    }
+    bytes += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+unique_ptr<RecordLog> RecordLog::open(const string& path) {
+  int fd = g_open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    GST_WARNING("cannot open %s: %s", path.c_str(), g_strerror(errno));
+    return nullptr;
+  }
+  unique_ptr<RecordLog> log(new RecordLog(path, fd));
+  auto start = g_get_monotonic_time();
+  // Exclusively, so that a new log is initialized and a torn tail cut off.
+  if (!log->lock(LOCK_EX)) {
+    return nullptr;
+  }
+  log->unlock();
+  GST_INFO("opened %s with %zu records in %" G_GINT64_FORMAT " us",
+      path.c_str(), log->records(), g_get_monotonic_time() - start);
+  return log;
+}
+
+RecordLog::RecordLog(const string& path, int fd)
+  : path(path)
+  , fd(fd) {
+}
+
+RecordLog::~RecordLog() {
+  if (mapping) {
+    munmap(const_cast<uint8_t*>(mapping), mapped);
+  }
+  close(fd);
+}
+
+// Maps at least |size| bytes of the file, with room to grow: the mapping may
+// extend past the end of the file, as long as nothing is read from there.
+bool RecordLog::map(uint64_t size) {
+  if (size <= mapped) {
+    return true;
+  }
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  auto length = (std::max(size * 2, kMinMapping) + page - 1) & ~(page - 1);
+  auto address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+  if (address == MAP_FAILED) {
+    GST_WARNING("cannot map %s: %s", path.c_str(), g_strerror(errno));
+    return false;
+  }
+  if (mapping) {
+    munmap(const_cast<uint8_t*>(mapping), mapped);
+  }
+  mapping = static_cast<const uint8_t*>(address);
+  mapped = length;
+  return true;
+}
+
+// Indexes the records appended since the last call, up to |fileSize|. Only
+// the holder of the exclusive lock initializes a new log or cuts off a torn
+// tail; others stop short of it.
+bool RecordLog::replay(uint64_t fileSize, bool exclusive) {
+  if (fileSize < end) {
+    // Cut short behind the log's back: nothing indexed can be trusted.
+    GST_WARNING("%s shrank, replaying it", path.c_str());
+    forget();
+  }
+  if (!end) {
+    if (fileSize < sizeof(kFileMagic)) {
+      if (!exclusive) {
+        // Created by another process that has yet to initialize it.
+        return true;
+      }
+      // Nothing was ever stored, or creating the log was interrupted.
+      if (ftruncate(fd, 0) != 0
+          || !write_all(fd, kFileMagic, sizeof(kFileMagic), 0)
+          || fdatasync(fd) != 0) {
+        GST_WARNING("cannot initialize %s: %s", path.c_str(), g_strerror(errno));
+        return false;
+      }
+      end = sizeof(kFileMagic);
+      return map(end);
+    }
+    if (!map(fileSize)) {
+      return false;
+    }
+    if (memcmp(mapping, kFileMagic, sizeof(kFileMagic))) {
+      GST_WARNING("%s is not a record log", path.c_str());
+      return false;
+    }
+    end = sizeof(kFileMagic);
+  } else if (!map(fileSize)) {
+    return false;
+  }
+
+  uint64_t offset = end;
+  while (offset + sizeof(RecordHeader) <= fileSize) {
+    RecordHeader header;
+    memcpy(&header, mapping + offset, sizeof(header));
+    auto size = record_size(header.nameSize, header.dataSize);
+    if (header.magic != kRecordMagic || offset + size > fileSize) {
+      break;
+    }
+    auto name = mapping + offset + sizeof(header);
+    auto data = name + header.nameSize;
+    if (checksum(header, name, data) != header.checksum) {
+      break;
+    }
+    string key(reinterpret_cast<const char*>(name), header.nameSize);
+    auto previous = index.find(key);
+    if (previous != index.end()) {
+      live -= previous->second.recordSize;
+      index.erase(previous);
+    }
+    if (header.dataSize) {
+      index[key] = { uint64_t(data - mapping), header.dataSize, uint32_t(size) };
+      live += size;
+    }
+    offset += size;
+  }
+  if (offset < fileSize && exclusive) {
+    GST_WARNING("%s: dropping %" G_GUINT64_FORMAT " bytes of incomplete records",
+        path.c_str(), fileSize - offset);
+    if (ftruncate(fd, offset) != 0) {
+      GST_WARNING("cannot truncate %s: %s", path.c_str(), g_strerror(errno));
+      return false;
+    }
+  }
+  end = offset;
+  return true;
+}
+
+// Drops the mapping and the index, to replay the log from the start.
+void RecordLog::forget() {
+  if (mapping) {
+    munmap(const_cast<uint8_t*>(mapping), mapped);
+  }
+  mapping = nullptr;
+  mapped = 0;
+  end = 0;
+  live = 0;
+  index.clear();
+}
+
+// Locks the file with |operation|, LOCK_SH or LOCK_EX, and catches up with
+// what other processes changed. Compaction replaces the file under the
+// exclusive lock of the old one, so a holder of that lock that finds another
+// file at |path| moves on to it.
+bool RecordLog::lock(int operation) {
+  for (;;) {
+    while (flock(fd, operation) != 0) {
+      if (errno != EINTR) {
+        GST_WARNING("cannot lock %s: %s", path.c_str(), g_strerror(errno));
+        return false;
+      }
+    }
+    struct stat opened;
+    if (fstat(fd, &opened) != 0) {
+      GST_WARNING("cannot stat %s: %s", path.c_str(), g_strerror(errno));
+      unlock();
+      return false;
+    }
+    GStatBuf current;
+    if (g_stat(path.c_str(), &current) == 0
+        && current.st_dev == opened.st_dev
+        && current.st_ino == opened.st_ino) {
+      if (!replay(opened.st_size, operation == LOCK_EX)) {
+        unlock();
+        return false;
+      }
+      return true;
+    }
+    int replacement = g_open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (replacement < 0) {
+      GST_WARNING("cannot reopen %s: %s", path.c_str(), g_strerror(errno));
+      unlock();
+      return false;
+    }
+    GST_DEBUG("%s was replaced, reopening it", path.c_str());
+    forget();
+    close(fd);
+    fd = replacement;
+  }
+}
+
+void RecordLog::unlock() {
+  flock(fd, LOCK_UN);
+}
+
+optional<span<const uint8_t>> RecordLog::get(const string& name) {
+  if (!lock(LOCK_SH)) {
+    return std::nullopt;
+  }
+  // What is indexed stays in place once unlocked: appends go after it, and
+  // compaction writes a new file, leaving the mapped one alone.
+  unlock();
+  auto found = index.find(name);
+  if (found == index.end() || !mapping) {
+    return span<const uint8_t>();
+  }
+  return span(mapping + found->second.offset, found->second.size);
+}
+
+bool RecordLog::put(const string& name, span<const uint8_t> data) {
+  if (!lock(LOCK_EX)) {
+    return false;
+  }
+  auto appended = append(name, data);
+  unlock();
+  return appended;
+}
+
+bool RecordLog::append(const string& name, span<const uint8_t> data) {
+  auto found = index.find(name);
+  if (data.empty() && found == index.end()) {
+    return true;
+  }
+  RecordHeader header = {
+    kRecordMagic,
+    0,
+    uint32_t(name.size()),
+    uint32_t(data.size()),
+  };
+  header.checksum = checksum(header, name.data(), data.data());
+  auto size = record_size(header.nameSize, header.dataSize);
+  if (!map(end + size)) {
+    return false;
+  }
+  vector<uint8_t> record(size);
+  memcpy(record.data(), &header, sizeof(header));
+  memcpy(record.data() + sizeof(header), name.data(), name.size());
+  if (!data.empty()) {
+    memcpy(record.data() + sizeof(header) + name.size(), data.data(), data.size());
+  }
+
+  // A record that could not be written in full is cut off again, as
+  // replaying the log would. Like a file written in place of the old one, a
+  // record may not have reached the disk yet when the system crashes; if so
+  // its checksum gives it away and the previous record of its name stands.
+  if (!write_all(fd, record.data(), record.size(), end)) {
+    GST_WARNING("cannot append to %s: %s", path.c_str(), g_strerror(errno));
+    if (ftruncate(fd, end) != 0) {
+      GST_WARNING("cannot truncate %s: %s", path.c_str(), g_strerror(errno));
+    }
+    return false;
+  }
+
+  if (found != index.end()) {
+    live -= found->second.recordSize;
+    index.erase(found);
+  }
+  if (!data.empty()) {
+    auto offset = end + sizeof(header) + name.size();
+    index[name] = { offset, header.dataSize, uint32_t(size) };
+    live += size;
+  }
+  end += size;
+  return true;
+}
+
+bool RecordLog::needsCompaction() const {
+  auto garbage = end - sizeof(kFileMagic) - live;
+  return garbage >= kCompactionThreshold && garbage > live;
+}
+
+bool RecordLog::compact() {
+  auto start = g_get_monotonic_time();
+  if (!lock(LOCK_EX)) {
+    return false;
+  }
+  // Only ever written under the exclusive lock of the log it replaces.
+  auto temporary = path + ".compact";
+  int out = g_open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (out < 0) {
+    GST_WARNING("cannot create %s: %s", temporary.c_str(), g_strerror(errno));
+    unlock();
+    return false;
+  }
+
+  // Records are copied as they are, checksums included; only their offsets
+  // change.
+  unordered_map<string, Location> compacted;
+  compacted.reserve(index.size());
+  uint64_t offset = sizeof(kFileMagic);
+  bool ok = write_all(out, kFileMagic, sizeof(kFileMagic), 0)
+      && flock(out, LOCK_EX | LOCK_NB) == 0;
+  for (const auto& [name, location] : index) {
+    if (!ok) {
+      break;
+    }
+    auto headerOffset = location.offset - name.size() - sizeof(RecordHeader);
+    ok = write_all(out, mapping + headerOffset, location.recordSize, offset);
+    compacted[name] = {
+      offset + sizeof(RecordHeader) + name.size(),
+      location.size,
+      location.recordSize,
+    };
+    offset += location.recordSize;
+  }
+  ok = ok && fdatasync(out) == 0 && g_rename(temporary.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    GST_WARNING("cannot compact %s: %s", path.c_str(), g_strerror(errno));
+    close(out);
+    g_unlink(temporary.c_str());
+    unlock();
+    return false;
+  }
+
+  // Closing the old file lets the processes waiting for it on to the new
+  // one, which stays locked until it is mapped.
+  auto reclaimed = end - offset;
+  forget();
+  close(fd);
+  fd = out;
+  index = std::move(compacted);
+  end = offset;
+  live = offset - sizeof(kFileMagic);
+  auto remapped = map(end);
+  unlock();
+  if (!remapped) {
+    return false;
+  }
+  GST_INFO("compacted %s, reclaimed %" G_GUINT64_FORMAT " bytes in %"
+      G_GINT64_FORMAT " us", path.c_str(), reclaimed,
+      g_get_monotonic_time() - start);
+  return true;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+
+#include <glib.h>
+
+using std::optional;
+using std::span;
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+
+// Named records in a single append-only file. Writing a record appends it,
+// superseding any earlier record of the same name; an empty record deletes the
+// name. The file is mapped into memory and an in-memory index points at the
+// latest record of every name, so a lookup is a lock on the file, a check
+// that it is still the log and one hash probe, and reading the data at most
+// a page fault; no file is opened.
+//
+// Every record carries a CRC-32 of its contents. Opening the log replays it
+// and cuts off whatever follows the first record that does not check out, as
+// left behind by a crash during an append. compact() rewrites the live
+// records into a new file that replaces the old one in a single rename.
+//
+// Several processes may have the same log open. Every operation locks the
+// file, shared for reading and exclusive for changing it, and first replays
+// what the others appended since; a log another process compacted is
+// reopened and replayed in full. Not thread safe.
+struct RecordLog {
+  // Superseded records are reclaimed once they take up more space than the
+  // live ones and at least this much.
+  static constexpr size_t kCompactionThreshold = 1 << 20;
+
+  // Opens or creates the log at |path|. Returns nullptr if that fails.
+  G_GNUC_INTERNAL
+  static unique_ptr<RecordLog> open(const string& path);
+
+  RecordLog(const RecordLog&) = delete;
+  RecordLog& operator=(const RecordLog&) = delete;
+  G_GNUC_INTERNAL
+  ~RecordLog();
+
+  // The data of |name|, empty if there is none, or nullopt if the log cannot
+  // be read. Valid until the next call.
+  G_GNUC_INTERNAL
+  optional<span<const uint8_t>> get(const string& name);
+
+  // Appends a record for |name|, or deletes it if |data| is empty. Returns
+  // whether the record could be written.
+  G_GNUC_INTERNAL
+  bool put(const string& name, span<const uint8_t> data);
+
+  G_GNUC_INTERNAL
+  bool needsCompaction() const;
+
+  // Drops superseded and deleted records. Returns false if the log could not
+  // be rewritten, in which case it is left as it was.
+  G_GNUC_INTERNAL
+  bool compact();
+
+  // As of the last operation: the number of records, the size of the file,
+  // and how much of it live records take up.
+  size_t records() const { return index.size(); }
+  uint64_t fileBytes() const { return end; }
+  uint64_t liveBytes() const { return live; }
+
+ private:
+  struct Location {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t recordSize;
+  };
+
+  G_GNUC_INTERNAL
+  RecordLog(const string& path, int fd);
+  G_GNUC_INTERNAL
+  bool map(uint64_t size);
+  G_GNUC_INTERNAL
+  bool replay(uint64_t fileSize, bool exclusive);
+  G_GNUC_INTERNAL
+  void forget();
+  G_GNUC_INTERNAL
+  bool lock(int operation);
+  G_GNUC_INTERNAL
+  void unlock();
+  G_GNUC_INTERNAL
+  bool append(const string& name, span<const uint8_t> data);
+
+  const string path;
+  int fd;
+  const uint8_t* mapping = nullptr;
+  uint64_t mapped = 0;
+  uint64_t end = 0;
+  uint64_t live = 0;
+  unordered_map<string, Location> index;
+};
@@ -0,0 +1,217 @@
+#include <glib.h>
+
+#include "open_cdm.h"
+#include "open_cdm_widevine.h"
+
+static const unsigned kSessions = 32;
+static const gint64 kLicenseMs = 1500;
+static const gint64 kLeadMs = 500;
+static const gint64 kJitterMs = 500;
+// Timers fire up to a tick late, and the CDM thread may be busy.
+static const gint64 kSlackMs = 100;
+static const gint64 kTimeoutUs = 5 * G_USEC_PER_SEC;
+static const uint8_t kInitData[] = { 0x00, 0x00, 0x00, 0x10 };
+
+// The renewal signals so far, filled in from the CDM thread.
+static struct {
+  GMutex lock;
+  GCond changed;
+  guint count;
+  // Time left before the expiration, in milliseconds, when each came in.
+  gint64 marginsMs[kSessions];
+} signals;
+
+static void
+on_renewal (OpenCDMSession *session, void *user_data, const int64_t expiration)
+{
+  auto nowMs = g_get_real_time () / 1000;
+  g_mutex_lock (&signals.lock);
+  if (signals.count < kSessions)
+    signals.marginsMs[signals.count] = expiration - nowMs;
+  signals.count++;
+  g_cond_broadcast (&signals.changed);
+  g_mutex_unlock (&signals.lock);
+}
+
+static void
+update (OpenCDMSession *session, guint index)
+{
+  uint8_t key[16] = { (uint8_t) index };
+  g_assert_cmpint (opencdm_session_update (session, key, sizeof (key)), ==,
+      ERROR_NONE);
+}
+
+static void
+get_metrics (OpenCDMSystem *system, OpenCDMWidevineSystemMetrics *metrics)
+{
+  g_assert_cmpint (opencdm_widevine_system_get_metrics (system, metrics), ==,
+      ERROR_NONE);
+}
+
+// Licenses fetched together are signalled for renewal ahead of their
+// expiration, spread over the jitter window rather than all at once.
+static void
+test_renewals (void)
+{
+  static OpenCDMSessionCallbacks callbacks = {};
+  auto system = opencdm_create_system ("com.widevine.alpha");
+  g_assert_nonnull (system);
+  g_assert_cmpint (opencdm_widevine_system_set_renewal_callback (system,
+      on_renewal, nullptr), ==, ERROR_NONE);
+
+  OpenCDMSession *sessions[kSessions];
+  for (auto i = 0U; i < kSessions; i++) {
+    g_assert_cmpint (opencdm_construct_session (system, Temporary, "cenc",
+        kInitData, sizeof (kInitData), nullptr, 0, &callbacks, nullptr,
+        &sessions[i]), ==, ERROR_NONE);
+    update (sessions[i], i);
+  }
+
+  auto deadline = g_get_monotonic_time () + kTimeoutUs;
+  g_mutex_lock (&signals.lock);
+  while (signals.count < kSessions) {
+    g_assert_true (g_cond_wait_until (&signals.changed, &signals.lock,
+        deadline));
+  }
+  g_mutex_unlock (&signals.lock);
+
+  gint64 earliest = G_MAXINT64, latest = 0;
+  for (auto i = 0U; i < kSessions; i++) {
+    earliest = MIN (earliest, signals.marginsMs[i]);
+    latest = MAX (latest, signals.marginsMs[i]);
+  }
+  g_print ("%u renewals signalled %" G_GINT64_FORMAT " to %" G_GINT64_FORMAT
+      " ms before expiring\n", kSessions, earliest, latest);
+  g_assert_cmpint (earliest, >=, kLeadMs - kSlackMs);
+  g_assert_cmpint (latest, <=, kLeadMs + kJitterMs);
+  g_assert_cmpint (latest - earliest, >=, kJitterMs / 4);
+
+  // Renew all but the last one, which is left to expire.
+  for (auto i = 0U; i < kSessions - 1; i++)
+    update (sessions[i], i);
+  OpenCDMWidevineSystemMetrics metrics;
+  deadline = g_get_monotonic_time () + kTimeoutUs;
+  do {
+    g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+    g_usleep (10000);
+    get_metrics (system, &metrics);
+  } while (!metrics.licenses_expired);
+
+  g_print ("renewal margins: min %" G_GINT64_FORMAT " ms, avg %"
+      G_GINT64_FORMAT " ms\n", metrics.renewal_margin_min_ms,
+      metrics.renewal_margin_avg_ms);
+  g_assert_cmpuint (metrics.renewals_signalled, >=, kSessions);
+  g_assert_cmpuint (metrics.renewals, ==, kSessions - 1);
+  g_assert_cmpuint (metrics.licenses_expired, ==, 1);
+  g_assert_cmpint (metrics.renewal_margin_min_ms, >, 0);
+  g_assert_cmpint (metrics.renewal_margin_min_ms, <=,
+      metrics.renewal_margin_avg_ms);
+  g_assert_cmpint (metrics.renewal_margin_avg_ms, <=, kLeadMs + kJitterMs);
+
+  for (auto i = 0U; i < kSessions; i++) {
+    g_assert_cmpint (opencdm_session_close (sessions[i]), ==, ERROR_NONE);
+    opencdm_destruct_session (sessions[i]);
+  }
+  opencdm_destruct_system (system);
+}
+
+// Where the updates started from the callbacks report back, and how many of
+// them failed.
+static GMainContext *completions;
+static guint updates_failed;
+
+static void
+on_updated (OpenCDMError result, void *user_data)
+{
+  if (result != ERROR_NONE)
+    updates_failed++;
+}
+
+// Answers from within the callbacks, on the CDM thread, where the blocking
+// calls fail rather than wait for the CDM, so the asynchronous ones are used.
+static void
+update_async (OpenCDMSession *session)
+{
+  uint8_t key[16] = { 0 };
+  g_assert_cmpint (opencdm_session_update (session, key, sizeof (key)), ==,
+      ERROR_FAIL);
+  g_assert_cmpint (opencdm_widevine_session_update_async (session, key,
+      sizeof (key), completions, on_updated, nullptr), ==, ERROR_NONE);
+}
+
+static void
+answer_challenge (OpenCDMSession *session, void *user_data, const char url[],
+    const uint8_t challenge[], const uint16_t length)
+{
+  auto system = (OpenCDMSystem *) user_data;
+  OpenCDMSession *other = nullptr;
+  g_assert_cmpint (opencdm_construct_session (system, Temporary, "cenc",
+      kInitData, sizeof (kInitData), nullptr, 0, nullptr, nullptr, &other), ==,
+      ERROR_FAIL);
+  g_assert_null (other);
+  update_async (session);
+}
+
+static void
+renew_now (OpenCDMSession *session, void *user_data, const int64_t expiration)
+{
+  update_async (session);
+}
+
+// Licenses requested and renewed by updating the sessions from the callbacks
+// that asked for them.
+static void
+test_update_from_callbacks (void)
+{
+  static const unsigned kCallbackSessions = 4;
+  auto system = opencdm_create_system ("com.widevine.alpha");
+  g_assert_nonnull (system);
+  g_assert_cmpint (opencdm_widevine_system_set_renewal_callback (system,
+      renew_now, nullptr), ==, ERROR_NONE);
+  static OpenCDMSessionCallbacks callbacks = {};
+  callbacks.process_challenge_callback = answer_challenge;
+
+  OpenCDMSession *sessions[kCallbackSessions];
+  for (auto i = 0U; i < kCallbackSessions; i++) {
+    g_assert_cmpint (opencdm_construct_session (system, Temporary, "cenc",
+        kInitData, sizeof (kInitData), nullptr, 0, &callbacks, system,
+        &sessions[i]), ==, ERROR_NONE);
+  }
+
+  OpenCDMWidevineSystemMetrics metrics;
+  auto deadline = g_get_monotonic_time () + kTimeoutUs;
+  do {
+    g_assert_cmpint (g_get_monotonic_time (), <, deadline);
+    g_usleep (10000);
+    while (g_main_context_iteration (completions, FALSE));
+    get_metrics (system, &metrics);
+  } while (metrics.renewals < kCallbackSessions);
+  g_assert_cmpuint (metrics.licenses_expired, ==, 0);
+  g_assert_cmpuint (updates_failed, ==, 0);
+
+  for (auto i = 0U; i < kCallbackSessions; i++) {
+    g_assert_cmpint (opencdm_session_close (sessions[i]), ==, ERROR_NONE);
+    opencdm_destruct_session (sessions[i]);
+  }
+  opencdm_destruct_system (system);
+  while (g_main_context_iteration (completions, FALSE));
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  g_autofree gchar *license = g_strdup_printf ("%" G_GINT64_FORMAT, kLicenseMs);
+  g_autofree gchar *lead = g_strdup_printf ("%" G_GINT64_FORMAT, kLeadMs);
+  g_autofree gchar *jitter = g_strdup_printf ("%" G_GINT64_FORMAT, kJitterMs);
+  g_setenv ("WIDEVINE_FAKE_CDM_LICENSE_MS", license, TRUE);
+  g_setenv ("WIDEVINE_CDM_RENEWAL_LEAD_MS", lead, TRUE);
+  g_setenv ("WIDEVINE_CDM_RENEWAL_JITTER_MS", jitter, TRUE);
+  g_assert_cmpint (opencdm_init (), ==, ERROR_NONE);
+
+  completions = g_main_context_new ();
+
+  test_renewals ();
+  test_update_from_callbacks ();
+  g_main_context_unref (completions);
+  return 0;
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+
+#include "renewal.h"
+
+static int64_t milliseconds_from_env(const gchar* name, int64_t fallback) {
+  const gchar *value = g_getenv(name);
+  guint64 ms;
+  if (value && g_ascii_string_to_unsigned(value, 10, 0, G_MAXINT32, &ms, nullptr)) {
+    return ms;
+  }
+  return fallback;
+}
+
+RenewalPolicy RenewalPolicy::fromEnvironment() {
+  return {
+    milliseconds_from_env("WIDEVINE_CDM_RENEWAL_LEAD_MS", kDefaultLeadMs),
+    milliseconds_from_env("WIDEVINE_CDM_RENEWAL_JITTER_MS", kDefaultJitterMs),
+  };
+}
+
+int64_t RenewalPolicy::delayMs(
+    int64_t expiryMs,
+    int64_t nowMs,
+    double random
+) const {
+  auto left = std::max<int64_t>(expiryMs - nowMs, 0);
+  auto start = std::max(expiryMs - leadMs - jitterMs, nowMs);
+  auto end = std::max(expiryMs - leadMs, nowMs + std::min(jitterMs, left / 2));
+  return start - nowMs + int64_t((end - start) * random);
+}
+
+void RenewalStats::renewed(int64_t marginMs) {
+  renewals++;
+  marginSumMs += marginMs;
+  auto min = minMarginMs.load();
+  while (marginMs < min && !minMarginMs.compare_exchange_weak(min, marginMs)) {
+  }
+}
+
+void RenewalStats::reset() {
+  signalled = 0;
+  expired = 0;
+  renewals = 0;
+  marginSumMs = 0;
+  minMarginMs = G_MAXINT64;
+}
+
+RenewalStatsSnapshot RenewalStats::snapshot() const {
+  uint64_t count = renewals;
+  return {
+    signalled,
+    count,
+    expired,
+    count ? minMarginMs.load() : 0,
+    count ? marginSumMs / int64_t(count) : 0,
+  };
+}
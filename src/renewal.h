@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include <glib.h>
+
+using std::atomic;
+
+// When to remind the application to renew a license, ahead of its
+// expiration. Every license gets a point picked at random in a window that
+// ends |leadMs| before it expires and starts |jitterMs| earlier, so that
+// licenses expiring together, as those fetched together do, are not all
+// renewed at once.
+struct RenewalPolicy {
+  static constexpr int64_t kDefaultLeadMs = 60000;
+  static constexpr int64_t kDefaultJitterMs = 30000;
+
+  // Set by WIDEVINE_CDM_RENEWAL_LEAD_MS and WIDEVINE_CDM_RENEWAL_JITTER_MS.
+  G_GNUC_INTERNAL
+  static RenewalPolicy fromEnvironment();
+
+  // Milliseconds from |nowMs| until the renewal of a license that expires at
+  // |expiryMs| is due, with |random| in [0, 1) picking the point in the
+  // window. A window that has started already begins now instead, and lasts
+  // at least the jitter or half of the time left, whichever is shorter, so
+  // that licenses that are late for renewal are still spread out.
+  G_GNUC_INTERNAL
+  int64_t delayMs(int64_t expiryMs, int64_t nowMs, double random) const;
+
+  int64_t leadMs;
+  int64_t jitterMs;
+};
+
+struct RenewalStatsSnapshot {
+  uint64_t signalled;
+  uint64_t renewed;
+  uint64_t expired;
+  // Time left before the expiration when licenses were renewed, 0 until one
+  // was.
+  int64_t minMarginMs;
+  int64_t avgMarginMs;
+};
+
+// How close to their expiration the licenses of a system got. Updated on the
+// executor, read from anywhere.
+struct RenewalStats {
+  G_GNUC_INTERNAL
+  void renewed(int64_t marginMs);
+  G_GNUC_INTERNAL
+  RenewalStatsSnapshot snapshot() const;
+  G_GNUC_INTERNAL
+  void reset();
+
+  atomic<uint64_t> signalled = 0;
+  atomic<uint64_t> expired = 0;
+
+ private:
+  atomic<uint64_t> renewals = 0;
+  atomic<int64_t> marginSumMs = 0;
+  atomic<int64_t> minMarginMs = G_MAXINT64;
+};
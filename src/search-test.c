@@ -1,4 +1,5 @@
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
 #include "search.h"
@@ -27,10 +28,245 @@ test_chromium (void)
   g_assert (cdm_path);
 }
 
+static void
+test_discovery_cache (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *dir = g_dir_make_tmp ("search-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  g_autofree gchar *blob = g_build_filename (dir, "libwidevinecdm.so", NULL);
+  g_autofree gchar *cache_file = g_build_filename (dir, "cache", "cdm-path", NULL);
+
+  g_assert_null (discovery_cache_load (cache_file));
+
+  g_file_set_contents (blob, "blob", -1, &error);
+  g_assert_no_error (error);
+  g_assert (discovery_cache_save (cache_file, blob, &error));
+  g_assert_no_error (error);
+  g_autofree gchar *cached = discovery_cache_load (cache_file);
+  g_assert_cmpstr (cached, ==, blob);
+
+  /* A replaced blob gets a new inode and the cache goes stale. */
+  g_autofree gchar *replacement = g_build_filename (dir, "replacement", NULL);
+  g_file_set_contents (replacement, "blob", -1, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (g_rename (replacement, blob), ==, 0);
+  g_assert_null (discovery_cache_load (cache_file));
+
+  g_assert_cmpint (g_remove (blob), ==, 0);
+  g_assert_null (discovery_cache_load (cache_file));
+
+  g_assert_cmpint (g_remove (cache_file), ==, 0);
+  g_autofree gchar *cache_dir = g_path_get_dirname (cache_file);
+  g_assert_cmpint (g_rmdir (cache_dir), ==, 0);
+  g_assert_cmpint (g_rmdir (dir), ==, 0);
+}
+
+static gchar *
+search_fixed (const gchar *root, GCancellable *cancellable, GError **error)
+{
+  return g_strdup (root);
+}
+
+static gchar *
+search_hung (const gchar *root, GCancellable *cancellable, GError **error)
+{
+  while (!g_cancellable_is_cancelled (cancellable))
+    g_usleep (1000);
+  return NULL;
+}
+
+static void
+test_discovery_priority (void)
+{
+  const gint64 timeout = 200 * G_TIME_SPAN_MILLISECOND;
+  gsize found_by = 0;
+
+  /* A higher priority candidate that finds nothing defers to the next one. */
+  CdmCandidate fallback[] = {
+    { "none", search_fixed, NULL },
+    { "fixed", search_fixed, "/fixed" },
+    { "hung", search_hung, NULL },
+  };
+  gint64 start = g_get_monotonic_time ();
+  g_autofree gchar *path = discover_cdm (fallback, G_N_ELEMENTS (fallback), timeout, &found_by);
+  g_assert_cmpstr (path, ==, "/fixed");
+  g_assert_cmpuint (found_by, ==, 1);
+  g_assert_cmpint (g_get_monotonic_time () - start, <, timeout);
+
+  /* A hung higher priority candidate only holds the result up until the
+   * deadline. */
+  CdmCandidate stuck[] = {
+    { "hung", search_hung, NULL },
+    { "fixed", search_fixed, "/fixed" },
+  };
+  start = g_get_monotonic_time ();
+  g_autofree gchar *late = discover_cdm (stuck, G_N_ELEMENTS (stuck), timeout, &found_by);
+  g_assert_cmpstr (late, ==, "/fixed");
+  g_assert_cmpuint (found_by, ==, 1);
+  g_assert_cmpint (g_get_monotonic_time () - start, >=, timeout);
+
+  CdmCandidate nothing[] = {
+    { "none", search_fixed, NULL },
+    { "none", search_fixed, NULL },
+  };
+  g_assert_null (discover_cdm (nothing, G_N_ELEMENTS (nothing), timeout, NULL));
+}
+
+static void
+make_dirs (const gchar *root, guint breadth, guint depth)
+{
+  g_assert_cmpint (g_mkdir_with_parents (root, 0700), ==, 0);
+  for (guint i = 0; depth && i < breadth; i++) {
+    g_autofree gchar *name = g_strdup_printf ("%s/%u", root, i);
+    make_dirs (name, breadth, depth - 1);
+  }
+}
+
+static void
+remove_tree (const gchar *root)
+{
+  GDir *dir = g_dir_open (root, 0, NULL);
+  const gchar *name;
+  while (dir && (name = g_dir_read_name (dir))) {
+    g_autofree gchar *child = g_build_filename (root, name, NULL);
+    if (g_file_test (child, G_FILE_TEST_IS_DIR))
+      remove_tree (child);
+    else
+      g_remove (child);
+  }
+  if (dir)
+    g_dir_close (dir);
+  g_rmdir (root);
+}
+
+static gchar *
+search_firefox (const gchar *root, GCancellable *cancellable, GError **error)
+{
+  gchar *cdm_path = NULL;
+  find_firefox_cdm (root, &cdm_path, cancellable, error);
+  return cdm_path;
+}
+
+static gchar *
+search_chromium (const gchar *root, GCancellable *cancellable, GError **error)
+{
+  gchar *cdm_path = NULL;
+  find_chromium_cdm (root, &cdm_path, cancellable, error);
+  return cdm_path;
+}
+
+/* Benchmarks discovery over synthetic profile trees: a large Firefox tree
+ * without the CDM, which has to be walked in full, and a Chromium tree that
+ * has it. */
+static void
+test_discovery_deep_trees (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *dir = g_dir_make_tmp ("search-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  g_autofree gchar *firefox = g_build_filename (dir, "firefox", NULL);
+  g_autofree gchar *chromium = g_build_filename (dir, "chromium", NULL);
+  make_dirs (firefox, 100, 2);
+  make_dirs (chromium, 100, 1);
+  g_autofree gchar *platform = g_build_filename (chromium, "WidevineCdm",
+      "1.0", "_platform_specific", "linux_x64", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (platform, 0700), ==, 0);
+  g_autofree gchar *blob = g_build_filename (platform, "libwidevinecdm.so", NULL);
+  g_file_set_contents (blob, "blob", -1, &error);
+  g_assert_no_error (error);
+
+  CdmCandidate candidates[] = {
+    { "firefox", search_firefox, firefox },
+    { "chromium", search_chromium, chromium },
+  };
+
+  gint64 start = g_get_monotonic_time ();
+  g_autofree gchar *sequential = NULL;
+  for (gsize i = 0; !sequential && i < G_N_ELEMENTS (candidates); i++)
+    sequential = candidates[i].search (candidates[i].root, NULL, NULL);
+  gint64 sequential_us = g_get_monotonic_time () - start;
+
+  start = g_get_monotonic_time ();
+  gsize found_by = 0;
+  g_autofree gchar *concurrent = discover_cdm (candidates,
+      G_N_ELEMENTS (candidates), 10 * G_TIME_SPAN_SECOND, &found_by);
+  gint64 concurrent_us = g_get_monotonic_time () - start;
+
+  g_assert_cmpstr (sequential, ==, blob);
+  g_assert_cmpstr (concurrent, ==, blob);
+  g_assert_cmpuint (found_by, ==, 1);
+  g_print ("discovery: sequential %" G_GINT64_FORMAT " us, concurrent %"
+      G_GINT64_FORMAT " us\n", sequential_us, concurrent_us);
+
+  remove_tree (dir);
+}
+
+static gchar *
+make_blob (const gchar *parent)
+{
+  g_assert_cmpint (g_mkdir_with_parents (parent, 0700), ==, 0);
+  gchar *blob = g_build_filename (parent, "libwidevinecdm.so", NULL);
+  g_autoptr(GError) error = NULL;
+  g_file_set_contents (blob, "blob", -1, &error);
+  g_assert_no_error (error);
+  return blob;
+}
+
+/* With old versions left behind next to an update, the newest version wins
+ * whatever order the directories are listed in. */
+static void
+test_newest_version (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *dir = g_dir_make_tmp ("search-test-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  g_autofree gchar *firefox = g_build_filename (dir, "firefox", NULL);
+  const gchar *firefox_versions[] = { "4.10.2710.0", "4.10.10000.0", "4.9.9999.9" };
+  g_autofree gchar *firefox_newest = NULL;
+  for (gsize i = 0; i < G_N_ELEMENTS (firefox_versions); i++) {
+    g_autofree gchar *version = g_build_filename (firefox, "profile",
+        "gmp-widevinecdm", firefox_versions[i], NULL);
+    g_autofree gchar *blob = make_blob (version);
+    if (i == 1)
+      firefox_newest = g_steal_pointer (&blob);
+  }
+  g_autofree gchar *firefox_found = NULL;
+  g_assert_true (find_firefox_cdm (firefox, &firefox_found, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpstr (firefox_found, ==, firefox_newest);
+
+  g_autofree gchar *chromium = g_build_filename (dir, "chromium", NULL);
+  const gchar *chromium_versions[] = { "4.10.2830.0", "4.10.2710.0", "4.10" };
+  for (gsize i = 0; i < G_N_ELEMENTS (chromium_versions); i++) {
+    g_autofree gchar *platform = g_build_filename (chromium, "WidevineCdm",
+        chromium_versions[i], "_platform_specific", "linux_x64", NULL);
+    g_autofree gchar *blob = make_blob (platform);
+  }
+  /* An update still being unpacked has no blob yet. */
+  g_autofree gchar *unpacking = g_build_filename (chromium, "WidevineCdm",
+      "4.10.2900.0", "_platform_specific", "linux_x64", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (unpacking, 0700), ==, 0);
+  g_autofree gchar *chromium_found = NULL;
+  g_assert_true (find_chromium_cdm (chromium, &chromium_found, NULL, &error));
+  g_assert_no_error (error);
+  g_autofree gchar *chromium_newest = g_build_filename (chromium,
+      "WidevineCdm", "4.10.2830.0", "_platform_specific", "linux_x64",
+      "libwidevinecdm.so", NULL);
+  g_assert_cmpstr (chromium_found, ==, chromium_newest);
+
+  remove_tree (dir);
+}
+
 gint
 main (gint argc, gchar **argv)
 {
   test_firefox ();
   test_chromium ();
+  test_discovery_cache ();
+  test_discovery_priority ();
+  test_discovery_deep_trees ();
+  test_newest_version ();
   return 0;
 }
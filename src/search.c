@@ -1,6 +1,11 @@
+#include <errno.h>
+
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <gio/gio.h>
 
+#include "search.h"
+
 #define CDM_BLOB "libwidevinecdm.so"
 #define ATTRS G_FILE_ATTRIBUTE_STANDARD_TYPE "," G_FILE_ATTRIBUTE_STANDARD_NAME
 
@@ -26,23 +31,63 @@ next_dir (GFileEnumerator *cwd, GCancellable *cancellable, GError **error)
   return NULL;
 }
 
+/* Orders version directory names such as "4.10.2710.0" by their numeric
+ * components, so that an update sorts after the version it replaces. */
+static gint
+compare_versions (const gchar *a, const gchar *b)
+{
+  while (*a || *b) {
+    gchar *a_end, *b_end;
+    guint64 a_part = g_ascii_strtoull (a, &a_end, 10);
+    guint64 b_part = g_ascii_strtoull (b, &b_end, 10);
+    if (a_end == a || b_end == b) {
+      return g_strcmp0 (a, b);
+    }
+    if (a_part != b_part) {
+      return a_part < b_part ? -1 : 1;
+    }
+    a = *a_end == '.' ? a_end + 1 : a_end;
+    b = *b_end == '.' ? b_end + 1 : b_end;
+  }
+  return 0;
+}
+
+/* Keeps |cdm| in |cdm_blob| if it comes from a newer version than the one
+ * found so far. */
+static void
+keep_newest (GFile *cdm, const gchar *version, gchar **newest_version, GFile **cdm_blob)
+{
+  if (*cdm_blob && compare_versions (version, *newest_version) <= 0) {
+    return;
+  }
+  g_clear_object (cdm_blob);
+  *cdm_blob = g_object_ref (cdm);
+  g_free (*newest_version);
+  *newest_version = g_strdup (version);
+}
+
 static gboolean
 check_for_firefox_cdm_blob (GFile *cwd, GFile **cdm_blob, GCancellable *cancellable, GError **error)
 {
   g_autoptr(GFileEnumerator) e = g_file_enumerate_children (cwd, ATTRS, (GFileQueryInfoFlags) 0, cancellable, error);
+  if (e == NULL) {
+    return FALSE;
+  }
+  /* Old versions may linger next to the one in use. */
+  g_autofree gchar *newest_version = NULL;
   while (!g_cancellable_is_cancelled (cancellable)) {
     g_autoptr(GFileInfo) info = next_dir(e, cancellable, error);
     if (info == NULL) {
       break;
     }
-    g_autoptr(GFile) version_dir = g_file_get_child (cwd, g_file_info_get_name (info));
+    const gchar *version = g_file_info_get_name (info);
+    g_autoptr(GFile) version_dir = g_file_get_child (cwd, version);
     g_autoptr(GFile) cdm = g_file_get_child (version_dir, CDM_BLOB);
     if (g_file_query_exists (cdm, cancellable)) {
-      *cdm_blob = g_object_ref (cdm);
-      return TRUE;
+      keep_newest (cdm, version, &newest_version, cdm_blob);
     }
   }
-  return FALSE;
+  return *cdm_blob != NULL;
 }
 
 static gboolean
@@ -55,7 +100,7 @@ walk_firefox (GFile *cwd, guint depth, guint max_depth, GFile **cdm_path, GCance
     return FALSE;
   }
   g_autoptr(GFileEnumerator) e = g_file_enumerate_children (cwd, ATTRS, (GFileQueryInfoFlags) 0, cancellable, error);
-  if (error && *error) {
+  if (e == NULL) {
     return FALSE;
   }
   while (!g_cancellable_is_cancelled (cancellable)) {
@@ -77,6 +122,9 @@ walk_firefox (GFile *cwd, guint depth, guint max_depth, GFile **cdm_path, GCance
     if (!walk_firefox (dir, depth + 1, max_depth, cdm_path, cancellable, error)) {
       return FALSE;
     }
+    if (*cdm_path) {
+      return TRUE;
+    }
   }
 
   return FALSE;
@@ -87,7 +135,7 @@ find_firefox_cdm (const gchar *root, gchar **cdm_path, GCancellable *cancellable
 {
   g_autoptr(GFile) cdm_path_file = NULL;
   g_autoptr(GFile) root_file = g_file_new_for_path (root);
-  if (!walk_firefox (root_file, 0, 2, &cdm_path_file, cancellable, error)) {
+  if (!walk_firefox (root_file, 0, 2, &cdm_path_file, cancellable, error) || cdm_path_file == NULL) {
     return FALSE;
   }
   *cdm_path = g_file_get_path (cdm_path_file);
@@ -98,7 +146,7 @@ static gboolean
 walk_chromium_platform_dir (GFile *cwd, GFile **cdm_blob, GCancellable *cancellable, GError **error)
 {
   g_autoptr(GFileEnumerator) e = g_file_enumerate_children (cwd, ATTRS, (GFileQueryInfoFlags) 0, cancellable, error);
-  if (error && *error) {
+  if (e == NULL) {
     return FALSE;
   }
   while (!g_cancellable_is_cancelled (cancellable)) {
@@ -125,18 +173,25 @@ static gboolean
 check_for_chromium_cdm_blob (GFile *cwd, GFile **cdm_blob, GCancellable *cancellable, GError **error)
 {
   g_autoptr(GFileEnumerator) e = g_file_enumerate_children (cwd, ATTRS, (GFileQueryInfoFlags) 0, cancellable, error);
+  if (e == NULL) {
+    return FALSE;
+  }
+  g_autofree gchar *newest_version = NULL;
   while (!g_cancellable_is_cancelled (cancellable)) {
     g_autoptr(GFileInfo) info = next_dir (e, cancellable, error);
     if (info == NULL) {
-      return FALSE;
+      break;
     }
-    g_autoptr(GFile) version_dir = g_file_get_child (cwd, g_file_info_get_name (info));
+    const gchar *version = g_file_info_get_name (info);
+    g_autoptr(GFile) version_dir = g_file_get_child (cwd, version);
     g_autoptr(GFile) platform_specific_dir = g_file_get_child (version_dir, "_platform_specific");
-    if (walk_chromium_platform_dir (platform_specific_dir, cdm_blob, cancellable, error)) {
-      return TRUE;
+    g_autoptr(GFile) cdm = NULL;
+    /* A version without the platform directory is skipped, not an error. */
+    if (walk_chromium_platform_dir (platform_specific_dir, &cdm, cancellable, NULL) && cdm) {
+      keep_newest (cdm, version, &newest_version, cdm_blob);
     }
   }
-  return FALSE;
+  return *cdm_blob != NULL;
 }
 
 static gboolean
@@ -146,7 +201,7 @@ walk_chromium (GFile *cwd, GFile **cdm_path, GCancellable *cancellable, GError *
     return FALSE;
   }
   g_autoptr(GFileEnumerator) e = g_file_enumerate_children (cwd, ATTRS, (GFileQueryInfoFlags) 0, cancellable, error);
-  if (error && *error) {
+  if (e == NULL) {
     return FALSE;
   }
   while (!g_cancellable_is_cancelled (cancellable)) {
@@ -175,9 +230,182 @@ find_chromium_cdm (const gchar *root, gchar **cdm_path, GCancellable *cancellabl
 {
   g_autoptr(GFile) cdm_path_file = NULL;
   g_autoptr(GFile) root_file = g_file_new_for_path (root);
-  if (!walk_chromium (root_file, &cdm_path_file, cancellable, error)) {
+  if (!walk_chromium (root_file, &cdm_path_file, cancellable, error) || cdm_path_file == NULL) {
     return FALSE;
   }
   *cdm_path = g_file_get_path (cdm_path_file);
   return TRUE;
 }
+
+typedef struct {
+  GMutex lock;
+  GCond changed;
+  gsize n_candidates;
+  gboolean *done;
+  gchar **paths;
+} Discovery;
+
+typedef struct {
+  Discovery *discovery;
+  gsize rank;
+  CdmSearchFunc search;
+  gchar *root;
+} DiscoveryJob;
+
+static void
+discovery_clear (gpointer data)
+{
+  Discovery *discovery = data;
+  for (gsize i = 0; i < discovery->n_candidates; i++) {
+    g_free (discovery->paths[i]);
+  }
+  g_free (discovery->paths);
+  g_free (discovery->done);
+  g_cond_clear (&discovery->changed);
+  g_mutex_clear (&discovery->lock);
+}
+
+static void
+discovery_job_free (gpointer data)
+{
+  DiscoveryJob *job = data;
+  g_atomic_rc_box_release_full (job->discovery, discovery_clear);
+  g_free (job->root);
+  g_free (job);
+}
+
+static void
+discovery_job_run (GTask *task, gpointer source_object, gpointer task_data, GCancellable *cancellable)
+{
+  DiscoveryJob *job = task_data;
+  gchar *path = job->search (job->root, cancellable, NULL);
+
+  Discovery *discovery = job->discovery;
+  g_mutex_lock (&discovery->lock);
+  discovery->paths[job->rank] = path;
+  discovery->done[job->rank] = TRUE;
+  g_cond_broadcast (&discovery->changed);
+  g_mutex_unlock (&discovery->lock);
+  g_task_return_boolean (task, path != NULL);
+}
+
+/* Returns the rank of the best path found so far. Sets |decided| if no
+ * search still running could find a better one. */
+static gssize
+discovery_best (Discovery *discovery, gboolean *decided)
+{
+  *decided = TRUE;
+  for (gsize i = 0; i < discovery->n_candidates; i++) {
+    if (discovery->paths[i]) {
+      return i;
+    }
+    if (!discovery->done[i]) {
+      *decided = FALSE;
+    }
+  }
+  return -1;
+}
+
+gchar *
+discover_cdm (const CdmCandidate *candidates, gsize n_candidates, gint64 timeout_us, gsize *found_by)
+{
+  Discovery *discovery = g_atomic_rc_box_new0 (Discovery);
+  g_mutex_init (&discovery->lock);
+  g_cond_init (&discovery->changed);
+  discovery->n_candidates = n_candidates;
+  discovery->done = g_new0 (gboolean, n_candidates);
+  discovery->paths = g_new0 (gchar *, n_candidates);
+
+  g_autoptr(GCancellable) cancellable = g_cancellable_new ();
+  for (gsize i = 0; i < n_candidates; i++) {
+    DiscoveryJob *job = g_new0 (DiscoveryJob, 1);
+    job->discovery = g_atomic_rc_box_acquire (discovery);
+    job->rank = i;
+    job->search = candidates[i].search;
+    job->root = g_strdup (candidates[i].root);
+
+    g_autoptr(GTask) task = g_task_new (NULL, cancellable, NULL, NULL);
+    g_task_set_task_data (task, job, discovery_job_free);
+    g_task_run_in_thread (task, discovery_job_run);
+  }
+
+  gint64 deadline = g_get_monotonic_time () + timeout_us;
+  gboolean decided = FALSE;
+  gssize best = -1;
+  g_mutex_lock (&discovery->lock);
+  for (;;) {
+    best = discovery_best (discovery, &decided);
+    if (decided || !g_cond_wait_until (&discovery->changed, &discovery->lock, deadline)) {
+      break;
+    }
+  }
+  if (!decided) {
+    best = discovery_best (discovery, &decided);
+  }
+  gchar *path = NULL;
+  if (best >= 0) {
+    path = g_strdup (discovery->paths[best]);
+    if (found_by) {
+      *found_by = best;
+    }
+  }
+  g_mutex_unlock (&discovery->lock);
+
+  g_cancellable_cancel (cancellable);
+  g_atomic_rc_box_release_full (discovery, discovery_clear);
+  return path;
+}
+
+#define CACHE_GROUP "cdm"
+
+gchar *
+discovery_cache_load (const gchar *cache_file)
+{
+  g_autoptr(GKeyFile) cache = g_key_file_new ();
+  if (!g_key_file_load_from_file (cache, cache_file, G_KEY_FILE_NONE, NULL)) {
+    return NULL;
+  }
+  g_autofree gchar *cdm_path = g_key_file_get_string (cache, CACHE_GROUP, "path", NULL);
+  if (cdm_path == NULL) {
+    return NULL;
+  }
+
+  GStatBuf st;
+  if (g_stat (cdm_path, &st) != 0) {
+    return NULL;
+  }
+  g_autoptr(GError) error = NULL;
+  guint64 size = g_key_file_get_uint64 (cache, CACHE_GROUP, "size", &error);
+  gint64 mtime = error ? 0 : g_key_file_get_int64 (cache, CACHE_GROUP, "mtime", &error);
+  guint64 inode = error ? 0 : g_key_file_get_uint64 (cache, CACHE_GROUP, "inode", &error);
+  if (error || size != (guint64) st.st_size || mtime != (gint64) st.st_mtime || inode != (guint64) st.st_ino) {
+    return NULL;
+  }
+  return g_steal_pointer (&cdm_path);
+}
+
+gboolean
+discovery_cache_save (const gchar *cache_file, const gchar *cdm_path, GError **error)
+{
+  GStatBuf st;
+  if (g_stat (cdm_path, &st) != 0) {
+    int saved_errno = errno;
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+        "%s: %s", cdm_path, g_strerror (saved_errno));
+    return FALSE;
+  }
+  g_autofree gchar *cache_dir = g_path_get_dirname (cache_file);
+  if (g_mkdir_with_parents (cache_dir, 0700) != 0) {
+    int saved_errno = errno;
+    g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+        "%s: %s", cache_dir, g_strerror (saved_errno));
+    return FALSE;
+  }
+
+  g_autoptr(GKeyFile) cache = g_key_file_new ();
+  g_key_file_set_string (cache, CACHE_GROUP, "path", cdm_path);
+  g_key_file_set_uint64 (cache, CACHE_GROUP, "size", st.st_size);
+  g_key_file_set_int64 (cache, CACHE_GROUP, "mtime", st.st_mtime);
+  g_key_file_set_uint64 (cache, CACHE_GROUP, "inode", st.st_ino);
+  return g_key_file_save_to_file (cache, cache_file, error);
+}
@@ -11,4 +11,32 @@ gboolean find_firefox_cdm (const gchar *root, gchar **cdm_path, GCancellable *ca
 G_GNUC_INTERNAL
 gboolean find_chromium_cdm (const gchar *root, gchar **cdm_path, GCancellable *cancellable, GError **error);
 
+/* Looks for the CDM under |root| and returns its path, or NULL. */
+typedef gchar *(*CdmSearchFunc) (const gchar *root, GCancellable *cancellable, GError **error);
+
+typedef struct {
+  const gchar *name;
+  CdmSearchFunc search;
+  const gchar *root;
+} CdmCandidate;
+
+/* Runs the search of every candidate concurrently and returns the path found
+ * by the first candidate, in array order, that finds one. Returns as soon as
+ * that is known, cancelling the searches still running. After |timeout_us|
+ * the best path found so far is returned, or NULL; searches stuck past that
+ * point are left to finish in the background. |found_by| is set to the index
+ * of the candidate the path comes from. */
+G_GNUC_INTERNAL
+gchar *discover_cdm (const CdmCandidate *candidates, gsize n_candidates, gint64 timeout_us, gsize *found_by);
+
+/* Returns the CDM path recorded in |cache_file| if the blob there still has the
+ * size, modification time and inode recorded alongside it, NULL otherwise. */
+G_GNUC_INTERNAL
+gchar *discovery_cache_load (const gchar *cache_file);
+
+/* Records |cdm_path| and the current size, modification time and inode of the
+ * blob it names in |cache_file|, replacing it atomically. */
+G_GNUC_INTERNAL
+gboolean discovery_cache_save (const gchar *cache_file, const gchar *cdm_path, GError **error);
+
 G_END_DECLS
@@ -0,0 +1,139 @@
+#include <glib.h>
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "open_cdm.h"
+#include "open_cdm_widevine.h"
+
+using std::atomic;
+using std::thread;
+using std::vector;
+
+static const unsigned kReaders = 4;
+static const unsigned kIterations = 2000;
+static const uint8_t kInitData[] = { 0x00, 0x00, 0x00, 0x10 };
+
+// The fake CDM takes a 16 byte response as the session's only key. The first
+// byte tells the sessions apart: 0 for the one that lives throughout.
+static void
+make_key (uint8_t key[16], guint index, guint generation)
+{
+  memset (key, 0, 16);
+  key[0] = index ? 1 : 0;
+  key[1] = index;
+  key[2] = index >> 8;
+  key[3] = generation;
+  key[15] = 0xaa;
+}
+
+static OpenCDMSession *
+construct_session (OpenCDMSystem *system)
+{
+  static OpenCDMSessionCallbacks callbacks = {};
+  OpenCDMSession *session = nullptr;
+  g_assert_cmpint (opencdm_construct_session (system, Temporary, "cenc",
+      kInitData, sizeof (kInitData), nullptr, 0, &callbacks, nullptr,
+      &session), ==, ERROR_NONE);
+  return session;
+}
+
+static void
+update (OpenCDMSession *session, const uint8_t key[16])
+{
+  g_assert_cmpint (opencdm_session_update (session, key, 16), ==, ERROR_NONE);
+}
+
+static void
+on_updated (OpenCDMError error, void *user_data)
+{
+}
+
+// Sessions are looked up by key id and their keys queried while others get
+// their keys replaced and are destroyed, with further key changes still
+// queued for them. The session that lives throughout must always be found
+// with its key usable, even while its key set is being reported again; the
+// others must no longer be found by a key they dropped or once destroyed.
+static void
+test_lookups_during_churn (void)
+{
+  auto system = opencdm_create_system ("com.widevine.alpha");
+  g_assert_nonnull (system);
+  auto context = g_main_context_new ();
+
+  uint8_t stableKey[16];
+  make_key (stableKey, 0, 0);
+  auto stable = construct_session (system);
+  update (stable, stableKey);
+
+  atomic<bool> done = false;
+  atomic<guint> latest = 0;
+  atomic<uint64_t> lookups = 0;
+  vector<thread> readers;
+  for (auto r = 0U; r < kReaders; r++) {
+    readers.emplace_back ([&]() {
+      uint64_t local = 0;
+      while (!done.load ()) {
+        g_assert_true (opencdm_get_system_session (system, stableKey, 16, 0)
+            == stable);
+        g_assert_cmpint (opencdm_session_status (stable, stableKey, 16), ==,
+            Usable);
+        // Whatever the churned sessions are up to, only their addresses are
+        // compared, as they may be gone by the time the lookup returns.
+        uint8_t key[16];
+        make_key (key, latest.load (), 1);
+        auto found = opencdm_get_system_session (system, key, 16, 0);
+        g_assert_true (found != stable);
+        local++;
+      }
+      lookups += local;
+    });
+  }
+
+  for (auto i = 1U; i <= kIterations; i++) {
+    uint8_t first[16], second[16];
+    make_key (first, i, 0);
+    make_key (second, i, 1);
+    auto session = construct_session (system);
+    latest = i;
+    update (session, first);
+    g_assert_true (opencdm_get_system_session (system, first, 16, 0)
+        == session);
+    update (session, second);
+    g_assert_null (opencdm_get_system_session (system, first, 16, 0));
+    g_assert_true (opencdm_get_system_session (system, second, 16, 0)
+        == session);
+
+    // Reported again while the session goes away.
+    g_assert_cmpint (opencdm_widevine_session_update_async (session, first,
+        16, context, on_updated, nullptr), ==, ERROR_NONE);
+    opencdm_destruct_session (session);
+    g_assert_null (opencdm_get_system_session (system, first, 16, 0));
+    g_assert_null (opencdm_get_system_session (system, second, 16, 0));
+    update (stable, stableKey);
+    while (g_main_context_iteration (context, FALSE));
+  }
+
+  done = true;
+  for (auto& reader : readers) {
+    reader.join ();
+  }
+  g_print ("%" G_GUINT64_FORMAT " lookups during %u sessions\n",
+      lookups.load (), kIterations);
+
+  g_assert_cmpint (opencdm_session_close (stable), ==, ERROR_NONE);
+  opencdm_destruct_session (stable);
+  opencdm_destruct_system (system);
+  while (g_main_context_iteration (context, FALSE));
+  g_main_context_unref (context);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  g_assert_cmpint (opencdm_init (), ==, ERROR_NONE);
+  test_lookups_during_churn ();
+  return 0;
+}
@@ -2,8 +2,10 @@
 
 #include "open_cdm.h"
 #include "open_cdm_adapter.h"
+#include "open_cdm_widevine.h"
 #include "content_decryption_module.h"
 #include <string>
+#include <vector>
 
 #include "session.h"
 #include "system.h"
@@ -30,7 +32,7 @@ OpenCDMSession::OpenCDMSession(
 }
 
 void OpenCDMSession::errorCallback(const string& message) {
-  if (callbacks->error_message_callback) {
+  if (!destroyed && callbacks->error_message_callback) {
     callbacks->error_message_callback(this, userData, message.data());
   }
 }
@@ -47,22 +49,58 @@ void OpenCDMSession::licenseRequestCallback(span<const uint8_t> message) {
   }
 }
 
+// Renewal and release messages go to the license server and their response
+// comes back through opencdm_session_update(), same as for license requests.
 void OpenCDMSession::licenseRenewalCallback(span<const uint8_t> message) {
+  licenseRequestCallback(message);
 }
 
 void OpenCDMSession::licenseReleaseCallback(span<const uint8_t> message) {
+  licenseRequestCallback(message);
 }
 
 void OpenCDMSession::individualizationRequestCallback(
     span<const uint8_t> message
 ) {
+  // A retried request still counts from the first one.
+  if (!individualizationStarted) {
+    individualizationStarted = g_get_monotonic_time();
+  }
+  if (system->individualizationCallback) {
+    system->individualizationCallback(
+        this,
+        system->individualizationUserData,
+        message.data(),
+        message.size()
+    );
+  } else {
+    GST_WARNING("%p: no individualization callback set", this);
+    errorCallback("individualization required");
+  }
 }
 
 void OpenCDMSession::onKeyUpdate(span<const cdm::KeyInformation> keys) {
+  // The CDM reports the session's whole key set each time, so keys left out
+  // have been dropped from the license.
+  KeyTable table;
   for (auto &key : keys) {
-    string keyId((char *) key.key_id, key.key_id_size);
-    keyInfo[keyId] = key;
+    auto keyId = KeyId::from(span(key.key_id, key.key_id_size));
+    if (keyId) {
+      table.update(keyId.value(), key.status, key.system_code);
+    } else {
+      LOG("%p: ignoring %u byte key id", this, key.key_id_size);
+    }
   }
+  vector<KeyId> dropped;
+  keyInfo.update([&](KeyTable& current) {
+    current.forEach([&](const KeyEntry& key) {
+      if (!table.find(key.id)) {
+        dropped.push_back(key.id);
+      }
+    });
+    current = std::move(table);
+  });
+  system->indexSessionKeys(*this, keys, dropped);
   if (callbacks->key_update_callback) {
     for (auto &key : keys) {
       span keyId(key.key_id, key.key_id + key.key_id_size);
@@ -79,23 +117,26 @@ void OpenCDMSession::onKeyUpdate(span<const cdm::KeyInformation> keys) {
   }
 }
 
-optional<cdm::KeyInformation> OpenCDMSession::getKeyInfo(
-    const string& keyId
+optional<KeyEntry> OpenCDMSession::getKeyInfo(
+    span<const uint8_t> keyId
 ) const {
-  if (keyInfo.contains(keyId)) {
-    return keyInfo.at(keyId);
-  } else {
+  auto id = KeyId::from(keyId);
+  if (!id) {
     return std::nullopt;
   }
+  return keyInfo.read([&](const KeyTable& table) {
+    return table.find(id.value());
+  });
 }
 
-bool OpenCDMSession::hasKey(const string& keyId) const {
-  return keyInfo.contains(keyId);
+bool OpenCDMSession::hasKey(span<const uint8_t> keyId) const {
+  return getKeyInfo(keyId).has_value();
 }
 
 OpenCDMError opencdm_destruct_session(OpenCDMSession* session) {
   LOG("%p", session);
-  delete session;
+  // The system owns the session, dropping its references frees it.
+  session->system->destroySession(*session);
   return ERROR_NONE;
 }
 
@@ -130,11 +171,10 @@ KeyStatus opencdm_session_status(
     const uint8_t length
 ) {
   LOG("%p", session);
-  string id(keyId, keyId + length);
-  auto key = session->getKeyInfo(id);
+  auto key = session->getKeyInfo(span(keyId, length));
   cdm::KeyStatus status;
   if (key) {
-    status = key.value().status;
+    status = key->keyStatus();
   } else {
     status = cdm::KeyStatus::kStatusPending;
   }
@@ -147,9 +187,20 @@ uint32_t opencdm_session_has_key_id(
     const uint8_t keyId[]
 ) {
   LOG("%p", session);
-  string id(keyId, keyId + length);
-  auto key = session->getKeyInfo(id);
-  return key.has_value();
+  return session->hasKey(span(keyId, length));
+}
+
+OpenCDMError opencdm_widevine_session_get_metrics(
+    const OpenCDMSession* session,
+    OpenCDMWidevineSessionMetrics* metrics
+) {
+  if (!session || !metrics) {
+    return ERROR_INVALID_ARG;
+  }
+  metrics->decrypt_copied_bytes = session->decryptCounters.copiedBytes;
+  metrics->decrypt_zero_copy_bytes = session->decryptCounters.zeroCopyBytes;
+  metrics->decrypt_duplicated_bytes = session->decryptCounters.duplicatedBytes;
+  return ERROR_NONE;
 }
 
 OpenCDMError opencdm_session_load(OpenCDMSession* session) {
@@ -177,6 +228,154 @@ OpenCDMError opencdm_session_close(OpenCDMSession* session) {
   return session->system->closeSession(*session);
 }
 
+OpenCDMError opencdm_widevine_session_load_async(
+    OpenCDMSession* session,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* userData
+) {
+  if (!session || !complete) {
+    return ERROR_INVALID_ARG;
+  }
+  LOG("%p", session);
+  session->system->loadSessionAsync(
+      *session,
+      completeOn(context, complete, userData)
+  );
+  return ERROR_NONE;
+}
+
+OpenCDMError opencdm_widevine_session_update_async(
+    OpenCDMSession* session,
+    const uint8_t keyMessage[],
+    const uint16_t keyLength,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* userData
+) {
+  if (!session || !complete) {
+    return ERROR_INVALID_ARG;
+  }
+  LOG("%p", session);
+  auto message = span<const uint8_t>(keyMessage, keyMessage + keyLength);
+  session->system->updateSessionAsync(
+      *session,
+      message,
+      completeOn(context, complete, userData)
+  );
+  return ERROR_NONE;
+}
+
+OpenCDMError opencdm_widevine_session_remove_async(
+    OpenCDMSession* session,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* userData
+) {
+  if (!session || !complete) {
+    return ERROR_INVALID_ARG;
+  }
+  LOG("%p", session);
+  session->system->removeSessionAsync(
+      *session,
+      completeOn(context, complete, userData)
+  );
+  return ERROR_NONE;
+}
+
+OpenCDMError opencdm_widevine_session_close_async(
+    OpenCDMSession* session,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* userData
+) {
+  if (!session || !complete) {
+    return ERROR_INVALID_ARG;
+  }
+  LOG("%p", session);
+  session->system->closeSessionAsync(
+      *session,
+      completeOn(context, complete, userData)
+  );
+  return ERROR_NONE;
+}
+
+// Makes every memory of the writable |buffer| safe to write to, duplicating
+// only the ones that are shared with another buffer.
+static bool makeMemoriesWritable(GstBuffer* buffer, size_t& duplicatedBytes) {
+  auto memoryCount = gst_buffer_n_memory(buffer);
+  for (auto i = 0U; i < memoryCount; i++) {
+    auto memory = gst_buffer_peek_memory(buffer, i);
+    if (gst_memory_is_writable(memory)) {
+      continue;
+    }
+    auto copy = gst_memory_copy(memory, 0, -1);
+    if (!copy) {
+      return false;
+    }
+    duplicatedBytes += gst_memory_get_sizes(copy, nullptr, nullptr);
+    gst_buffer_replace_memory(buffer, i, copy);
+  }
+  return true;
+}
+
+// Decrypts the memories of the writable |buffer| where they are, one by one;
+// mapping the whole buffer would merge them into a freshly allocated copy.
+static OpenCDMError decryptMemories(
+    OpenCDMSession* session,
+    GstBuffer* buffer,
+    span<uint8_t> subsampleData,
+    const uint32_t subsampleCount,
+    span<uint8_t> ivData,
+    span<uint8_t> keyIdData
+) {
+  size_t duplicatedBytes = 0;
+  auto writable = makeMemoriesWritable(buffer, duplicatedBytes);
+  session->decryptCounters.duplicatedBytes += duplicatedBytes;
+  if (!writable) {
+    return ERROR_INVALID_DECRYPT_BUFFER;
+  }
+
+  auto memoryCount = gst_buffer_n_memory(buffer);
+  vector<GstMapInfo> memoryInfos(memoryCount);
+  vector<span<uint8_t>> chunks;
+  chunks.reserve(memoryCount);
+  OpenCDMError result = ERROR_NONE;
+  for (auto i = 0U; i < memoryCount; i++) {
+    auto memory = gst_buffer_peek_memory(buffer, i);
+    if (!gst_memory_map(memory, &memoryInfos[i], GST_MAP_READWRITE)) {
+      result = ERROR_INVALID_DECRYPT_BUFFER;
+      break;
+    }
+    chunks.emplace_back(memoryInfos[i].data, memoryInfos[i].size);
+  }
+
+  if (result == ERROR_NONE && chunks.size() == 1) {
+    result = session->system->decrypt(
+        *session,
+        chunks.front(),
+        subsampleData,
+        subsampleCount,
+        ivData,
+        keyIdData
+    );
+  } else if (result == ERROR_NONE && chunks.size() > 1) {
+    result = session->system->decryptScattered(
+        *session,
+        chunks,
+        subsampleData,
+        subsampleCount,
+        ivData,
+        keyIdData
+    );
+  }
+
+  for (auto i = 0U; i < chunks.size(); i++) {
+    gst_memory_unmap(memoryInfos[i].memory, &memoryInfos[i]);
+  }
+  return result;
+}
+
 OpenCDMError opencdm_gstreamer_session_decrypt(
     OpenCDMSession* session,
     GstBuffer* buffer,
@@ -187,30 +386,45 @@ OpenCDMError opencdm_gstreamer_session_decrypt(
     uint32_t initWithLast15
 ) {
   UNUSED(initWithLast15);
-  GstMapInfo bufferInfo, subsampleInfo, ivInfo, keyIdInfo;
+  GstMapInfo subsampleInfo, ivInfo, keyIdInfo;
 
-  gst_buffer_map(buffer, &bufferInfo, GST_MAP_READ);
   if (GST_IS_BUFFER(subsamples)) {
     gst_buffer_map(subsamples, &subsampleInfo, GST_MAP_READ);
   }
   gst_buffer_map(iv, &ivInfo, GST_MAP_READ);
   gst_buffer_map(keyID, &keyIdInfo, GST_MAP_READ);
 
-  span<uint8_t> bufferData(bufferInfo.data, bufferInfo.size);
   span<uint8_t> subsampleData(subsampleInfo.data, subsampleInfo.size);
   span<uint8_t> ivData(ivInfo.data, ivInfo.size);
   span<uint8_t> keyIdData(keyIdInfo.data, keyIdInfo.size);
 
-  auto result = session->system->decrypt(
-      *session,
-      bufferData,
-      subsampleData,
-      subsampleCount,
-      ivData,
-      keyIdData
-  );
+  OpenCDMError result;
+  if (gst_buffer_is_writable(buffer)) {
+    result = decryptMemories(
+        session,
+        buffer,
+        subsampleData,
+        subsampleCount,
+        ivData,
+        keyIdData
+    );
+  } else {
+    // Its memories may be referenced elsewhere too, e.g. behind a tee, so
+    // none of them is swapped for a private copy or decrypted where it lies:
+    // the buffer is mapped as a whole and the CDM's output written there.
+    GstMapInfo bufferInfo;
+    gst_buffer_map(buffer, &bufferInfo, GST_MAP_READ);
+    result = session->system->decrypt(
+        *session,
+        span<uint8_t>(bufferInfo.data, bufferInfo.size),
+        subsampleData,
+        subsampleCount,
+        ivData,
+        keyIdData
+    );
+    gst_buffer_unmap(buffer, &bufferInfo);
+  }
 
-  gst_buffer_unmap(buffer, &bufferInfo);
   if (GST_IS_BUFFER(subsamples)) {
     gst_buffer_unmap(subsamples, &subsampleInfo);
   }
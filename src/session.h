@@ -3,15 +3,17 @@
 #include <string>
 #include <optional>
 #include <span>
-#include <unordered_map>
 
 #include "open_cdm.h"
 #include "content_decryption_module.h"
 
+#include "decrypt.h"
+#include "key_table.h"
+#include "snapshot.h"
+
 using std::optional;
 using std::string;
 using std::span;
-using std::unordered_map;
 
 #include <glib.h>
 
@@ -41,15 +43,25 @@ struct OpenCDMSession {
   G_GNUC_INTERNAL
   void onKeyUpdate(span<const cdm::KeyInformation> keys);
   G_GNUC_INTERNAL
-  optional<cdm::KeyInformation> getKeyInfo(const string& keyId) const;
+  optional<KeyEntry> getKeyInfo(span<const uint8_t> keyId) const;
   G_GNUC_INTERNAL
-  bool hasKey(const string& keyId) const;
+  bool hasKey(span<const uint8_t> keyId) const;
 
   string id;
   cdm::SessionType sessionType;
-  cdm::Time expiration;
+  // 0 while the license does not expire.
+  cdm::Time expiration = 0;
   OpenCDMSystem* system;
   OpenCDMSessionCallbacks* callbacks;
   void* userData;
-  unordered_map<string, cdm::KeyInformation> keyInfo;
+  // When the session asked for the device to be provisioned, and whether that
+  // has been done since. Only touched on the executor.
+  gint64 individualizationStarted = 0;
+  bool individualized = false;
+  // Set on the executor once the application destroyed the session, after
+  // which errors are no longer reported to it.
+  bool destroyed = false;
+  // Written from CDM callbacks, read lock-free from streaming threads.
+  Snapshot<KeyTable> keyInfo;
+  DecryptCounters decryptCounters;
 };
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using std::atomic;
+using std::mutex;
+using std::vector;
+
+// Publishes immutable snapshots of a T, RCU style. Readers never lock and
+// never wait: they announce themselves in one of two epoch counters, load the
+// current snapshot and run a function on it. Writers are serialized, copy the
+// current snapshot, modify the copy and swap it in. A replaced snapshot is
+// only freed once every reader that could still see it has left, which is
+// tracked by advancing the epoch whenever the older counter drains; until then
+// it waits on a retired list that later writes (or the destructor) reclaim.
+template <typename T>
+struct Snapshot {
+  Snapshot() : current(new T()) { }
+  explicit Snapshot(T initial) : current(new T(std::move(initial))) { }
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  ~Snapshot() {
+    for (auto& item : retired) {
+      delete item.snapshot;
+    }
+    delete current.load();
+  }
+
+  template <typename Func>
+  auto read(Func&& func) const {
+    auto slot = enter();
+    struct Leave {
+      const Snapshot* self;
+      unsigned slot;
+      ~Leave() { self->readers[slot].count.fetch_sub(1); }
+    } leave { this, slot };
+    return func(*current.load());
+  }
+
+  template <typename Func>
+  void update(Func&& modify) {
+    std::lock_guard guard(writeLock);
+    auto next = new T(*current.load());
+    modify(*next);
+    auto previous = current.exchange(next);
+    retired.push_back({ previous, epoch.load() });
+    reclaim();
+  }
+
+  // Frees what can be freed and returns how many replaced snapshots are
+  // still waiting for readers to leave.
+  size_t pendingReclamation() {
+    std::lock_guard guard(writeLock);
+    reclaim();
+    return retired.size();
+  }
+
+ private:
+  struct alignas(64) ReaderCount {
+    mutable atomic<uint64_t> count = 0;
+  };
+
+  struct Retired {
+    const T* snapshot;
+    uint64_t epoch;
+  };
+
+  unsigned enter() const {
+    for (;;) {
+      auto observed = epoch.load();
+      unsigned slot = observed & 1;
+      readers[slot].count.fetch_add(1);
+      if (epoch.load() == observed) {
+        return slot;
+      }
+      readers[slot].count.fetch_sub(1);
+    }
+  }
+
+  // Readers active during epoch E registered in E or E - 1. Moving to E + 1
+  // requires the E - 1 readers to be gone, so once the epoch is two past the
+  // one a snapshot was retired in, nobody can still hold it.
+  void reclaim() {
+    for (auto i = 0; i < 2; i++) {
+      auto observed = epoch.load();
+      if (readers[(observed + 1) & 1].count.load() != 0) {
+        break;
+      }
+      epoch.store(observed + 1);
+    }
+    auto now = epoch.load();
+    std::erase_if(retired, [now](const Retired& item) {
+      if (item.epoch + 2 > now) {
+        return false;
+      }
+      delete item.snapshot;
+      return true;
+    });
+  }
+
+  atomic<const T*> current;
+  atomic<uint64_t> epoch = 0;
+  ReaderCount readers[2];
+
+  mutex writeLock;
+  vector<Retired> retired;
+};
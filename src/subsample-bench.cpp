@@ -0,0 +1,71 @@
+#include <glib.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "decrypt.h"
+
+using std::vector;
+
+static std::atomic<uint64_t> allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  if (auto ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+  std::free(ptr);
+}
+
+static void run(uint32_t subsampleCount) {
+  const auto iterations = 200000U / subsampleCount + 1000U;
+  vector<uint8_t> subsamples;
+  for (auto i = 0U; i < subsampleCount; i++) {
+    subsamples.insert(subsamples.end(), { 0x00, 0x60, 0x00, 0x00, 0x0f, 0xa0 });
+  }
+  size_t payloadSize = subsampleCount * (0x60 + 0xfa0);
+
+  // The first parse on a thread may size the spill buffer.
+  {
+    SubsampleMap map;
+    parseSubsamples(subsamples, subsampleCount, payloadSize, map);
+  }
+
+  auto before = allocations.load();
+  auto start = g_get_monotonic_time();
+  for (auto i = 0U; i < iterations; i++) {
+    SubsampleMap map;
+    auto result = parseSubsamples(subsamples, subsampleCount, payloadSize, map);
+    g_assert(result == ERROR_NONE);
+    g_assert(map.sampleSize == payloadSize);
+  }
+  auto elapsed = g_get_monotonic_time() - start;
+  auto allocated = allocations.load() - before;
+
+  g_print(
+      "subsamples=%-4u ns/call=%-8.1f allocations/call=%.3f\n",
+      subsampleCount,
+      elapsed * 1000.0 / iterations,
+      (double) allocated / iterations
+  );
+  g_assert(allocated == 0);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  for (auto count : { 1U, 8U, 64U, 512U }) {
+    run(count);
+  }
+  return 0;
+}
@@ -0,0 +1,123 @@
+#include <glib.h>
+
+#include <cstdio>
+#include <unistd.h>
+
+#include "open_cdm.h"
+#include "open_cdm_widevine.h"
+
+static const unsigned kWarmup = 200;
+static const unsigned kIterations = 3000;
+static const unsigned kSessions = 4;
+// Generous bounds; they are there to catch teardown waiting on something or
+// leaking per system, not to benchmark.
+static const gint64 kMaxDestroyUs = 100000;
+static const long kMaxRssGrowthKiB = 16 * 1024;
+
+static const uint8_t kInitData[] = { 0x00, 0x00, 0x00, 0x10 };
+static const uint8_t kHold[] = { 'h', 'o', 'l', 'd' };
+// Widevine by name and by system id, taken in turns.
+static const char *const kKeySystems[] = {
+  "com.widevine.alpha",
+  "edef8ba9-79d6-4ace-a3c8-27dcd51d21ed",
+};
+
+static long
+rss_kib (void)
+{
+  long pages = 0, resident = 0;
+  FILE *statm = fopen ("/proc/self/statm", "r");
+  if (!statm)
+    return 0;
+  if (fscanf (statm, "%ld %ld", &pages, &resident) != 2)
+    resident = 0;
+  fclose (statm);
+  return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+static void
+on_held_update (OpenCDMError result, void *user_data)
+{
+  g_assert_cmpint (result, !=, ERROR_NONE);
+  (*(guint *) user_data)++;
+}
+
+// Creates a system with a few sessions, each with a pending timer and an
+// update the CDM never settles, and destroys it straight away.
+static gint64
+churn_once (const char *keySystem, GMainContext *context, guint *failed)
+{
+  static OpenCDMSessionCallbacks callbacks = {};
+  auto system = opencdm_create_system (keySystem);
+  g_assert_nonnull (system);
+
+  for (auto i = 0U; i < kSessions; i++) {
+    OpenCDMSession *session = nullptr;
+    g_assert_cmpint (opencdm_construct_session (system, Temporary, "cenc",
+        kInitData, sizeof (kInitData), nullptr, 0, &callbacks, nullptr,
+        &session), ==, ERROR_NONE);
+    g_assert_cmpint (opencdm_widevine_session_update_async (session, kHold,
+        sizeof (kHold), context, on_held_update, failed), ==, ERROR_NONE);
+  }
+
+  OpenCDMWidevineSystemMetrics metrics;
+  g_assert_cmpint (opencdm_widevine_system_get_metrics (system, &metrics), ==,
+      ERROR_NONE);
+  g_assert_cmpuint (metrics.outstanding_promises, ==, kSessions);
+
+  auto start = g_get_monotonic_time ();
+  g_assert_cmpint (opencdm_destruct_system (system), ==, ERROR_NONE);
+  return g_get_monotonic_time () - start;
+}
+
+static void
+test_churn (void)
+{
+  auto context = g_main_context_new ();
+  guint failed = 0;
+
+  g_assert_cmpint (opencdm_init (), ==, ERROR_NONE);
+  for (auto i = 0U; i < kWarmup; i++) {
+    churn_once (kKeySystems[i % 2], context, &failed);
+    while (g_main_context_iteration (context, FALSE));
+  }
+  g_assert_cmpuint (failed, ==, kWarmup * kSessions);
+
+  auto rssBefore = rss_kib ();
+  gint64 total = 0, slowest = 0;
+  for (auto i = 0U; i < kIterations; i++) {
+    auto elapsed = churn_once (kKeySystems[i % 2], context, &failed);
+    total += elapsed;
+    slowest = MAX (slowest, elapsed);
+    while (g_main_context_iteration (context, FALSE));
+  }
+  auto growth = rss_kib () - rssBefore;
+
+  g_assert_cmpuint (failed, ==, (kWarmup + kIterations) * kSessions);
+  g_print ("%u systems: destroy avg %" G_GINT64_FORMAT " us, max %"
+      G_GINT64_FORMAT " us, rss growth %ld KiB\n", kIterations,
+      total / kIterations, slowest, growth);
+  g_assert_cmpint (slowest, <, kMaxDestroyUs);
+  g_assert_cmpint (growth, <, kMaxRssGrowthKiB);
+
+  // With WIDEVINE_CDM_POOL_SIZE set every system after the first reuses the
+  // CDM instance of the previous one, whichever way Widevine was named.
+  OpenCDMWidevineCdmPoolMetrics pool;
+  g_assert_cmpint (opencdm_widevine_get_cdm_pool_metrics (&pool), ==,
+      ERROR_NONE);
+  if (g_getenv ("WIDEVINE_CDM_POOL_SIZE")) {
+    g_assert_cmpuint (pool.hits, >=, kWarmup + kIterations - 1);
+    g_assert_cmpuint (pool.idle, ==, 1);
+  } else {
+    g_assert_cmpuint (pool.hits, ==, 0);
+  }
+
+  g_main_context_unref (context);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  test_churn ();
+  return 0;
+}
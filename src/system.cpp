@@ -1,15 +1,17 @@
 // SPDX-License-Identifier: MIT
 
 #include <gst/gst.h>
-#include <gst/gstclock.h>
-#include <gst/base/gstbytereader.h>
 
 #include <glib.h>
 #include <gmodule.h>
 
+#include <pthread.h>
+
 #include <atomic>
+#include <functional>
 #include <future>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <span>
 #include <string>
@@ -19,13 +21,23 @@
 #include <variant>
 
 #include "open_cdm.h"
+#include "open_cdm_widevine.h"
 #include "content_decryption_module.h"
 
+#include "buffer_pool.h"
+#include "cdm_module.h"
+#include "cdm_pool.h"
+#include "decrypt.h"
+#include "file_io.h"
+#include "promise_registry.h"
+#include "renewal.h"
 #include "system.h"
 #include "search.h"
 #include "session.h"
+#include "timer_wheel.h"
 
 using std::atomic_uint32_t;
+using std::function;
 using std::future;
 using std::monostate;
 using std::optional;
@@ -66,48 +78,23 @@ GST_DEBUG_CATEGORY(sparkle_widevine_debug_cat);
 
 static const string widevineId("com.widevine.alpha");
 static const string widevineUUID("edef8ba9-79d6-4ace-a3c8-27dcd51d21ed");
+// The only version of the storage ID there is.
+static const uint32_t kStorageIdVersion = 1;
 
-static GModule *mod;
-
-using InitializeCdmModuleFunc = void (*)();
-using CreateCdmInstanceFunc = void* (*)(
-    int cdm_interface_version,
-    const char* key_system,
-    uint32_t key_system_size,
-    GetCdmHostFunc get_cdm_host_func,
-    void* user_data
-);
-
-static bool initialize_cdm(GModule* mod) {
-  void* sym;
-  if(!g_module_symbol(mod, G_STRINGIFY(INITIALIZE_CDM_MODULE), &sym)) {
-    return false;
-  }
-  auto func = reinterpret_cast<InitializeCdmModuleFunc>(sym);
-  func();
-  return true;
-}
-
-static bool create_cdm_instance(
-    GModule* mod,
-    cdm::ContentDecryptionModule_10*& instance,
-    const string& keySystem,
-    GetCdmHostFunc get_cdm_host,
-    void* user_data
-) {
-  void* sym;
-  if (!g_module_symbol(mod, G_STRINGIFY(CreateCdmInstance), &sym)) {
-    return false;
-  }
-  auto func = reinterpret_cast<CreateCdmInstanceFunc>(sym);
-  auto ptr = func(10, keySystem.data(), keySystem.size(), get_cdm_host, user_data);
-  if (ptr == nullptr) {
-    return false;
-  }
-  instance = reinterpret_cast<cdm::ContentDecryptionModule_10*>(ptr);
-  return true;
+// The module new systems create their CDM from. Replaced when hot reloading
+// finds a newer blob, and otherwise never unloaded, not even at exit.
+static std::mutex module_lock;
+static shared_ptr<CdmModule>& current_module = *new shared_ptr<CdmModule>();
+
+static shared_ptr<CdmModule> acquire_module() {
+  std::lock_guard guard(module_lock);
+  return current_module;
 }
 
+// Bounds the search for the CDM, which may be stuck on a network home
+// directory.
+static const guint64 kDefaultDiscoveryTimeoutMs = 2000;
+
 static const gchar *widevine_cdm_blob_env() {
   return g_getenv ("WIDEVINE_CDM_BLOB");
 }
@@ -200,68 +187,196 @@ static gchar* find_chrome_widevine_cdm() {
 }
 #endif
 
+static gint64 discovery_timeout_us() {
+  const gchar *value = g_getenv("WIDEVINE_CDM_DISCOVERY_TIMEOUT_MS");
+  guint64 ms;
+  if (!value || !g_ascii_string_to_unsigned(value, 10, 1, G_MAXINT32, &ms, nullptr)) {
+    ms = kDefaultDiscoveryTimeoutMs;
+  }
+  return ms * G_TIME_SPAN_MILLISECOND;
+}
+
+static gchar *search_chrome(const gchar*, GCancellable*, GError**) {
+  return find_chrome_widevine_cdm();
+}
+
+static gchar *search_firefox(const gchar *root, GCancellable *cancellable, GError **error) {
+  gchar *cdm_path = nullptr;
+  find_firefox_cdm(root, &cdm_path, cancellable, error);
+  return cdm_path;
+}
+
+static gchar *search_chromium(const gchar *root, GCancellable *cancellable, GError **error) {
+  gchar *cdm_path = nullptr;
+  find_chromium_cdm(root, &cdm_path, cancellable, error);
+  return cdm_path;
+}
+
+// Set by opencdm_widevine_zygote_init() before loading the module.
+static std::atomic<bool> zygote_mode = false;
+
+// Probes the known install locations of the CDM, which means walking browser
+// profile directories. All of them are searched at once; the order of the
+// candidates is their priority.
+static gchar *search_cdm() {
+#ifdef __APPLE__
+  // On macOS, try to find Widevine in Chrome
+  const CdmCandidate candidates[] = {
+    { "Chrome", search_chrome, nullptr },
+  };
+#else
+  // Linux paths
+  g_autofree gchar *ff_home = firefox_dir();
+  g_autofree gchar *chr_home = chromium_dir();
+  const CdmCandidate candidates[] = {
+    // Chrome first (most reliable), then Firefox, then Chromium
+    { "chrome", search_chrome, nullptr },
+    { "firefox", search_firefox, ff_home },
+    { "chromium", search_chromium, chr_home },
+  };
+#endif
+  gsize found_by = 0;
+  gchar *cdm_path = nullptr;
+  if (zygote_mode) {
+    // A zygote starts no threads: the children would inherit the GIO thread
+    // pool without its threads.
+    for (gsize i = 0; !cdm_path && i < G_N_ELEMENTS(candidates); i++) {
+      cdm_path = candidates[i].search(candidates[i].root, nullptr, nullptr);
+      found_by = i;
+    }
+  } else {
+    cdm_path = discover_cdm(candidates, G_N_ELEMENTS(candidates), discovery_timeout_us(), &found_by);
+  }
+  if (cdm_path) {
+    GST_LOG("found %s cdm@%s", candidates[found_by].name, cdm_path);
+  }
+  return cdm_path;
+}
+
+static gchar *discovery_cache_file() {
+  return g_build_filename(g_get_user_cache_dir(), "sparkle-cdm-widevine", "cdm-path", NULL);
+}
+
+static bool hot_reload_enabled() {
+  const gchar *value = g_getenv("WIDEVINE_CDM_HOT_RELOAD");
+  return value && g_strcmp0(value, "0") != 0;
+}
+
+// Blobs are opened with local binding, as browsers do. A newer blob loaded by
+// a hot reload next to the one in use then resolves its symbols to its own
+// rather than to those of the blob loaded first.
+static GModule *open_cdm_module(const gchar *path) {
+  return g_module_open(
+      path,
+      static_cast<GModuleFlags>(G_MODULE_BIND_LAZY | G_MODULE_BIND_LOCAL)
+  );
+}
+
+// Searches for the blob again, bypassing the cache, and has new systems use
+// it if it is not the one loaded already. Returns the path of the blob in use.
+static string reload_module() {
+  auto current = acquire_module();
+  g_autofree gchar *cdm_path = search_cdm();
+  if (!cdm_path) {
+    GST_WARNING("cdm@%s changed but no cdm was found, keeping it", current->path.c_str());
+    return current->path;
+  }
+  auto handle = open_cdm_module(cdm_path);
+  if (!handle) {
+    GST_WARNING("could not open cdm@%s: %s", cdm_path, g_module_error());
+    return current->path;
+  }
+  // GModule hands out the loaded module again for the same file name; a blob
+  // replaced in place is only picked up by a process that has not loaded it.
+  if (handle == current->handle) {
+    g_module_close(handle);
+    return current->path;
+  }
+  auto module = CdmModule::initialize(handle, cdm_path);
+  if (!module) {
+    GST_WARNING("cdm@%s is not usable", cdm_path);
+    return current->path;
+  }
+  g_autofree gchar *cache_file = discovery_cache_file();
+  g_autoptr(GError) error = nullptr;
+  if (!discovery_cache_save(cache_file, cdm_path, &error)) {
+    GST_WARNING("could not cache cdm path: %s", error->message);
+  }
+  GST_INFO("new systems use cdm@%s instead of %s", cdm_path, current->path.c_str());
+  std::lock_guard guard(module_lock);
+  current_module = module;
+  return module->path;
+}
+
 static void do_init(bool& success) {
   GST_DEBUG_CATEGORY_INIT(sparkle_widevine_debug_cat, "sprklcdm-widevine", 0,
       "Sparkle CDM Widevine");
 
+  GModule *mod = nullptr;
   g_autofree gchar *cdm_path = nullptr;
+  bool discovered = false;
   const gchar *widevine_cdm_blob = widevine_cdm_blob_env();
   
   if (widevine_cdm_blob && g_file_test(widevine_cdm_blob, G_FILE_TEST_EXISTS)) {
     GST_LOG("using env@%s", widevine_cdm_blob);
-    mod = g_module_open(widevine_cdm_blob, GModuleFlags::G_MODULE_BIND_LAZY);
-  } 
-#ifdef __APPLE__
-  else {
-    // On macOS, try to find Widevine in Chrome
-    cdm_path = find_chrome_widevine_cdm();
-    if (cdm_path) {
-      GST_LOG("found Chrome CDM@%s", cdm_path);
-      mod = g_module_open(cdm_path, GModuleFlags::G_MODULE_BIND_LAZY);
-    }
-  }
-#else
-  else {
-    // Linux paths
-    g_autofree gchar *ff_home = firefox_dir();
-    g_autofree gchar *chr_home = chromium_dir();
-    
-    // Try to find CDM in Chrome first (most reliable)
-    cdm_path = find_chrome_widevine_cdm();
-    if (cdm_path) {
-      GST_LOG("found chrome cdm@%s", cdm_path);
-      mod = g_module_open(cdm_path, GModuleFlags::G_MODULE_BIND_LAZY);
+    cdm_path = g_strdup(widevine_cdm_blob);
+    mod = open_cdm_module(cdm_path);
+  } else {
+    // A path found by an earlier process is trusted as long as the blob it
+    // names looks unchanged, which costs one stat instead of a search.
+    auto started = g_get_monotonic_time();
+    g_autofree gchar *cache_file = discovery_cache_file();
+    cdm_path = discovery_cache_load(cache_file);
+    bool cached = cdm_path;
+    if (cached) {
+      GST_LOG("found cached cdm@%s", cdm_path);
+      mod = open_cdm_module(cdm_path);
     }
-    // Then try Firefox
-    else if (find_firefox_cdm(ff_home, &cdm_path, nullptr, nullptr)) {
-      GST_LOG("found firefox cdm@%s", cdm_path);
-      mod = g_module_open(cdm_path, GModuleFlags::G_MODULE_BIND_LAZY);
-    } 
-    // Then Chromium
-    else if (find_chromium_cdm(chr_home, &cdm_path, nullptr, nullptr)) {
-      GST_LOG("found chromium cdm@%s", cdm_path);
-      mod = g_module_open(cdm_path, GModuleFlags::G_MODULE_BIND_LAZY);
+    if (!mod) {
+      g_free(cdm_path);
+      cdm_path = search_cdm();
+      cached = false;
+      if (cdm_path) {
+        mod = open_cdm_module(cdm_path);
+      }
+      g_autoptr(GError) error = nullptr;
+      if (mod && !discovery_cache_save(cache_file, cdm_path, &error)) {
+        GST_WARNING("could not cache cdm path: %s", error->message);
+      }
     }
+    discovered = mod;
+    GST_INFO("cdm discovery took %" G_GINT64_FORMAT " us (%s)",
+        g_get_monotonic_time() - started, cached ? "cached" : "searched");
   }
-#endif
   
   if (!mod) {
     GST_ERROR("no cdm found, trying fallback");
+    g_free(cdm_path);
 #ifdef __APPLE__
-    mod = g_module_open("libwidevinecdm.dylib", GModuleFlags::G_MODULE_BIND_LAZY);
+    cdm_path = g_strdup("libwidevinecdm.dylib");
 #else
-    mod = g_module_open("libwidevinecdm.so", GModuleFlags::G_MODULE_BIND_LAZY);
+    cdm_path = g_strdup("libwidevinecdm.so");
 #endif
+    mod = open_cdm_module(cdm_path);
   }
 
-  success = mod && initialize_cdm(mod);
+  if (mod) {
+    current_module = CdmModule::initialize(mod, cdm_path);
+  }
+  success = current_module != nullptr;
   
   if (!success) {
     if (mod) {
+      GST_ERROR("Failed to initialize CDM: %s is not a CDM", cdm_path);
+    } else {
       const gchar *error = g_module_error();
-      GST_ERROR("Failed to initialize CDM: %s", error ? error : "unknown error");
+      GST_ERROR("Failed to open CDM module: %s", error ? error : "unknown error");
+    }
+  } else if (discovered && hot_reload_enabled()) {
+    if (zygote_mode) {
+      GST_WARNING("hot reloading is not available to a zygote");
     } else {
-      GST_ERROR("Failed to open CDM module");
+      watchCdmModule(cdm_path, reload_module);
     }
   }
 }
@@ -273,249 +388,117 @@ static bool do_init_once() {
   return success;
 }
 
-static atomic_uint32_t nextPromiseId_ = 0;
-uint32_t nextPromiseId() {
-  return nextPromiseId_.fetch_add(1);
-}
-
-struct VecBuffer final : Buffer {
-  vector<uint8_t> data;
-
-  VecBuffer(uint32_t capacity) { data.resize(capacity); }
-  void Destroy() final { data.resize(0); }
-
-  [[nodiscard]] uint32_t Capacity() const final { return data.capacity(); }
-  uint8_t* Data() final { return data.data(); }
-  void SetSize(uint32_t size) final { data.resize(size); }
-  [[nodiscard]] uint32_t Size() const final { return data.capacity(); }
-};
-
-struct BasicDecryptedBlock final : DecryptedBlock {
-  Buffer* buffer;
-  int64_t timestamp;
-
-  ~BasicDecryptedBlock() final {
-    if (buffer) {
-      buffer->Destroy();
-    }
-  }
-
-  void SetDecryptedBuffer(Buffer* buffer) final { this->buffer = buffer; }
-  Buffer* DecryptedBuffer() final { return buffer; }
-
-  void SetTimestamp(int64_t timestamp) final { this->timestamp = timestamp; }
-  [[nodiscard]] int64_t Timestamp() const final { return timestamp; }
-
-  [[nodiscard]] uint32_t size() const { return buffer ? buffer->Size() : 0; }
-  [[nodiscard]] const uint8_t* data() const {
-    return buffer ? buffer->Data() : nullptr;
+static size_t buffer_pool_high_water_mark() {
+  const gchar *value = g_getenv("WIDEVINE_CDM_BUFFER_POOL_MAX_BYTES");
+  guint64 bytes;
+  if (value && g_ascii_string_to_unsigned(value, 10, 0, G_MAXSIZE, &bytes, nullptr)) {
+    return bytes;
   }
-};
-
-struct Host;
-
-struct SetTimerContext {
-  Host* host;
-  void* call_context;
-};
-
-struct RejectedPromise {
-  uint32_t id;
-  Exception exception;
-  uint32_t system_code;
-  string message;
-
-  OpenCDMError openCdmError() {
-    switch (exception) {
-      case Exception::kExceptionInvalidStateError:
-      case Exception::kExceptionNotSupportedError:
-      case Exception::kExceptionQuotaExceededError:
-      case Exception::kExceptionTypeError:
-        return ERROR_FAIL;
-      default:
-        return ERROR_UNKNOWN;
-    }
-  }
-};
-
-struct UpdateSessionResponse : variant<monostate, RejectedPromise> {
-  bool isOk() {
-    return std::get_if<monostate>(this);
-  }
-  optional<RejectedPromise> error() {
-    if (std::holds_alternative<RejectedPromise>(*this)) {
-      return std::get<RejectedPromise>(*this);
-    } else {
-      return nullopt;
-    }
-  }
-};
-
-struct LoadSessionResponse : variant<monostate, RejectedPromise> {
-  bool isOk() {
-    return std::get_if<monostate>(this);
-  }
-  optional<RejectedPromise> error() {
-    if (std::holds_alternative<RejectedPromise>(*this)) {
-      return std::get<RejectedPromise>(*this);
-    } else {
-      return nullopt;
-    }
-  }
-};
-
-struct RemoveSessionResponse : variant<monostate, RejectedPromise> {
-  bool isOk() {
-    return std::get_if<monostate>(this);
-  }
-  optional<RejectedPromise> error() {
-    if (std::holds_alternative<RejectedPromise>(*this)) {
-      return std::get<RejectedPromise>(*this);
-    } else {
-      return nullopt;
-    }
-  }
-};
+  return BufferPool::kDefaultHighWaterMark;
+}
 
-struct CloseSessionResponse : variant<monostate, RejectedPromise> {
-  bool isOk() {
-    return std::get_if<monostate>(this);
-  }
-  optional<RejectedPromise> error() {
-    if (std::holds_alternative<RejectedPromise>(*this)) {
-      return std::get<RejectedPromise>(*this);
-    } else {
-      return nullopt;
-    }
-  }
-};
+static bool eager_init_enabled() {
+  const gchar *value = g_getenv("WIDEVINE_CDM_EAGER_INIT");
+  return value && g_strcmp0(value, "0") != 0;
+}
 
-struct CreateSessionRequest {
-  cdm::SessionType sessionType;
-  OpenCDMSessionCallbacks* callbacks;
-  void* userData;
-};
+static bool decrypt_in_place_enabled() {
+  const gchar *value = g_getenv("WIDEVINE_CDM_DECRYPT_IN_PLACE");
+  return value && g_strcmp0(value, "0") != 0;
+}
 
-struct CreateSessionResponse : variant<shared_ptr<OpenCDMSession>, RejectedPromise> {
-  optional<shared_ptr<OpenCDMSession>> session() {
-    if (std::holds_alternative<shared_ptr<OpenCDMSession>>(*this)) {
-      return std::get<shared_ptr<OpenCDMSession>>(*this);
-    } else {
-      return nullopt;
-    }
+static optional<unsigned> executor_cpu() {
+  const gchar *value = g_getenv("WIDEVINE_CDM_EXECUTOR_CPU");
+  guint64 cpu;
+  if (value && g_ascii_string_to_unsigned(value, 10, 0, G_MAXUINT32, &cpu, nullptr)) {
+    return cpu;
   }
-  optional<RejectedPromise> error() {
-    if (std::holds_alternative<RejectedPromise>(*this)) {
-      return std::get<RejectedPromise>(*this);
-    } else {
-      return nullopt;
-    }
-  }
-};
-
-struct SetServerCertificateRequest {
-  span<const uint8_t> certificate;
-};
+  return nullopt;
+}
 
-struct SetServerCertificateResponse : variant<monostate, RejectedPromise> {
-  optional<RejectedPromise> error() {
-    if (std::holds_alternative<RejectedPromise>(*this)) {
-      return std::get<RejectedPromise>(*this);
-    } else {
-      return nullopt;
-    }
-  }
-};
+// Lock free, so that a child forked while another thread was drawing an id
+// still has a usable counter.
+static_assert(atomic_uint32_t::is_always_lock_free);
+static atomic_uint32_t nextPromiseId_ = 0;
+// Systems that have not been destroyed, pooled ones included. A zygote must
+// not have any, as their executor threads would not survive fork().
+static std::atomic<size_t> live_systems = 0;
+uint32_t nextPromiseId() {
+  return nextPromiseId_.fetch_add(1);
+}
 
 struct Host final : Host_10 {
-  GstClock *clock;
   OpenCDMSystem *system;
   promise<bool> cdmInitialized;
   shared_future<bool> cdmInitializedFuture;
-  unordered_map<uint32_t, CreateSessionRequest> create_session_requests;
-
-  unordered_map<uint32_t, unique_ptr<promise<SetServerCertificateResponse>>> set_server_certificate_promises;
-  unordered_map<uint32_t, unique_ptr<promise<CreateSessionResponse>>> create_session_promises;
-  unordered_map<uint32_t, unique_ptr<promise<LoadSessionResponse>>> load_session_promises;
-  unordered_map<uint32_t, unique_ptr<promise<UpdateSessionResponse>>> update_session_promises;
-  unordered_map<uint32_t, unique_ptr<promise<RemoveSessionResponse>>> remove_session_promises;
-  unordered_map<uint32_t, unique_ptr<promise<CloseSessionResponse>>> close_session_promises;
+  // Only touched on the executor thread.
+  bool initializeRequested = false;
+  vector<function<void(bool)>> initializeWaiters;
+  gint64 initializeStarted = 0;
+  // How long the CDM took to initialize, and how long session construction
+  // spent waiting for it.
+  atomic<gint64> initializeUs = 0;
+  atomic<gint64> initializeWaitUs = 0;
+  PromiseRegistry promises;
 
   unordered_map<string, shared_ptr<OpenCDMSession>> sessions;
 
-  Host(OpenCDMSystem* system) : clock(gst_system_clock_obtain())
-                              , system(system)
-                              , cdmInitializedFuture(shared_future(cdmInitialized.get_future()))
-  { }
+  BufferPool bufferPool;
 
-  Buffer* Allocate(uint32_t capacity) final {
-    return new VecBuffer(capacity);
-  }
+  // Shared with the files the CDM has open.
+  shared_ptr<FileIOSink> fileSink = std::make_shared<FileIOSink>();
 
-  void SetTimer(int64_t delay_ms, void* context) final {
-    auto delay_ns = delay_ms * 1000 * 1000;
-    auto deadline = gst_clock_get_time(clock) + delay_ns;
-    auto id = gst_clock_new_single_shot_id(clock, deadline);
-    auto set_timer_context = new SetTimerContext { this, context };
-    auto cb = [] (GstClock* clock, GstClockTime time, GstClockID id, void* user_data) -> gboolean {
-      UNUSED(clock);
-      UNUSED(time);
-      auto ctx = (SetTimerContext *) user_data;
-      gst_clock_id_unref(id);
-      ctx->host->system->cdm->TimerExpired(ctx->call_context);
-      delete ctx;
-      return false;
-    };
-    gst_clock_id_wait_async(id, cb, set_timer_context, nullptr);
-  }
+  // Provisioning of the device through this system. Cache hits are counted
+  // on the storage thread, which may outlive the host.
+  atomic<gint64> provisioningUs = 0;
+  atomic<uint64_t> provisioningRequests = 0;
+  shared_ptr<atomic<uint64_t>> provisioningCacheHits =
+      std::make_shared<atomic<uint64_t>>(0);
 
-  Time GetCurrentWallTime() final {
-    return ((double) g_get_real_time()) / G_USEC_PER_SEC;
-  }
+  const RenewalPolicy renewalPolicy = RenewalPolicy::fromEnvironment();
+  RenewalStats renewalStats;
 
-  future<CreateSessionResponse> registerPromiseCreateSession(
-      uint32_t id,
-      CreateSessionRequest request
-  ) {
-    create_session_requests[id] = std::move(request);
-    auto promise = std::make_unique<std::promise<CreateSessionResponse>>();
-    auto future = promise->get_future();
-    create_session_promises[id] = std::move(promise);
-    return future;
+  Host(OpenCDMSystem* system) : system(system)
+                              , cdmInitializedFuture(shared_future(cdmInitialized.get_future()))
+                              , bufferPool(buffer_pool_high_water_mark())
+  {
+    fileSink->executor = &system->executor;
   }
 
-  future<UpdateSessionResponse> registerPromiseUpdateSession(uint32_t id) {
-    auto promise = std::make_unique<std::promise<UpdateSessionResponse>>();
-    auto future = promise->get_future();
-    update_session_promises[id] = std::move(promise);
-    return future;
+  Buffer* Allocate(uint32_t capacity) final {
+    if (auto destination = claimDecryptDestination(capacity)) {
+      return destination;
+    }
+    return bufferPool.acquire(capacity);
   }
 
-  future<RemoveSessionResponse> registerPromiseRemoveSession(uint32_t id) {
-    auto promise = std::make_unique<std::promise<RemoveSessionResponse>>();
-    auto future = promise->get_future();
-    remove_session_promises[id] = std::move(promise);
-    return future;
+  void SetTimer(int64_t delay_ms, void* context) final {
+    TimerWheel::shared().schedule(system, delay_ms, [system = system, context] {
+      system->executor.post(CdmWork::Housekeeping, [system, context] {
+        // The timer may have gone off just as the system was torn down.
+        if (system->cdm) {
+          system->cdm->TimerExpired(context);
+        }
+      });
+    });
   }
 
-  future<CloseSessionResponse> registerPromiseCloseSession(uint32_t id) {
-    auto promise = std::make_unique<std::promise<CloseSessionResponse>>();
-    auto future = promise->get_future();
-    close_session_promises[id] = std::move(promise);
-    return future;
+  Time GetCurrentWallTime() final {
+    return ((double) g_get_real_time()) / G_USEC_PER_SEC;
   }
 
-  future<SetServerCertificateResponse> registerPromiseSetServerCertificate(
-      uint32_t id
-  ) {
-    auto promise = std::make_unique<std::promise<SetServerCertificateResponse>>();
-    auto future = promise->get_future();
-    set_server_certificate_promises[id] = std::move(promise);
-    return future;
+  void OnInitialized(bool success) final {
+    initializeUs = g_get_monotonic_time() - initializeStarted;
+    LOG("%p: initialized in %" G_GINT64_FORMAT " us", system, initializeUs.load());
+    settleInitialization(success);
   }
 
-  void OnInitialized(bool success) final {
+  void settleInitialization(bool success) {
     cdmInitialized.set_value(success);
+    auto waiters = std::move(initializeWaiters);
+    for (auto& waiter : waiters) {
+      waiter(success);
+    }
   }
 
   void OnResolveKeyStatusPromise(
@@ -533,48 +516,63 @@ struct Host final : Host_10 {
       uint32_t session_id_size
   ) final {
     string sessionId(session_id, session_id_size);
-    auto request = std::move(create_session_requests[promise_id]);
-    auto promise = std::move(create_session_promises[promise_id]);
+    auto slot = promises.take(promise_id);
+    // Loading a session resolves with the id of the session found, if any.
+    auto loading = slot
+        ? std::get_if<Completion<LoadSessionResponse>>(&slot.value())
+        : nullptr;
+    if (loading) {
+      LOG("%u: loaded id=%s", promise_id, sessionId.c_str());
+      if (sessionId.empty()) {
+        (*loading)({ RejectedPromise {
+          promise_id,
+          Exception::kExceptionInvalidStateError,
+          0,
+          "session not found",
+        } });
+      } else {
+        (*loading)({});
+      }
+      return;
+    }
+    auto pending = slot ? std::get_if<CreateSessionSlot>(&slot.value()) : nullptr;
+    if (!pending) {
+      LOG("%u: id=%s no promise was registered", promise_id, sessionId.c_str());
+      return;
+    }
     auto newSession = std::make_shared<OpenCDMSession>(
         sessionId,
-        request.sessionType,
+        pending->request.sessionType,
         system,
-        request.callbacks,
-        request.userData
+        pending->request.callbacks,
+        pending->request.userData
     );
     sessions[sessionId] = newSession;
-    if (promise) {
-      CreateSessionResponse response = { newSession };
-      promise->set_value(response);
-      LOG("%u: resolved", promise_id);
-    } else {
-      LOG("%u: id=%s no promise was registered", promise_id, sessionId.c_str());
-    }
+    pending->complete({ newSession });
+    LOG("%u: resolved", promise_id);
   }
 
   void OnResolvePromise(uint32_t promise_id) final {
     LOG("%u", promise_id);
-    if (create_session_promises.contains(promise_id)) {
-      auto promise = std::move(create_session_promises[promise_id]);
-      promise->set_value({});
-    } else if (set_server_certificate_promises.contains(promise_id)) {
-      auto promise = std::move(set_server_certificate_promises[promise_id]);
-      promise->set_value({});
-    } else if (load_session_promises.contains(promise_id)) {
-      auto promise = std::move(load_session_promises[promise_id]);
-      promise->set_value({});
-    } else if (update_session_promises.contains(promise_id)) {
-      auto promise = std::move(update_session_promises[promise_id]);
-      promise->set_value({});
-    } else if (remove_session_promises.contains(promise_id)) {
-      auto promise = std::move(remove_session_promises[promise_id]);
-      promise->set_value({});
-    } else if (close_session_promises.contains(promise_id)) {
-      auto promise = std::move(close_session_promises[promise_id]);
-      promise->set_value({});
-    } else {
+    auto slot = promises.take(promise_id);
+    if (!slot) {
       LOG("%u: no matching promise found", promise_id);
+      return;
     }
+    std::visit([&](auto& pending) {
+      using Slot = std::decay_t<decltype(pending)>;
+      if constexpr (std::is_same_v<Slot, CreateSessionSlot>) {
+        // A session was promised but the CDM did not name one.
+        pending.complete({ RejectedPromise {
+          promise_id,
+          Exception::kExceptionInvalidStateError,
+          0,
+          "no session id",
+        } });
+      } else {
+        pending({});
+      }
+    }, slot.value());
   }
 
   void OnRejectPromise(
@@ -621,27 +619,12 @@ struct Host final : Host_10 {
       system_code,
       message,
     };
-    if (create_session_promises.contains(promise_id)) {
-      auto promise = std::move(create_session_promises[promise_id]);
-      promise->set_value({rejection});
-    } else if (set_server_certificate_promises.contains(promise_id)) {
-      auto promise = std::move(set_server_certificate_promises[promise_id]);
-      promise->set_value({rejection});
-    } else if (load_session_promises.contains(promise_id)) {
-      auto promise = std::move(load_session_promises[promise_id]);
-      promise->set_value({rejection});
-    } else if (update_session_promises.contains(promise_id)) {
-      auto promise = std::move(update_session_promises[promise_id]);
-      promise->set_value({rejection});
-    } else if (remove_session_promises.contains(promise_id)) {
-      auto promise = std::move(remove_session_promises[promise_id]);
-      promise->set_value({rejection});
-    } else if (close_session_promises.contains(promise_id)) {
-      auto promise = std::move(close_session_promises[promise_id]);
-      promise->set_value({rejection});
-    } else {
+    auto slot = promises.take(promise_id);
+    if (!slot) {
       LOG("%u: no matching promise found", promise_id);
+      return;
     }
+    rejectSlot(slot.value(), rejection);
   }
 
   void OnSessionMessage(
@@ -661,6 +644,7 @@ struct Host final : Host_10 {
     switch (message_type) {
       case MessageType::kIndividualizationRequest:
         LOG("%s: kIndividualizationRequest", sessionId.c_str());
+        provisioningRequests++;
         if (haveSession) {
           auto session = sessions[sessionId];
           session->individualizationRequestCallback(messageData);
@@ -670,6 +654,9 @@ struct Host final : Host_10 {
         LOG("%s: kLicenseRequest", sessionId.c_str());
         if (haveSession) {
           auto session = sessions[sessionId];
+          if (!session->individualizationStarted) {
+            countProvisioningCacheHit();
+          }
           session->licenseRequestCallback(messageData);
         }
         break;
@@ -714,12 +701,66 @@ struct Host final : Host_10 {
       Time new_expiry_time
   ) final {
     string sessionId(session_id, session_id_size);
-    if (sessions.contains(sessionId))  {
-      auto session = sessions[sessionId];
-      session->expiration = new_expiry_time;
-    } else {
+    if (!sessions.contains(sessionId)) {
       LOG("%s: session not found", sessionId.c_str());
+      return;
     }
+    auto session = sessions[sessionId];
+    auto previous = session->expiration;
+    session->expiration = new_expiry_time;
+    // NaN stands for no expiration as well.
+    bool expires = new_expiry_time > 0;
+    if (previous > 0 && (!expires || new_expiry_time > previous)) {
+      auto marginMs = int64_t((previous - GetCurrentWallTime()) * 1000);
+      LOG("%s: renewed %" G_GINT64_FORMAT " ms before expiring",
+          sessionId.c_str(), marginMs);
+      renewalStats.renewed(marginMs);
+    }
+    if (expires) {
+      scheduleRenewal(sessionId, new_expiry_time);
+    }
+  }
+
+  // Signals the renewal of the license of |sessionId| ahead of |expiry|, and
+  // counts the license expired if it is still due by then. The timers are
+  // not cancelled when the expiration changes again; they find it changed
+  // and do nothing.
+  void scheduleRenewal(const string& sessionId, Time expiry) {
+    auto expiryMs = int64_t(expiry * 1000);
+    auto nowMs = g_get_real_time() / 1000;
+    auto delayMs = renewalPolicy.delayMs(expiryMs, nowMs, g_random_double());
+    LOG("%s: renewal due in %" G_GINT64_FORMAT " ms", sessionId.c_str(), delayMs);
+    auto onExecutor = [system = system, sessionId, expiry](auto work) {
+      return [system, sessionId, expiry, work] {
+        system->executor.post(CdmWork::Housekeeping, [system, sessionId, expiry, work] {
+          auto& sessions = system->host->sessions;
+          auto found = sessions.find(sessionId);
+          if (system->cdm && found != sessions.end()
+              && found->second->expiration == expiry) {
+            work(*system, *found->second);
+          }
+        });
+      };
+    };
+    TimerWheel::shared().schedule(system, delayMs, onExecutor(
+        [](OpenCDMSystem& system, OpenCDMSession& session) {
+          LOG("%s: renewal due", session.id.c_str());
+          if (system.renewalCallback) {
+            system.host->renewalStats.signalled++;
+            system.renewalCallback(
+                &session,
+                system.renewalUserData,
+                int64_t(session.expiration * 1000)
+            );
+          }
+        }
+    ));
+    TimerWheel::shared().schedule(system, expiryMs - nowMs, onExecutor(
+        [](OpenCDMSystem& system, OpenCDMSession& session) {
+          GST_WARNING("%s: license expired", session.id.c_str());
+          system.host->renewalStats.expired++;
+        }
+    ));
   }
 
   void OnSessionClosed(const char* session_id, uint32_t session_id_size) final {
@@ -735,16 +776,49 @@ struct Host final : Host_10 {
       uint32_t challenge_size
   ) final {
     string serviceId(service_id, service_id_size);
-    string challengeData(challenge, challenge_size);
     LOG("%s", serviceId.c_str());
+    // There is no platform to verify; an empty response tells the CDM so
+    // rather than leaving it waiting.
+    system->executor.post(CdmWork::Housekeeping, [system = system] {
+      if (system->cdm) {
+        system->cdm->OnPlatformChallengeResponse({});
+      }
+    });
+  }
+
+  // A session that asked for no provisioning may owe that to an earlier run
+  // having stored it, which only the storage thread can tell.
+  void countProvisioningCacheHit() {
+    FileStorage::shared().post([hits = provisioningCacheHits] {
+      if (FileStorage::shared().provisioned()) {
+        (*hits)++;
+      }
+    });
+  }
+
+  // The CDM accepted the provisioning response of |session|.
+  void onProvisioned(OpenCDMSession& session) {
+    session.individualized = true;
+    provisioningUs = g_get_monotonic_time() - session.individualizationStarted;
+    GST_INFO("%p: provisioned in %" G_GINT64_FORMAT " us", system,
+        provisioningUs.load());
+    FileStorage::shared().post([durationUs = provisioningUs.load()] {
+      FileStorage::shared().markProvisioned(durationUs);
+    });
   }
 
   void EnableOutputProtection(uint32_t desired_protection_mask) final {
     LOG("%u", desired_protection_mask);
   }
 
+  // Answered from a separate task rather than from within the CDM call that
+  // asked, which the CDM does not expect to be re-entered.
   void QueryOutputProtectionStatus() final {
-    system->cdm->OnQueryOutputProtectionStatus(cdm::QueryResult::kQuerySucceeded, 0, 0);
+    system->executor.post(CdmWork::Housekeeping, [system = system] {
+      if (system->cdm) {
+        system->cdm->OnQueryOutputProtectionStatus(cdm::QueryResult::kQuerySucceeded, 0, 0);
+      }
+    });
   }
 
   void OnDeferredInitializationDone(StreamType stream_type, Status decoder_status) final {
@@ -753,13 +827,24 @@ struct Host final : Host_10 {
 
   FileIO* CreateFileIO(FileIOClient* client) final {
     LOG("%p", client);
-    return nullptr;
+    return new CdmFileIO(client, fileSink);
   }
 
+  // The ID is derived once per process and then handed over right away; it
+  // is still delivered from a separate task, as the CDM does not expect to
+  // be re-entered.
   void RequestStorageId(uint32_t version) final {
     LOG("%u", version);
-    string id("test");
-    system->cdm->OnStorageId(version, (uint8_t *) id.c_str(), id.length());
+    const vector<uint8_t>* id = nullptr;
+    if (version == 0 || version == kStorageIdVersion) {
+      id = &FileStorage::shared().storageId();
+      version = kStorageIdVersion;
+    }
+    system->executor.post(CdmWork::Housekeeping, [system = system, version, id] {
+      if (system->cdm) {
+        system->cdm->OnStorageId(version, id ? id->data() : nullptr, id ? id->size() : 0);
+      }
+    });
   }
 };
 
@@ -774,20 +859,133 @@ static void* get_host_func(int cdm_interface_version, void* user_data) {
   }
 }
 
-OpenCDMSystem::OpenCDMSystem(string keySystem) {
+OpenCDMSystem::OpenCDMSystem(string keySystem)
+  : keySystem(keySystem)
+  , decryptInPlace(decrypt_in_place_enabled())
+  , executor(executor_cpu()) {
+  live_systems++;
   host = std::make_shared<Host>(this);
-  create_cdm_instance(
-      mod,
-      cdm,
-      keySystem,
-      get_host_func,
-      this
-  );
+  module = acquire_module();
+  auto create = [this, keySystem] {
+    cdm = module->createInstance(keySystem, get_host_func, this);
+    if (!cdm) {
+      LOG("%p: could not create a CDM for %s", this, keySystem.c_str());
+    }
+  };
+  // Eagerly, the instance is created and initialized in the background, and
+  // only the first call that needs it waits for whatever is left.
+  if (eager_init_enabled()) {
+    executor.post(CdmWork::Housekeeping, [this, create] {
+      create();
+      requestInitialization();
+    });
+  } else {
+    executor.call(CdmWork::Housekeeping, create);
+  }
 }
 
+// Closing lets the CDM release per-session state; the promises are not
+// registered since nobody is left to wait for them.
+void OpenCDMSystem::closeCdmSessions() {
+  for (const auto& [id, session] : sessions) {
+    cdm->CloseSession(nextPromiseId(), id.data(), id.length());
+  }
+  host->sessions.clear();
+}
+
+// Only the future is consulted, as eager initialization may still be setting
+// |cdm| on the executor. It only ever holds true once there is a CDM.
+bool OpenCDMSystem::recyclable() {
+  auto initialized = host->cdmInitializedFuture;
+  return initialized.wait_for(std::chrono::seconds(0)) == std::future_status::ready
+      && initialized.get();
+}
+
+void OpenCDMSystem::reset() {
+  size_t sessionCount = 0;
+  size_t promises = 0;
+  executor.call(CdmWork::Housekeeping, [this, &sessionCount, &promises] {
+    sessionCount = sessions.size();
+    closeCdmSessions();
+    individualizationCallback = nullptr;
+    individualizationUserData = nullptr;
+    renewalCallback = nullptr;
+    renewalUserData = nullptr;
+    // Before the sessions go, as the completions may still use them.
+    promises = host->promises.rejectAll(
+        Exception::kExceptionInvalidStateError,
+        "system destroyed"
+    );
+    sessions.clear();
+    // What the previous owner's sessions and decrypts went through. How long
+    // the CDM took to initialize describes the CDM itself and is kept.
+    host->initializeWaitUs = 0;
+    host->provisioningUs = 0;
+    host->provisioningRequests = 0;
+    *host->provisioningCacheHits = 0;
+    host->renewalStats.reset();
+    host->bufferPool.resetStats();
+    executor.resetStats();
+  });
+  sessionsByKeyId.update([](auto& index) { index.clear(); });
+  LOG("%p: rejected %zu promises, closed %zu sessions",
+      this, promises, sessionCount);
+}
+
+void OpenCDMSystem::requestInitialization() {
+  if (host->initializeRequested) {
+    return;
+  }
+  host->initializeRequested = true;
+  if (!cdm) {
+    host->settleInitialization(false);
+    return;
+  }
+  LOG("%p: initializing cdm", cdm);
+  host->initializeStarted = g_get_monotonic_time();
+  cdm->Initialize(false, false, false);
+}
+
+void OpenCDMSystem::whenInitialized(function<void(bool)> work) {
+  executor.post(CdmWork::Housekeeping, [this, work = std::move(work)] {
+    auto initialized = host->cdmInitializedFuture;
+    if (initialized.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+      work(initialized.get());
+      return;
+    }
+    host->initializeWaiters.push_back(std::move(work));
+    requestInitialization();
+  });
+}
+
+// Tears everything down in a fixed number of steps, however many timers,
+// promises and sessions are outstanding: nothing waits on the CDM to confirm
+// anything individually.
 OpenCDMSystem::~OpenCDMSystem() {
-  cdm->Destroy();
-  cdm = nullptr;
+  size_t sessionCount = 0;
+  executor.call(CdmWork::Housekeeping, [this, &sessionCount] {
+    sessionCount = sessions.size();
+    if (!cdm) {
+      return;
+    }
+    closeCdmSessions();
+    cdm->Destroy();
+    cdm = nullptr;
+    // File operations still in flight have nobody to report to any more.
+    std::lock_guard guard(host->fileSink->lock);
+    host->fileSink->executor = nullptr;
+  });
+  // Only now that the CDM cannot arm any more. Tasks for timers that went off
+  // in the meantime find |cdm| cleared; later ones are dropped with the
+  // executor.
+  auto timers = TimerWheel::shared().cancel(this);
+  auto promises = host->promises.rejectAll(
+      Exception::kExceptionInvalidStateError,
+      "system destroyed"
+  );
+  LOG("%p: cancelled %zu timers, rejected %zu promises, closed %zu sessions",
+      this, timers, promises, sessionCount);
+  live_systems--;
 }
 
 static SessionType sessionTypeFromLicenseType(LicenseType licenseType) {
@@ -818,6 +1016,25 @@ bool initDataTypeFromString(const string& value, InitDataType& type) {
   return false;
 }
 
+// Starts an asynchronous operation and blocks until it reports back. From a
+// callback, i.e. on the executor, the CDM would only get to the operation once
+// the callback returned, so there is no outcome to wait for: the operation is
+// not started and fails, and |async| names the call to use there instead.
+static OpenCDMError waitFor(
+    CdmExecutor& executor,
+    const char* async,
+    function<void(OperationCallback)> start
+) {
+  if (executor.onExecutorThread()) {
+    GST_WARNING("cannot wait for the cdm from a callback, use %s", async);
+    return ERROR_FAIL;
+  }
+  promise<OpenCDMError> result;
+  auto future = result.get_future();
+  start([&result](OpenCDMError error) { result.set_value(error); });
+  return future.get();
+}
+
 OpenCDMError OpenCDMSystem::constructSession(
     LicenseType licenseType,
     const string& initDataTypeName,
@@ -825,20 +1042,40 @@ OpenCDMError OpenCDMSystem::constructSession(
     OpenCDMSessionCallbacks* callbacks,
     void* userData,
     OpenCDMSession*& session
+) {
+  OpenCDMSession* newSession = nullptr;
+  auto error = waitFor(executor, "opencdm_widevine_construct_session_async",
+      [&](OperationCallback done) {
+        constructSessionAsync(
+            licenseType,
+            initDataTypeName,
+            initData,
+            callbacks,
+            userData,
+            [&newSession, done](OpenCDMError error, OpenCDMSession* created) {
+              newSession = created;
+              done(error);
+            }
+        );
+      });
+  if (error == ERROR_NONE) {
+    session = newSession;
+  }
+  return error;
+}
+
+void OpenCDMSystem::constructSessionAsync(
+    LicenseType licenseType,
+    const string& initDataTypeName,
+    span<const uint8_t> initData,
+    OpenCDMSessionCallbacks* callbacks,
+    void* userData,
+    SessionCallback done
 ) {
   InitDataType initDataType;
   if (!initDataTypeFromString(initDataTypeName, initDataType)) {
-    return ERROR_INVALID_ARG;
-  }
-
-  auto initialized = host->cdmInitializedFuture;
-  if (initialized.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
-    LOG("%p: initializing cdm", cdm);
-    cdm->Initialize(false, false, false);
-  }
-  if (!initialized.get()) {
-    LOG("%p: CDM failed to initialize", cdm);
-    return ERROR_FAIL;
+    done(ERROR_INVALID_ARG, nullptr);
+    return;
   }
 
   auto promiseId = nextPromiseId();
@@ -848,279 +1085,381 @@ OpenCDMError OpenCDMSystem::constructSession(
     callbacks,
     userData,
   };
-  auto future = host->registerPromiseCreateSession(promiseId, request);
-  cdm->CreateSessionAndGenerateRequest(
+  host->promises.add(promiseId, CreateSessionSlot {
+    request,
+    [this, done](CreateSessionResponse response) {
+      auto error = response.error();
+      if (error) {
+        done(error->openCdmError(), nullptr);
+        return;
+      }
+      auto newSession = response.session().value();
+      sessions[newSession->id] = newSession;
+      done(ERROR_NONE, newSession.get());
+    },
+  });
+  // Queued behind initialization rather than waited for, which may take the
+  // CDM a while if it has to read its files first.
+  gint64 waitStarted = 0;
+  auto initialized = host->cdmInitializedFuture;
+  if (initialized.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+    waitStarted = g_get_monotonic_time();
+  }
+  whenInitialized([
+      this,
       promiseId,
       sessionType,
       initDataType,
-      initData.data(),
-      initData.size()
-  );
-  auto response = future.get();
-  auto error = response.error();
-  if (error) {
-    return error->openCdmError();
-  }
-  auto newSession = response.session().value();
-  sessions[newSession->id] = newSession;
-  session = newSession.get();
-  return ERROR_NONE;
+      initData = vector<uint8_t>(initData.begin(), initData.end()),
+      waitStarted
+  ](bool success) {
+    if (waitStarted) {
+      host->initializeWaitUs += g_get_monotonic_time() - waitStarted;
+    }
+    if (!success) {
+      LOG("%p: CDM failed to initialize", this);
+      if (auto slot = host->promises.take(promiseId)) {
+        rejectSlot(slot.value(), {
+          promiseId,
+          Exception::kExceptionInvalidStateError,
+          0,
+          "CDM failed to initialize",
+        });
+      }
+      return;
+    }
+    cdm->CreateSessionAndGenerateRequest(
+        promiseId,
+        sessionType,
+        initDataType,
+        initData.data(),
+        initData.size()
+    );
+  });
 }
 
 OpenCDMError OpenCDMSystem::loadSession(const OpenCDMSession& session) {
+  return waitFor(executor, "opencdm_widevine_session_load_async",
+      [&](OperationCallback done) {
+        loadSessionAsync(session, std::move(done));
+      });
+}
+
+void OpenCDMSystem::loadSessionAsync(
+    const OpenCDMSession& session,
+    OperationCallback done
+) {
   auto promiseId = nextPromiseId();
-  auto future = host->registerPromiseUpdateSession(promiseId);
-  cdm->LoadSession(
+  host->promises.add(promiseId, Completion<LoadSessionResponse>(
+      [done](LoadSessionResponse response) {
+        auto error = response.error();
+        done(error ? error->openCdmError() : ERROR_NONE);
+      }
+  ), &session);
+  executor.post(CdmWork::Housekeeping, [
+      this,
       promiseId,
-      session.sessionType,
-      session.id.data(),
-      session.id.length()
-  );
-  auto response = future.get();
-  auto error = response.error();
-  if (error) {
-    return error->openCdmError();
-  }
-  return ERROR_NONE;
+      sessionType = session.sessionType,
+      id = session.id
+  ] {
+    cdm->LoadSession(promiseId, sessionType, id.data(), id.length());
+  });
 }
 
 OpenCDMError OpenCDMSystem::updateSession(
     OpenCDMSession& session,
     span<const uint8_t> message
+) {
+  return waitFor(executor, "opencdm_widevine_session_update_async",
+      [&](OperationCallback done) {
+        updateSessionAsync(session, message, std::move(done));
+      });
+}
+
+void OpenCDMSystem::updateSessionAsync(
+    OpenCDMSession& session,
+    span<const uint8_t> message,
+    OperationCallback done
 ) {
   auto promiseId = nextPromiseId();
-  auto future = host->registerPromiseUpdateSession(promiseId);
-  cdm->UpdateSession(
+  host->promises.add(promiseId, Completion<UpdateSessionResponse>(
+      [this, &session, done](UpdateSessionResponse response) {
+        auto error = response.error();
+        if (error) {
+          session.errorCallback(error->message);
+          done(error->openCdmError());
+          return;
+        }
+        if (session.individualizationStarted && !session.individualized) {
+          host->onProvisioned(session);
+        }
+        done(ERROR_NONE);
+      }
+  ), &session);
+  executor.post(CdmWork::Housekeeping, [
+      this,
       promiseId,
-      session.id.data(),
-      session.id.length(),
-      message.data(),
-      message.size()
-  );
-  auto response = future.get();
-  auto error = response.error();
-  if (error) {
-    session.errorCallback(error->message);
-    return error->openCdmError();
-  }
-  return ERROR_NONE;
+      id = session.id,
+      message = vector<uint8_t>(message.begin(), message.end())
+  ] {
+    cdm->UpdateSession(
+        promiseId,
+        id.data(),
+        id.length(),
+        message.data(),
+        message.size()
+    );
+  });
 }
 
 OpenCDMError OpenCDMSystem::removeSession(OpenCDMSession& session) {
+  return waitFor(executor, "opencdm_widevine_session_remove_async",
+      [&](OperationCallback done) {
+        removeSessionAsync(session, std::move(done));
+      });
+}
+
+void OpenCDMSystem::removeSessionAsync(
+    OpenCDMSession& session,
+    OperationCallback done
+) {
   auto promiseId = nextPromiseId();
-  auto future = host->registerPromiseRemoveSession(promiseId);
-  cdm->RemoveSession(promiseId, session.id.data(), session.id.length());
-  auto response = future.get();
-  auto error = response.error();
-  if (error) {
-    session.errorCallback(error->message);
-    return error->openCdmError();
-  }
-  sessions.erase(session.id);
-  return ERROR_NONE;
+  host->promises.add(promiseId, Completion<RemoveSessionResponse>(
+      [this, &session, done](RemoveSessionResponse response) {
+        auto error = response.error();
+        if (error) {
+          session.errorCallback(error->message);
+          done(error->openCdmError());
+          return;
+        }
+        unindexSession(session);
+        done(ERROR_NONE);
+      }
+  ), &session);
+  executor.post(CdmWork::Housekeeping, [this, promiseId, id = session.id] {
+    cdm->RemoveSession(promiseId, id.data(), id.length());
+  });
 }
 
 OpenCDMError OpenCDMSystem::closeSession(OpenCDMSession& session) {
-  auto promiseId = nextPromiseId();
-  auto future = host->registerPromiseCloseSession(promiseId);
-  cdm->CloseSession(promiseId, session.id.data(), session.id.length());
-  auto response = future.get();
-  auto error = response.error();
-  if (error) {
-    session.errorCallback(error->message);
-    return error->openCdmError();
-  }
-  sessions.erase(session.id);
-  return ERROR_NONE;
+  return waitFor(executor, "opencdm_widevine_session_close_async",
+      [&](OperationCallback done) {
+        closeSessionAsync(session, std::move(done));
+      });
 }
 
-OpenCDMError OpenCDMSystem::setServerCertificate(
-    span<const uint8_t> certificate
+void OpenCDMSystem::closeSessionAsync(
+    OpenCDMSession& session,
+    OperationCallback done
 ) {
   auto promiseId = nextPromiseId();
-  auto future = host->registerPromiseSetServerCertificate(promiseId);
-  cdm->SetServerCertificate(promiseId, certificate.data(), certificate.size());
-  auto response = future.get();
-  auto error = response.error();
-  if (error) {
-    return error->openCdmError();
-  }
-  return ERROR_NONE;
+  host->promises.add(promiseId, Completion<CloseSessionResponse>(
+      [this, &session, done](CloseSessionResponse response) {
+        auto error = response.error();
+        if (error) {
+          session.errorCallback(error->message);
+          done(error->openCdmError());
+          return;
+        }
+        unindexSession(session);
+        done(ERROR_NONE);
+      }
+  ), &session);
+  executor.post(CdmWork::Housekeeping, [this, promiseId, id = session.id] {
+    cdm->CloseSession(promiseId, id.data(), id.length());
+  });
 }
 
-static OpenCDMError processDecryptionResult(
-    ContentDecryptionModule_10& cdm,
-    span<uint8_t> buffer,
-    cdm::InputBuffer_2 input
+void OpenCDMSystem::indexSessionKeys(
+    OpenCDMSession& session,
+    span<const cdm::KeyInformation> keys,
+    span<const KeyId> dropped
 ) {
-  BasicDecryptedBlock decrypted;
-  auto result = cdm.Decrypt(input, &decrypted);
-  switch (result) {
-    case cdm::kSuccess:
-      memcpy(buffer.data(), decrypted.data(), decrypted.size());
-      return ERROR_NONE;
-    case cdm::kNeedMoreData:
-      return ERROR_MORE_DATA_AVAILBALE;
-    case cdm::kNoKey:
-      return ERROR_INVALID_SESSION;
-    default:
-      return ERROR_FAIL;
-  }
+  if (session.destroyed) {
+    return;
+  }
+  sessionsByKeyId.update([&](auto& index) {
+    for (const auto& keyId : dropped) {
+      auto entry = index.find(keyId);
+      if (entry != index.end() && entry->second == &session) {
+        index.erase(entry);
+      }
+    }
+    for (const auto& key : keys) {
+      auto keyId = KeyId::from(span(key.key_id, key.key_id_size));
+      if (keyId) {
+        index[keyId.value()] = &session;
+      }
+    }
+  });
 }
 
-static OpenCDMError decryptWithoutSubsamples(
-    ContentDecryptionModule_10& cdm,
-    span<uint8_t> buffer,
-    span<uint8_t> iv,
-    span<uint8_t> keyId
-) {
-  cdm::InputBuffer_2 input = {
-    .data = buffer.data(),
-    .data_size = static_cast<uint32_t>(buffer.size()),
-    .encryption_scheme = cdm::EncryptionScheme::kCenc,
-    .key_id = keyId.data(),
-    .key_id_size = static_cast<uint32_t>(keyId.size()),
-    .iv = iv.data(),
-    .iv_size = static_cast<uint32_t>(iv.size()),
-    .subsamples = nullptr,
-    .num_subsamples = 0,
-    .pattern = { 0, 0 },
-    .timestamp = 0,
-  };
-
-  return processDecryptionResult(cdm, buffer, input);
+void OpenCDMSystem::unindexSession(const OpenCDMSession& session) {
+  sessionsByKeyId.update([&](auto& index) {
+    session.keyInfo.read([&](const KeyTable& keys) {
+      keys.forEach([&](const KeyEntry& key) {
+        auto entry = index.find(key.id);
+        if (entry != index.end() && entry->second == &session) {
+          index.erase(entry);
+        }
+      });
+    });
+  });
 }
 
-static optional<cdm::SubsampleEntry> parseSubsample(GstByteReader& reader) {
-  guint16 clear;
-  guint32 cipher;
-  if (!gst_byte_reader_get_uint16_be(&reader, &clear)) {
-    return nullopt;
-  }
-  if (!gst_byte_reader_get_uint32_be(&reader, &cipher)) {
-    return nullopt;
+OpenCDMSession* OpenCDMSystem::findSessionByKeyId(span<const uint8_t> keyId) {
+  auto id = KeyId::from(keyId);
+  if (!id) {
+    return nullptr;
   }
-  return cdm::SubsampleEntry {
-    .clear_bytes = clear,
-    .cipher_bytes = cipher,
-  };
+  return sessionsByKeyId.read([&](const auto& index) -> OpenCDMSession* {
+    auto entry = index.find(id.value());
+    return entry != index.end() ? entry->second : nullptr;
+  });
 }
 
-static optional<vector<cdm::SubsampleEntry>> parseSubsamples(
-    span<const uint8_t> data,
-    size_t subsampleCount
-) {
-  std::vector<cdm::SubsampleEntry> entries;
-  if (subsampleCount < 1) {
-    return nullopt;
-  }
-
-  GstByteReader reader;
-  gst_byte_reader_init(&reader, data.data(), data.size());
-
-  for (auto i = 0U; i < subsampleCount; i++) {
-    auto entry = parseSubsample(reader);
-    if (entry) {
-      entries.push_back(std::move(entry.value()));
-    } else {
-      return nullopt;
+void OpenCDMSystem::destroySession(OpenCDMSession& session) {
+  auto id = session.id;
+  // On the executor, where the CDM settles promises, so that no completion is
+  // still using the session once its slots are gone. The CDM may also still
+  // be reporting the session closed there, or its keys changed, which no
+  // longer index it once it is marked destroyed.
+  executor.call(CdmWork::Housekeeping, [this, &session, &id] {
+    session.destroyed = true;
+    unindexSession(session);
+    auto promises = host->promises.rejectSession(
+        session,
+        Exception::kExceptionInvalidStateError,
+        "session destroyed"
+    );
+    if (promises) {
+      LOG("%p: rejected %zu promises", &session, promises);
     }
-  }
-
-  return entries;
+    host->sessions.erase(id);
+    sessions.erase(id);
+  });
 }
 
-static OpenCDMError decryptSubsample(
-    ContentDecryptionModule_10& cdm,
-    span<uint8_t> buffer,
-    const cdm::SubsampleEntry& subsample,
-    span<uint8_t> iv,
-    span<uint8_t> keyId
+OpenCDMError OpenCDMSystem::setServerCertificate(
+    span<const uint8_t> certificate
 ) {
+  return waitFor(executor, "opencdm_widevine_system_set_server_certificate_async",
+      [&](OperationCallback done) {
+        setServerCertificateAsync(certificate, std::move(done));
+      });
+}
 
-  if (subsample.cipher_bytes < 1) {
-    return ERROR_NONE;
-  }
-
-  auto encryptedBuffer = buffer.subspan(
-      subsample.clear_bytes,
-      subsample.cipher_bytes
-  );
-  cdm::InputBuffer_2 input = {
-    .data = encryptedBuffer.data(),
-    .data_size = static_cast<uint32_t>(encryptedBuffer.size()),
-    .encryption_scheme = cdm::EncryptionScheme::kCenc,
-    .key_id = keyId.data(),
-    .key_id_size = static_cast<uint32_t>(keyId.size()),
-    .iv = iv.data(),
-    .iv_size = static_cast<uint32_t>(iv.size()),
-    .subsamples = nullptr,
-    .num_subsamples = 0,
-    .pattern = { 0, 0 },
-    .timestamp = 0,
-  };
-
-  return processDecryptionResult(cdm, encryptedBuffer, input);
+void OpenCDMSystem::setServerCertificateAsync(
+    span<const uint8_t> certificate,
+    OperationCallback done
+) {
+  auto promiseId = nextPromiseId();
+  host->promises.add(promiseId, Completion<SetServerCertificateResponse>(
+      [done](SetServerCertificateResponse response) {
+        auto error = response.error();
+        done(error ? error->openCdmError() : ERROR_NONE);
+      }
+  ));
+  executor.post(CdmWork::Housekeeping, [
+      this,
+      promiseId,
+      certificate = vector<uint8_t>(certificate.begin(), certificate.end())
+  ] {
+    cdm->SetServerCertificate(promiseId, certificate.data(), certificate.size());
+  });
 }
 
-static OpenCDMError decryptSubsamples(
-    ContentDecryptionModule_10& cdm,
+OpenCDMError OpenCDMSystem::decrypt(
+    OpenCDMSession& session,
     span<uint8_t> buffer,
     span<uint8_t> subsamples,
     const uint32_t subsampleCount,
     span<uint8_t> iv,
     span<uint8_t> keyId
 ) {
-  auto subsampleEntriesResult = parseSubsamples(subsamples, subsampleCount);
-  if (!subsampleEntriesResult) {
-    return ERROR_FAIL;
-  }
-
-  auto subsampleEntries = subsampleEntriesResult.value();
-
-  size_t position = 0;
-  for (auto subsample : subsampleEntries) {
-    auto subsampleSize = subsample.clear_bytes + subsample.cipher_bytes;
-    auto result = decryptSubsample(
-        cdm,
-        buffer.subspan(position, subsampleSize),
-        subsample,
-        iv,
-        keyId
-    );
-    switch (result) {
-      case ERROR_NONE:
-        position += subsampleSize;
-        continue;
-      default:
-        return result;
+  OpenCDMError result = ERROR_FAIL;
+  executor.call(CdmWork::Decrypt, [&] {
+    if (subsampleCount < 1) {
+      result = decryptWithoutSubsamples(
+          *cdm,
+          buffer,
+          iv,
+          keyId,
+          session.decryptCounters,
+          decryptInPlace
+      );
+    } else {
+      result = decryptSubsamples(
+          *cdm,
+          buffer,
+          subsamples,
+          subsampleCount,
+          iv,
+          keyId,
+          session.decryptCounters,
+          decryptInPlace
+      );
     }
-  }
-  return ERROR_NONE;
+  });
+  return result;
 }
 
-OpenCDMError OpenCDMSystem::decrypt(
-    const OpenCDMSession& session,
-    span<uint8_t> buffer,
+OpenCDMError OpenCDMSystem::decryptScattered(
+    OpenCDMSession& session,
+    span<const span<uint8_t>> buffers,
     span<uint8_t> subsamples,
     const uint32_t subsampleCount,
     span<uint8_t> iv,
     span<uint8_t> keyId
 ) {
-  UNUSED(session);
-
-  if (subsampleCount < 1) {
-    return decryptWithoutSubsamples(*cdm, buffer, iv, keyId);
-  } else {
-    return decryptSubsamples(
+  OpenCDMError result = ERROR_FAIL;
+  executor.call(CdmWork::Decrypt, [&] {
+    result = ::decryptScattered(
         *cdm,
-        buffer,
+        buffers,
         subsamples,
         subsampleCount,
         iv,
-        keyId
+        keyId,
+        session.decryptCounters,
+        decryptInPlace
     );
-  }
+  });
+  return result;
+}
+
+void invokeOnContext(GMainContext* context, function<void()> callback) {
+  auto source = g_idle_source_new();
+  g_source_set_priority(source, G_PRIORITY_DEFAULT);
+  g_source_set_callback(
+      source,
+      [](gpointer data) -> gboolean {
+        (*static_cast<function<void()>*>(data))();
+        return G_SOURCE_REMOVE;
+      },
+      new function<void()>(std::move(callback)),
+      [](gpointer data) { delete static_cast<function<void()>*>(data); }
+  );
+  g_source_attach(source, context);
+  g_source_unref(source);
+}
+
+static shared_ptr<GMainContext> completionContext(GMainContext* context) {
+  return shared_ptr<GMainContext>(
+      context ? g_main_context_ref(context) : g_main_context_ref_thread_default(),
+      g_main_context_unref
+  );
+}
+
+OperationCallback completeOn(
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* userData
+) {
+  auto target = completionContext(context);
+  return [target, complete, userData](OpenCDMError error) {
+    invokeOnContext(target.get(), [=]() { complete(error, userData); });
+  };
 }
 
 OpenCDMError opencdm_is_type_supported(
@@ -1136,23 +1475,85 @@ OpenCDMError opencdm_is_type_supported(
   }
 }
 
+// With eager initialization, opencdm_init() starts warming up a Widevine
+// system that the first opencdm_create_system() call then hands out.
+static std::mutex spare_lock;
+static OpenCDMSystem* spare_system = nullptr;
+
 OpenCDMError opencdm_init() {
-  if (do_init_once()) {
-    return ERROR_NONE;
-  } else {
+  if (!do_init_once()) {
     return ERROR_FAIL;
   }
+  if (eager_init_enabled()) {
+    std::lock_guard guard(spare_lock);
+    if (!spare_system) {
+      spare_system = new OpenCDMSystem(widevineId);
+    }
+  }
+  return ERROR_NONE;
+}
+
+OpenCDMError opencdm_widevine_zygote_init() {
+  if (live_systems) {
+    GST_ERROR("a zygote cannot have systems");
+    return ERROR_FAIL;
+  }
+  zygote_mode = true;
+  // Keeps these consistent in the children if another thread holds them
+  // while forking, e.g. after opencdm_init() was called first.
+  static std::once_flag at_fork;
+  std::call_once(at_fork, [] {
+    pthread_atfork(
+        [] { spare_lock.lock(); module_lock.lock(); },
+        [] { module_lock.unlock(); spare_lock.unlock(); },
+        [] { module_lock.unlock(); spare_lock.unlock(); }
+    );
+  });
+  auto started = g_get_monotonic_time();
+  if (!do_init_once()) {
+    return ERROR_FAIL;
+  }
+  GST_INFO("zygote ready in %" G_GINT64_FORMAT " us", g_get_monotonic_time() - started);
+  return ERROR_NONE;
 }
 
 OpenCDMSystem* opencdm_create_system(const char keySystem[]) {
-  if (do_init_once()) {
-    return new OpenCDMSystem(keySystem);
-  } else {
+  if (!do_init_once()) {
     return nullptr;
   }
+  // Widevine may be asked for by its system id too, which is not a key
+  // system the CDM knows and would not match a spare or pooled system.
+  string systemId(keySystem);
+  if (systemId == widevineUUID) {
+    systemId = widevineId;
+  }
+  auto module = acquire_module();
+  if (systemId == widevineId) {
+    OpenCDMSystem* spare;
+    {
+      std::lock_guard guard(spare_lock);
+      spare = std::exchange(spare_system, nullptr);
+    }
+    // Warmed up before a reload, it would keep the replaced module around.
+    if (spare && spare->module == module) {
+      return spare;
+    }
+    delete spare;
+  }
+  if (auto recycled = CdmPool::shared().take(systemId, module.get())) {
+    return recycled;
+  }
+  return new OpenCDMSystem(systemId);
 }
 
 OpenCDMError opencdm_destruct_system(OpenCDMSystem* system) {
+  auto& pool = CdmPool::shared();
+  if (pool.capacity && system->recyclable()) {
+    system->reset();
+    if (pool.give(system)) {
+      return ERROR_NONE;
+    }
+  }
   delete system;
   return ERROR_NONE;
 }
@@ -1162,23 +1563,97 @@ OpenCDMBool opencdm_system_supports_server_certificate(OpenCDMSystem* system) {
   return OPENCDM_BOOL_TRUE;
 }
 
+OpenCDMError opencdm_widevine_system_get_metrics(
+    OpenCDMSystem* system,
+    OpenCDMWidevineSystemMetrics* metrics
+) {
+  if (!system || !metrics) {
+    return ERROR_INVALID_ARG;
+  }
+  auto poolStats = system->host->bufferPool.stats();
+  metrics->buffer_pool_hits = poolStats.hits;
+  metrics->buffer_pool_misses = poolStats.misses;
+  metrics->buffer_pool_retained_bytes = poolStats.retainedBytes;
+  metrics->outstanding_promises = system->host->promises.outstanding();
+  auto executorStats = system->executor.stats();
+  metrics->executor_decrypt_batches = executorStats.decryptBatches;
+  metrics->executor_decrypt_requests = executorStats.decryptRequests;
+  metrics->cdm_initialize_us = system->host->initializeUs;
+  metrics->cdm_initialize_wait_us = system->host->initializeWaitUs;
+  metrics->provisioning_us = system->host->provisioningUs;
+  metrics->provisioning_requests = system->host->provisioningRequests;
+  metrics->provisioning_cache_hits = *system->host->provisioningCacheHits;
+  auto renewalStats = system->host->renewalStats.snapshot();
+  metrics->renewals_signalled = renewalStats.signalled;
+  metrics->renewals = renewalStats.renewed;
+  metrics->licenses_expired = renewalStats.expired;
+  metrics->renewal_margin_min_ms = renewalStats.minMarginMs;
+  metrics->renewal_margin_avg_ms = renewalStats.avgMarginMs;
+  return ERROR_NONE;
+}
+
+const char* opencdm_widevine_system_get_cdm_version(OpenCDMSystem* system) {
+  if (!system || system->module->version.empty()) {
+    return nullptr;
+  }
+  return system->module->version.c_str();
+}
+
+OpenCDMError opencdm_widevine_system_set_individualization_callback(
+    OpenCDMSystem* system,
+    OpenCDMWidevineIndividualizationCallback callback,
+    void* userData
+) {
+  if (!system) {
+    return ERROR_INVALID_ARG;
+  }
+  LOG("%p", system);
+  system->executor.call(CdmWork::Housekeeping, [=] {
+    system->individualizationCallback = callback;
+    system->individualizationUserData = userData;
+  });
+  return ERROR_NONE;
+}
+
+OpenCDMError opencdm_widevine_system_set_renewal_callback(
+    OpenCDMSystem* system,
+    OpenCDMWidevineRenewalCallback callback,
+    void* userData
+) {
+  if (!system) {
+    return ERROR_INVALID_ARG;
+  }
+  LOG("%p", system);
+  system->executor.call(CdmWork::Housekeeping, [=] {
+    system->renewalCallback = callback;
+    system->renewalUserData = userData;
+  });
+  return ERROR_NONE;
+}
+
+OpenCDMError opencdm_widevine_get_cdm_pool_metrics(
+    OpenCDMWidevineCdmPoolMetrics* metrics
+) {
+  if (!metrics) {
+    return ERROR_INVALID_ARG;
+  }
+  auto stats = CdmPool::shared().stats();
+  metrics->hits = stats.hits;
+  metrics->misses = stats.misses;
+  metrics->recycled = stats.recycled;
+  metrics->reaped = stats.reaped;
+  metrics->idle = stats.idle;
+  return ERROR_NONE;
+}
+
 OpenCDMSession* opencdm_get_system_session(
     OpenCDMSystem* system,
     const uint8_t keyId[],
     const uint8_t length,
     const uint32_t waitTime
 ) {
-  UNUSED(keyId);
-  UNUSED(length);
   UNUSED(waitTime);
-  const string key((const char *) keyId, length);
-  for (auto pair : system->sessions) {
-    auto session = pair.second;
-    if (session->hasKey(key)) {
-      return session.get();
-    }
-  }
-  return nullptr;
+  return system->findSessionByKeyId(span(keyId, length));
 }
 
 OpenCDMError opencdm_system_set_server_certificate(
@@ -1219,3 +1694,59 @@ OpenCDMError opencdm_construct_session(
       *session
   );
 }
+
+OpenCDMError opencdm_widevine_system_set_server_certificate_async(
+    OpenCDMSystem* system,
+    const uint8_t serverCertificate[],
+    const uint16_t serverCertificateLength,
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* userData
+) {
+  if (!system || !complete) {
+    return ERROR_INVALID_ARG;
+  }
+  LOG("%p", system);
+  auto certificate = span(
+      serverCertificate,
+      serverCertificate + serverCertificateLength
+  );
+  system->setServerCertificateAsync(
+      certificate,
+      completeOn(context, complete, userData)
+  );
+  return ERROR_NONE;
+}
+
+OpenCDMError opencdm_widevine_construct_session_async(
+    OpenCDMSystem* system,
+    const LicenseType licenseType,
+    const char initDataType[],
+    const uint8_t initData[],
+    const uint16_t initDataLength,
+    OpenCDMSessionCallbacks* callbacks,
+    void* userData,
+    GMainContext* context,
+    OpenCDMWidevineSessionCompletion complete,
+    void* completeData
+) {
+  if (!system || !initDataType || !complete) {
+    return ERROR_INVALID_ARG;
+  }
+  auto target = completionContext(context);
+  string initDataTypeName(initDataType);
+  auto initDataBytes = span(initData, initData + initDataLength);
+  system->constructSessionAsync(
+      licenseType,
+      initDataTypeName,
+      initDataBytes,
+      callbacks,
+      userData,
+      [target, complete, completeData](OpenCDMError error, OpenCDMSession* session) {
+        invokeOnContext(target.get(), [=]() {
+          complete(session, error, completeData);
+        });
+      }
+  );
+  return ERROR_NONE;
+}
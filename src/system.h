@@ -1,6 +1,7 @@
 #pragma once
 
 #include <atomic>
+#include <functional>
 #include <memory>
 #include <span>
 #include <string>
@@ -8,10 +9,16 @@
 
 #include <glib.h>
 #include "open_cdm.h"
+#include "open_cdm_widevine.h"
 #include "content_decryption_module.h"
 
+#include "cdm_executor.h"
+#include "cdm_module.h"
+#include "key_id.h"
 #include "session.h"
+#include "snapshot.h"
 
+using std::function;
 using std::shared_ptr;
 using std::string;
 using std::span;
@@ -21,6 +28,20 @@ using cdm::ContentDecryptionModule_10;
 
 struct Host;
 
+// Receives the outcome of an operation the CDM settles through a promise. It
+// runs exactly once, on whichever thread the CDM settled the promise from.
+using OperationCallback = function<void(OpenCDMError)>;
+using SessionCallback = function<void(OpenCDMError, OpenCDMSession*)>;
+
+// Adapts a public completion so that it is dispatched from |context|, or from
+// the calling thread's default context if null, rather than from the CDM.
+G_GNUC_INTERNAL
+OperationCallback completeOn(
+    GMainContext* context,
+    OpenCDMWidevineCompletion complete,
+    void* userData
+);
+
 struct OpenCDMSystem {
   G_GNUC_INTERNAL
   OpenCDMSystem(string keySystem);
@@ -37,25 +58,55 @@ struct OpenCDMSystem {
       OpenCDMSession*& session
   );
   G_GNUC_INTERNAL
+  void constructSessionAsync(
+      LicenseType licenseType,
+      const string& initDataType,
+      span<const uint8_t> initData,
+      OpenCDMSessionCallbacks* callbacks,
+      void* userData,
+      SessionCallback done
+  );
+  G_GNUC_INTERNAL
   OpenCDMError loadSession(const OpenCDMSession& session);
   G_GNUC_INTERNAL
+  void loadSessionAsync(const OpenCDMSession& session, OperationCallback done);
+  G_GNUC_INTERNAL
   OpenCDMError updateSession(
       OpenCDMSession& session,
       span<const uint8_t> message
   );
   G_GNUC_INTERNAL
+  void updateSessionAsync(
+      OpenCDMSession& session,
+      span<const uint8_t> message,
+      OperationCallback done
+  );
+  G_GNUC_INTERNAL
   OpenCDMError removeSession(OpenCDMSession& session);
   G_GNUC_INTERNAL
+  void removeSessionAsync(OpenCDMSession& session, OperationCallback done);
+  G_GNUC_INTERNAL
   OpenCDMError closeSession(OpenCDMSession& session);
   G_GNUC_INTERNAL
+  void closeSessionAsync(OpenCDMSession& session, OperationCallback done);
+  G_GNUC_INTERNAL
   OpenCDMError decrypt(
-          const OpenCDMSession& session,
+          OpenCDMSession& session,
           span<uint8_t> buffer,
           span<uint8_t> subsamples,
           const uint32_t subsampleCount,
           span<uint8_t> iv,
           span<uint8_t> keyId
   );
+  G_GNUC_INTERNAL
+  OpenCDMError decryptScattered(
+          OpenCDMSession& session,
+          span<const span<uint8_t>> buffers,
+          span<uint8_t> subsamples,
+          const uint32_t subsampleCount,
+          span<uint8_t> iv,
+          span<uint8_t> keyId
+  );
 
   G_GNUC_INTERNAL
   cdm::KeyStatus getSessionKeyStatus(
@@ -65,8 +116,73 @@ struct OpenCDMSystem {
 
   G_GNUC_INTERNAL
   OpenCDMError setServerCertificate(span<const uint8_t> certificate);
+  G_GNUC_INTERNAL
+  void setServerCertificateAsync(
+      span<const uint8_t> certificate,
+      OperationCallback done
+  );
+
+  // On the executor. Indexes |keys| under |session| and unindexes the keys
+  // it |dropped|. A session marked destroyed is not indexed again.
+  G_GNUC_INTERNAL
+  void indexSessionKeys(
+      OpenCDMSession& session,
+      span<const cdm::KeyInformation> keys,
+      span<const KeyId> dropped
+  );
+  G_GNUC_INTERNAL
+  void unindexSession(const OpenCDMSession& session);
+  G_GNUC_INTERNAL
+  OpenCDMSession* findSessionByKeyId(span<const uint8_t> keyId);
+  G_GNUC_INTERNAL
+  void destroySession(OpenCDMSession& session);
+
+  // Starts initializing the CDM unless that has been done already. Runs on
+  // the executor.
+  G_GNUC_INTERNAL
+  void requestInitialization();
+  // Runs |work| on the executor once the CDM is initialized, or has failed
+  // to, starting that if need be. |work| is told which it was.
+  G_GNUC_INTERNAL
+  void whenInitialized(function<void(bool)> work);
+  // Asks the CDM to close every session. Runs on the executor.
+  G_GNUC_INTERNAL
+  void closeCdmSessions();
+
+  // Whether the CDM is initialized and could serve another system after
+  // reset().
+  G_GNUC_INTERNAL
+  bool recyclable();
+  // Drops every session and fails outstanding promises, as destroying the
+  // system would, but keeps the CDM instance (and its timers) alive. The
+  // metrics start over.
+  G_GNUC_INTERNAL
+  void reset();
+
+  const string keySystem;
+  // Whether the CDM decrypts straight into the sample, as set by
+  // WIDEVINE_CDM_DECRYPT_IN_PLACE.
+  const bool decryptInPlace;
 
   shared_ptr<Host> host;
-  ContentDecryptionModule_10* cdm;
+  // Outlives |cdm|, which it created.
+  shared_ptr<CdmModule> module;
+  ContentDecryptionModule_10* cdm = nullptr;
+  // The sessions handed to the application. Only touched on the executor.
   unordered_map<string, shared_ptr<OpenCDMSession>> sessions;
+
+  // Where individualization requests go. Only touched on the executor.
+  OpenCDMWidevineIndividualizationCallback individualizationCallback = nullptr;
+  void* individualizationUserData = nullptr;
+  // Where renewal signals go. Only touched on the executor.
+  OpenCDMWidevineRenewalCallback renewalCallback = nullptr;
+  void* renewalUserData = nullptr;
+
+  // Which session holds a key, so the demuxer can find the session for a
+  // protection event with a single lookup that never blocks.
+  Snapshot<unordered_map<KeyId, OpenCDMSession*, KeyIdHash>> sessionsByKeyId;
+
+  // Every call into |cdm| goes through here. Declared last so that its thread
+  // is joined before anything a late task could touch goes away.
+  CdmExecutor executor;
 };
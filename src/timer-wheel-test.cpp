@@ -0,0 +1,168 @@
+#include <glib.h>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "timer_wheel.h"
+
+using std::atomic;
+using std::vector;
+
+// One tick per millisecond, so that a lap of the wheel takes half a second.
+static const int64_t kSlackMs = 1;
+static const int64_t kLapMs = TimerWheel::kSlots * kSlackMs;
+// How late a timer may fire on a loaded machine.
+static const int64_t kLatenessMs = 250;
+static const gint64 kTimeoutUs = 5 * G_USEC_PER_SEC;
+static const unsigned kRaces = 500;
+
+static void
+wait_until_fired (const atomic<unsigned>& fired, unsigned count)
+{
+  auto deadline = g_get_monotonic_time() + kTimeoutUs;
+  while (fired.load() < count) {
+    g_assert_cmpint(g_get_monotonic_time(), <, deadline);
+    g_usleep(1000);
+  }
+}
+
+// Timers hashed into the same slot one or more laps apart each fire on their
+// own lap, never early, including one too far out for the wheel to see.
+static void
+test_slot_wrap (void)
+{
+  auto& wheel = TimerWheel::shared();
+  const int64_t delaysMs[] = {
+    5, 5 + kLapMs, 5 + 2 * kLapMs, kLapMs - 1, kLapMs, 3 * kLapMs + 100,
+  };
+  const auto count = G_N_ELEMENTS(delaysMs);
+  int owner;
+  atomic<unsigned> fired = 0;
+  vector<atomic<gint64>> firedUs(count);
+
+  auto start = g_get_monotonic_time();
+  for (auto i = 0U; i < count; i++) {
+    wheel.schedule(&owner, delaysMs[i], [&, i] {
+      firedUs[i] = g_get_monotonic_time();
+      fired++;
+    });
+  }
+  wait_until_fired(fired, count);
+
+  for (auto i = 0U; i < count; i++) {
+    auto elapsedMs = (firedUs[i] - start) / 1000;
+    g_print("scheduled in %" G_GINT64_FORMAT " ms, fired after %"
+        G_GINT64_FORMAT " ms\n", delaysMs[i], elapsedMs);
+    g_assert_cmpint(elapsedMs, >=, delaysMs[i]);
+    g_assert_cmpint(elapsedMs, <, delaysMs[i] + kLatenessMs);
+  }
+  g_assert_cmpuint(wheel.cancel(&owner), ==, 0);
+}
+
+// Cancelling a timer that is about to fire either drops it, and then it never
+// runs, or finds it fired; never while it is still running.
+static void
+test_cancel_racing_fire (void)
+{
+  auto& wheel = TimerWheel::shared();
+  g_autoptr(GRand) rand = g_rand_new_with_seed(0x7157);
+  atomic<bool> running = false;
+  atomic<unsigned> fired = 0;
+  unsigned cancelled = 0;
+
+  for (auto i = 0U; i < kRaces; i++) {
+    int owner;
+    wheel.schedule(&owner, g_rand_int_range(rand, 0, 3), [&] {
+      running = true;
+      g_usleep(200);
+      fired++;
+      running = false;
+    });
+    g_usleep(g_rand_int_range(rand, 0, 3000));
+    auto dropped = wheel.cancel(&owner);
+    g_assert_false(running.load());
+    cancelled += dropped;
+    g_assert_cmpuint(fired.load() + cancelled, ==, i + 1);
+  }
+  // Nothing cancelled shows up late.
+  g_usleep(10 * kSlackMs * 1000);
+  g_assert_cmpuint(fired.load() + cancelled, ==, kRaces);
+  g_print("%u timers fired, %u cancelled\n", fired.load(), cancelled);
+  g_assert_cmpuint(fired.load(), >, 0);
+  g_assert_cmpuint(cancelled, >, 0);
+}
+
+// Zero and negative delays are due right away: they fire on the wheel thread
+// at the next tick, rather than inline or after the delay wrapped around.
+static void
+test_clamped_delays (void)
+{
+  auto& wheel = TimerWheel::shared();
+  const int64_t delaysMs[] = { 0, -1, -kLapMs, G_MININT64 };
+  const auto count = G_N_ELEMENTS(delaysMs);
+  int owner;
+  auto caller = std::this_thread::get_id();
+  atomic<unsigned> fired = 0;
+  atomic<unsigned> firedInline = 0;
+
+  auto start = g_get_monotonic_time();
+  for (auto delayMs : delaysMs) {
+    wheel.schedule(&owner, delayMs, [&] {
+      if (std::this_thread::get_id() == caller) {
+        firedInline++;
+      }
+      fired++;
+    });
+  }
+  wait_until_fired(fired, count);
+  g_assert_cmpuint(firedInline.load(), ==, 0);
+  g_assert_cmpint(g_get_monotonic_time() - start, <, kLatenessMs * 1000);
+  g_assert_cmpuint(wheel.pending(), ==, 0);
+}
+
+// A child forked while the parent's wheel has timers pending gets a wheel of
+// its own, which fires the child's timers and none of the parent's.
+static void
+test_forked_child (void)
+{
+  auto& parentWheel = TimerWheel::shared();
+  int owner;
+  atomic<unsigned> parentFired = 0;
+  parentWheel.schedule(&owner, 50, [&] { parentFired++; });
+
+  auto child = fork();
+  g_assert_cmpint(child, >=, 0);
+  if (child == 0) {
+    auto& wheel = TimerWheel::shared();
+    g_assert_true(&wheel != &parentWheel);
+    g_assert_true(&TimerWheel::shared() == &wheel);
+    atomic<unsigned> fired = 0;
+    wheel.schedule(&owner, 1, [&] { fired++; });
+    wait_until_fired(fired, 1);
+    g_usleep(100000);
+    g_assert_cmpuint(parentFired.load(), ==, 0);
+    _exit(0);
+  }
+
+  int status;
+  g_assert_cmpint(waitpid(child, &status, 0), ==, child);
+  g_assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  wait_until_fired(parentFired, 1);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  g_autofree gchar *slack = g_strdup_printf("%" G_GINT64_FORMAT, kSlackMs);
+  g_setenv("WIDEVINE_CDM_TIMER_SLACK_MS", slack, TRUE);
+
+  test_slot_wrap ();
+  test_cancel_racing_fire ();
+  test_clamped_delays ();
+  test_forked_child ();
+  return 0;
+}
@@ -0,0 +1,201 @@
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "timer_wheel.h"
+
+using std::atomic;
+using std::lock_guard;
+using std::unique_lock;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+
+static mutex sharedLock;
+static atomic<TimerWheel*> sharedWheel = nullptr;
+
+// In a forked child, the wheel inherited from the parent is abandoned, as its
+// lock may be held by a thread that does not exist here, and the next call to
+// shared() creates one of its own.
+void TimerWheel::abandonShared() {
+  if (auto wheel = sharedWheel.exchange(nullptr)) {
+#ifdef __linux__
+    close(wheel->timerFd);
+#endif
+  }
+  sharedLock.unlock();
+}
+
+TimerWheel& TimerWheel::shared() {
+  if (auto wheel = sharedWheel.load(std::memory_order_acquire)) {
+    return *wheel;
+  }
+  lock_guard guard(sharedLock);
+  if (auto wheel = sharedWheel.load()) {
+    return *wheel;
+  }
+  // Once per process tree: a child inherits the handlers.
+  static std::once_flag atFork;
+  std::call_once(atFork, [] {
+    pthread_atfork(
+        [] { sharedLock.lock(); },
+        [] { sharedLock.unlock(); },
+        abandonShared
+    );
+  });
+
+  auto slack = kDefaultSlack;
+  const gchar *value = g_getenv("WIDEVINE_CDM_TIMER_SLACK_MS");
+  guint64 ms;
+  if (value && g_ascii_string_to_unsigned(value, 10, 1, 60000, &ms, nullptr)) {
+    slack = milliseconds(ms);
+  }
+  auto wheel = new TimerWheel(slack);
+  sharedWheel.store(wheel, std::memory_order_release);
+  return *wheel;
+}
+
+TimerWheel::TimerWheel(milliseconds slack)
+  : tick(std::max(slack, milliseconds(1)))
+  , origin(steady_clock::now()) {
+#ifdef __linux__
+  timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  g_assert(timerFd >= 0);
+#endif
+  worker = thread([this] { loop(); });
+  worker.detach();
+}
+
+void TimerWheel::schedule(
+    const void* owner,
+    int64_t delayMs,
+    function<void()> fire
+) {
+  auto due = steady_clock::now() + milliseconds(std::max<int64_t>(delayMs, 0)) - origin;
+  // Rounded up, so that a timer never fires early.
+  uint64_t deadline = (due + tick - nanoseconds(1)) / tick;
+
+  lock_guard guard(lock);
+  deadline = std::max(deadline, expiredTick + 1);
+  slots[deadline % kSlots].push_back({ deadline, owner, std::move(fire) });
+  count++;
+  if (!armedTick || deadline < armedTick) {
+    arm();
+  }
+}
+
+size_t TimerWheel::cancel(const void* owner) {
+  lock_guard guard(lock);
+  size_t cancelled = 0;
+  for (auto& slot : slots) {
+    cancelled += std::erase_if(slot, [owner](const Timer& timer) {
+      return timer.owner == owner;
+    });
+  }
+  count -= cancelled;
+  if (cancelled) {
+    arm();
+  }
+  return cancelled;
+}
+
+size_t TimerWheel::pending() {
+  lock_guard guard(lock);
+  return count;
+}
+
+uint64_t TimerWheel::currentTick() const {
+  return (steady_clock::now() - origin) / tick;
+}
+
+// Fires the timers in the slot of |tick| that are due by |expiredTick|.
+void TimerWheel::expire(uint64_t tick) {
+  auto& slot = slots[tick % kSlots];
+  for (size_t i = 0; i < slot.size();) {
+    if (slot[i].deadline > expiredTick) {
+      i++;
+      continue;
+    }
+    auto fire = std::move(slot[i].fire);
+    slot[i] = std::move(slot.back());
+    slot.pop_back();
+    count--;
+    fire();
+  }
+}
+
+// Sets the thread to wake up at the next tick that has a timer due.
+void TimerWheel::arm() {
+  uint64_t next = 0;
+  for (auto t = expiredTick + 1; count && t <= expiredTick + kSlots; t++) {
+    auto& slot = slots[t % kSlots];
+    if (std::any_of(slot.begin(), slot.end(), [t](const Timer& timer) {
+      return timer.deadline <= t;
+    })) {
+      next = t;
+      break;
+    }
+  }
+  if (count && !next) {
+    next = G_MAXUINT64;
+    for (auto& slot : slots) {
+      for (auto& timer : slot) {
+        next = std::min(next, timer.deadline);
+      }
+    }
+  }
+  armedTick = next;
+
+#ifdef __linux__
+  struct itimerspec spec = {};
+  if (next) {
+    auto at = duration_cast<nanoseconds>((origin + next * tick).time_since_epoch());
+    spec.it_value.tv_sec = duration_cast<seconds>(at).count();
+    spec.it_value.tv_nsec = (at % seconds(1)).count();
+  }
+  timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+#else
+  wakeup.notify_one();
+#endif
+}
+
+void TimerWheel::loop() {
+  for (;;) {
+#ifdef __linux__
+    uint64_t expirations;
+    if (read(timerFd, &expirations, sizeof(expirations)) < 0 && errno != EINTR) {
+      g_error("timerfd read failed: %s", g_strerror(errno));
+    }
+    lock_guard guard(lock);
+#else
+    unique_lock guard(lock);
+    if (armedTick) {
+      wakeup.wait_until(guard, origin + armedTick * tick);
+    } else {
+      wakeup.wait(guard);
+    }
+#endif
+    auto now = currentTick();
+    if (now <= expiredTick) {
+      continue;
+    }
+    // After a long stall every slot is visited once rather than every tick.
+    auto first = std::max(expiredTick + 1, now >= kSlots ? now - kSlots + 1 : 0);
+    expiredTick = now;
+    for (auto t = first; t <= now; t++) {
+      expire(t);
+    }
+    arm();
+  }
+}
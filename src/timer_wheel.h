@@ -0,0 +1,96 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#ifndef __linux__
+#include <condition_variable>
+#endif
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glib.h>
+
+using std::array;
+using std::function;
+using std::mutex;
+using std::thread;
+using std::vector;
+
+// One-shot timers for every system in the process, kept in a hashed timing
+// wheel and driven by a single thread. Deadlines are rounded up to the next
+// tick, so timers falling within the same |slack| expire in the same wakeup,
+// and the thread only wakes up for ticks that have something due.
+//
+// Expired timers run on the wheel thread with the wheel locked; they are
+// expected to hand the real work off (e.g. to a CdmExecutor) and must not call
+// back into the wheel.
+struct TimerWheel {
+  static constexpr size_t kSlots = 512;
+  static constexpr std::chrono::milliseconds kDefaultSlack { 10 };
+
+  // The wheel shared by all systems, with the slack set by
+  // WIDEVINE_CDM_TIMER_SLACK_MS. Never destroyed. A process forked from one
+  // that used the wheel gets a wheel of its own, since neither the thread nor
+  // the timers of the parent's wheel belong to it.
+  G_GNUC_INTERNAL
+  static TimerWheel& shared();
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Runs |fire| once |delayMs| have passed, unless cancelled first.
+  G_GNUC_INTERNAL
+  void schedule(const void* owner, int64_t delayMs, function<void()> fire);
+
+  // Drops every pending timer of |owner|. Once this returns none of them is
+  // running or will run. Returns how many were dropped.
+  G_GNUC_INTERNAL
+  size_t cancel(const void* owner);
+
+  G_GNUC_INTERNAL
+  size_t pending();
+
+ private:
+  G_GNUC_INTERNAL
+  explicit TimerWheel(std::chrono::milliseconds slack);
+
+  // Runs in a forked child, see shared().
+  G_GNUC_INTERNAL
+  static void abandonShared();
+
+  struct Timer {
+    uint64_t deadline;
+    const void* owner;
+    function<void()> fire;
+  };
+
+  G_GNUC_INTERNAL
+  uint64_t currentTick() const;
+  G_GNUC_INTERNAL
+  void expire(uint64_t tick);
+  G_GNUC_INTERNAL
+  void arm();
+  G_GNUC_INTERNAL
+  void loop();
+
+  const std::chrono::nanoseconds tick;
+  const std::chrono::steady_clock::time_point origin;
+
+  mutex lock;
+  array<vector<Timer>, kSlots> slots;
+  size_t count = 0;
+  // Every tick up to and including this one has been expired.
+  uint64_t expiredTick = 0;
+  // The tick the thread is set to wake up at, 0 if none.
+  uint64_t armedTick = 0;
+
+#ifdef __linux__
+  int timerFd = -1;
+#else
+  std::condition_variable wakeup;
+#endif
+  thread worker;
+};
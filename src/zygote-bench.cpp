@@ -0,0 +1,110 @@
+#include <glib.h>
+
+#include <cstdio>
+#include <cstring>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "open_cdm.h"
+#include "open_cdm_widevine.h"
+
+static const unsigned kWorkers = 8;
+static const uint8_t kInitData[] = { 0x00, 0x00, 0x00, 0x10 };
+
+static long
+pss_kib (pid_t pid)
+{
+  char path[64];
+  snprintf (path, sizeof (path), "/proc/%d/smaps_rollup", (int) pid);
+  FILE *smaps = fopen (path, "r");
+  if (!smaps)
+    return 0;
+  char line[256];
+  long pss = 0;
+  while (fgets (line, sizeof (line), smaps)) {
+    if (sscanf (line, "Pss: %ld kB", &pss) == 1)
+      break;
+  }
+  fclose (smaps);
+  return pss;
+}
+
+// Runs in the forked worker: brings up a system with one session, reports how
+// long that took and stays around until released, so that all workers are
+// alive while their PSS is taken.
+static void
+worker (int report, int release)
+{
+  static OpenCDMSessionCallbacks callbacks = {};
+  auto start = g_get_monotonic_time ();
+  g_assert_cmpint (opencdm_init (), ==, ERROR_NONE);
+  auto system = opencdm_create_system ("com.widevine.alpha");
+  g_assert_nonnull (system);
+  OpenCDMSession *session = nullptr;
+  g_assert_cmpint (opencdm_construct_session (system, Temporary, "cenc",
+      kInitData, sizeof (kInitData), nullptr, 0, &callbacks, nullptr,
+      &session), ==, ERROR_NONE);
+  gint64 elapsed = g_get_monotonic_time () - start;
+  g_assert_cmpint (write (report, &elapsed, sizeof (elapsed)), ==,
+      sizeof (elapsed));
+
+  char byte;
+  g_assert_cmpint (read (release, &byte, 1), ==, 1);
+  _exit (0);
+}
+
+static void
+run (const char *mode)
+{
+  int report[2], release[2];
+  g_assert_cmpint (pipe (report), ==, 0);
+  g_assert_cmpint (pipe (release), ==, 0);
+
+  pid_t workers[kWorkers];
+  for (auto i = 0U; i < kWorkers; i++) {
+    workers[i] = fork ();
+    g_assert_cmpint (workers[i], >=, 0);
+    if (workers[i] == 0)
+      worker (report[1], release[0]);
+  }
+
+  gint64 startUs = 0;
+  for (auto i = 0U; i < kWorkers; i++) {
+    gint64 elapsed;
+    g_assert_cmpint (read (report[0], &elapsed, sizeof (elapsed)), ==,
+        sizeof (elapsed));
+    startUs += elapsed;
+  }
+  long pss = 0;
+  for (auto i = 0U; i < kWorkers; i++)
+    pss += pss_kib (workers[i]);
+
+  for (auto i = 0U; i < kWorkers; i++)
+    g_assert_cmpint (write (release[1], "x", 1), ==, 1);
+  for (auto i = 0U; i < kWorkers; i++) {
+    int status;
+    g_assert_cmpint (waitpid (workers[i], &status, 0), ==, workers[i]);
+    g_assert (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+  }
+  close (report[0]);
+  close (report[1]);
+  close (release[0]);
+  close (release[1]);
+
+  g_print ("%-12s %u workers: start avg %" G_GINT64_FORMAT " us, pss avg %ld "
+      "KiB\n", mode, kWorkers, startUs / kWorkers, pss / kWorkers);
+}
+
+gint
+main (gint argc, gchar **argv)
+{
+  // Workers forked before anything is loaded each start from scratch.
+  run ("independent");
+
+  auto start = g_get_monotonic_time ();
+  g_assert_cmpint (opencdm_widevine_zygote_init (), ==, ERROR_NONE);
+  g_print ("zygote ready in %" G_GINT64_FORMAT " us\n",
+      g_get_monotonic_time () - start);
+  run ("zygote");
+  return 0;
+}